@@ -0,0 +1,191 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Allocation of large numeric buffers (trellises, model tables, counts).  */
+/* big_alloc() returns zeroed memory aligned to ALLOC_ALIGN bytes. Buffers */
+/* of at least g_hugepage_threshold bytes are mapped directly: with        */
+/* HUGEPAGES_THP the kernel is asked to back them with transparent huge    */
+/* pages (madvise), with HUGEPAGES_HUGETLB they are mapped from the huge   */
+/* page pool (MAP_HUGETLB), falling back to THP if the pool is empty.      */
+/* Memory from big_alloc() must be released with big_free().               */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#ifndef _WIN32
+ #include <sys/mman.h>
+ #include <unistd.h>
+#endif /* _WIN32 */
+
+#include "treba.h"
+
+extern int g_hugepages;
+extern size_t g_hugepage_threshold;
+extern int g_verbose;
+
+#define ALLOC_MALLOC  0
+#define ALLOC_MMAP    1
+#define ALLOC_HUGETLB 2
+
+/* Stored in the ALLOC_ALIGN bytes before each buffer */
+struct alloc_header {
+    void *base;
+    size_t size;
+    size_t mapsize;
+    int kind;
+};
+
+static char *alloc_kind_name[] = {"malloc", "thp", "hugetlb"};
+
+static void alloc_fail(size_t size) {
+    fprintf(stderr, "Out of memory allocating %zu bytes. Fatal.\n", size);
+    exit(1);
+}
+
+/* Size of huge pages (hugetlbfs pool and THP), from /proc/meminfo, or 0 */
+size_t big_alloc_hugepage_size(void) {
+    FILE *meminfo;
+    char line[256];
+    size_t kb = 0;
+    if ((meminfo = fopen("/proc/meminfo", "r")) == NULL)
+	return(0);
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+	if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+	    break;
+    }
+    fclose(meminfo);
+    return(kb << 10);
+}
+
+#ifndef _WIN32
+
+static void *alloc_map(size_t size, int *kind, size_t *mapsize) {
+    void *base = MAP_FAILED;
+    char *aligned;
+    size_t pagesize;
+#ifdef MAP_HUGETLB
+    if (*kind == ALLOC_HUGETLB) {
+	if ((pagesize = big_alloc_hugepage_size()) == 0)
+	    pagesize = 2 << 20;
+	*mapsize = (size + pagesize - 1) / pagesize * pagesize;
+	base = mmap(NULL, *mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED && g_verbose)
+	    fprintf(stderr, "No huge pages available from hugetlbfs for %zu bytes, using THP\n", size);
+    }
+#endif /* MAP_HUGETLB */
+    if (base == MAP_FAILED) {
+	*kind = ALLOC_MMAP;
+	/* Map one huge page extra and trim, so the buffer starts on a huge */
+	/* page boundary and all of it can be backed by huge pages          */
+	if ((pagesize = big_alloc_hugepage_size()) == 0)
+	    pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	*mapsize = (size + pagesize - 1) / pagesize * pagesize;
+	base = mmap(NULL, *mapsize + pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	    return(NULL);
+	aligned = (char *) (((uintptr_t) base + pagesize - 1) & ~((uintptr_t) pagesize - 1));
+	if (aligned > (char *) base)
+	    munmap(base, aligned - (char *) base);
+	if ((char *) base + pagesize > aligned)
+	    munmap(aligned + *mapsize, (char *) base + pagesize - aligned);
+	base = aligned;
+#ifdef MADV_HUGEPAGE
+	madvise(base, *mapsize, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    }
+    return(base);
+}
+
+/* Print the page size backing the mapping at ptr, from /proc/self/smaps */
+static void alloc_report(struct alloc_header *h) {
+    FILE *smaps;
+    char line[256];
+    uintptr_t start, end, addr = (uintptr_t) h->base;
+    size_t kernelpage = 0, anonhuge = 0, kb;
+    int inside = 0;
+    if ((smaps = fopen("/proc/self/smaps", "r")) == NULL)
+	return;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+	if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &start, &end) == 2 && strchr(line, ':') != NULL && strchr(line, '-') < strchr(line, ' ')) {
+	    if (inside)
+		break;
+	    inside = (addr >= start && addr < end);
+	} else if (inside) {
+	    if (sscanf(line, "KernelPageSize: %zu kB", &kb) == 1)
+		kernelpage = kb;
+	    if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+		anonhuge = kb;
+	}
+    }
+    fclose(smaps);
+    fprintf(stderr, "Buffer of %zu bytes (%s): page size %zu kB", h->size, alloc_kind_name[h->kind], kernelpage);
+    if (h->kind == ALLOC_MMAP)
+	fprintf(stderr, ", %zu kB in transparent huge pages", anonhuge);
+    fprintf(stderr, "\n");
+}
+
+#endif /* _WIN32 */
+
+void *big_alloc(size_t size) {
+    struct alloc_header *h;
+    char *base = NULL;
+    size_t mapsize = 0;
+    int kind = ALLOC_MALLOC;
+
+#ifndef _WIN32
+    if (g_hugepages != HUGEPAGES_OFF && size >= g_hugepage_threshold) {
+	kind = g_hugepages == HUGEPAGES_HUGETLB ? ALLOC_HUGETLB : ALLOC_MMAP;
+	/* Mapped memory is page aligned and zeroed; the header takes one ALLOC_ALIGN slot */
+	base = alloc_map(size + ALLOC_ALIGN, &kind, &mapsize);
+	if (base == NULL)
+	    kind = ALLOC_MALLOC;
+    }
+#endif /* _WIN32 */
+    if (kind == ALLOC_MALLOC) {
+	if ((base = calloc(1, size + 2 * ALLOC_ALIGN)) == NULL)
+	    alloc_fail(size);
+	/* First aligned address with room for the header */
+	h = (struct alloc_header *) (((uintptr_t) base + ALLOC_ALIGN) & ~((uintptr_t) ALLOC_ALIGN - 1));
+    } else {
+	h = (struct alloc_header *) base;
+    }
+    h->base = base;
+    h->size = size;
+    h->mapsize = mapsize;
+    h->kind = kind;
+    return((char *) h + ALLOC_ALIGN);
+}
+
+void big_free(void *ptr) {
+    struct alloc_header *h;
+    if (ptr == NULL)
+	return;
+    h = (struct alloc_header *) ((char *) ptr - ALLOC_ALIGN);
+#ifndef _WIN32
+    if (h->kind != ALLOC_MALLOC) {
+	if (g_verbose)
+	    alloc_report(h);
+	munmap(h->base, h->mapsize);
+	return;
+    }
+#endif /* _WIN32 */
+    free(h->base);
+}
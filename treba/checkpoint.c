@@ -0,0 +1,406 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Checkpoints of long training runs (--checkpoint) and resuming from     */
+/* them (--resume). A checkpoint is serialized into memory by the trainer */
+/* at the end of an iteration and written by a writer thread while the    */
+/* next iteration runs; if the previous one is still being written, the   */
+/* newer replaces the one waiting. Files are written to FILE.tmp and      */
+/* renamed, so FILE is always a complete checkpoint. The format is binary */
+/* in native byte order:                                                  */
+/*                                                                        */
+/*   "TREBACK1", algorithm, use_hmm, num_states, alphabet_size,           */
+/*   iteration, beta, loglikelihood, drand48() state, random() state,     */
+/*   weights, Gibbs burnin, lag, samplecount, chain, count tables,        */
+/*   --heldout best iteration, waiting, best and training loglikelihood,  */
+/*   best weights                                                         */
+/*                                                                        */
+/* where arrays are preceded by their length (uint64_t).                  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "treba.h"
+
+#define CHECKPOINT_MAGIC "TREBACK1"
+
+extern char *g_checkpoint_file;
+extern int g_checkpoint_every;
+extern PROB g_checkpoint_minutes;
+
+static struct {
+    int algorithm;
+    time_t last;               /* Time of the last checkpoint */
+    char *pending;             /* Serialized checkpoint waiting to be written */
+    size_t pending_size;
+    int running;               /* Writer thread started */
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ckpt = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+#ifndef _WIN32
+/* random() runs on one of these states once checkpointing or resuming   */
+/* starts, so that it can be saved and restored. setstate() stores the   */
+/* position in the state it leaves, so a restored state goes into the    */
+/* other one. The generator is moved onto them with its state as it is: */
+/* initstate() hands back the state in use (the default state that      */
+/* srandom() seeds, of CHECKPOINT_RANDSTATE bytes) with its position    */
+/* stored, which is copied and made current, so random() goes on with   */
+/* the same numbers as without checkpoints.                             */
+static char checkpoint_randstate[2][CHECKPOINT_RANDSTATE];
+static int checkpoint_randstate_active = -1;
+
+static void checkpoint_randstate_init(void) {
+    char *live;
+    if (checkpoint_randstate_active < 0) {
+	live = initstate(1, checkpoint_randstate[0], CHECKPOINT_RANDSTATE);
+	memcpy(checkpoint_randstate[1], live, CHECKPOINT_RANDSTATE);
+	setstate(checkpoint_randstate[1]);
+	checkpoint_randstate_active = 1;
+    }
+}
+#endif /* _WIN32 */
+
+/* Checkpoints of a run of -T algorithm are written every */
+/* g_checkpoint_every iterations or g_checkpoint_minutes  */
+void checkpoint_start(int algorithm) {
+    ckpt.algorithm = algorithm;
+    ckpt.last = time(NULL);
+#ifndef _WIN32
+    checkpoint_randstate_init();
+#endif /* _WIN32 */
+}
+
+int checkpoint_due(int iteration) {
+    if (g_checkpoint_file == NULL)
+	return(0);
+    if (g_checkpoint_every > 0 && iteration % g_checkpoint_every == 0)
+	return(1);
+    return(g_checkpoint_minutes > 0 && difftime(time(NULL), ckpt.last) >= g_checkpoint_minutes * 60);
+}
+
+/* The model's weights as in the checkpoint: WFSA transitions then final */
+/* states, HMM transitions then emissions                                */
+static size_t checkpoint_tables(struct wfsa *fsm, struct hmm *hmm, PROB **table, PROB **table2, size_t *n2) {
+    if (fsm != NULL) {
+	*table = fsm->state_table;
+	*table2 = fsm->final_table;
+	*n2 = fsm->num_states;
+	return((size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size);
+    }
+    *table = hmm->transition_table;
+    *table2 = hmm->emission_table;
+    *n2 = (size_t) hmm->num_states * hmm->alphabet_size;
+    return((size_t) hmm->num_states * hmm->num_states);
+}
+
+struct ckpt_buf {
+    char *data;
+    size_t size;
+    size_t max;
+};
+
+static void ckpt_put(struct ckpt_buf *b, const void *p, size_t n) {
+    if (b->size + n > b->max) {
+	b->max = (b->size + n) * 2;
+	b->data = realloc(b->data, b->max);
+    }
+    memcpy(b->data + b->size, p, n);
+    b->size += n;
+}
+
+static void ckpt_put_array(struct ckpt_buf *b, const void *p, size_t n, size_t size) {
+    uint64_t len = n;
+    ckpt_put(b, &len, sizeof(uint64_t));
+    ckpt_put(b, p, n * size);
+}
+
+static void *checkpoint_writer(void *arg) {
+    char *data, *tmpname;
+    size_t size;
+    FILE *f;
+    tmpname = malloc(strlen(g_checkpoint_file) + 5);
+    sprintf(tmpname, "%s.tmp", g_checkpoint_file);
+    pthread_mutex_lock(&ckpt.mutex);
+    for (;;) {
+	while (ckpt.pending == NULL && !ckpt.stop)
+	    pthread_cond_wait(&ckpt.cond, &ckpt.mutex);
+	if (ckpt.pending == NULL)
+	    break;
+	data = ckpt.pending;
+	size = ckpt.pending_size;
+	ckpt.pending = NULL;
+	pthread_mutex_unlock(&ckpt.mutex);
+	if ((f = fopen(tmpname, "wb")) == NULL || fwrite(data, 1, size, f) != size || fflush(f) != 0) {
+	    perror("Error writing checkpoint");
+	} else {
+#ifndef _WIN32
+	    fsync(fileno(f));
+#endif /* _WIN32 */
+	    fclose(f);
+	    f = NULL;
+	    if (rename(tmpname, g_checkpoint_file) != 0)
+		perror("Error writing checkpoint");
+	}
+	if (f != NULL)
+	    fclose(f);
+	free(data);
+	pthread_mutex_lock(&ckpt.mutex);
+    }
+    pthread_mutex_unlock(&ckpt.mutex);
+    free(tmpname);
+    return(NULL);
+}
+
+/* Serializes c, with the model and the state of the random number */
+/* generators, and hands it to the writer thread                   */
+void checkpoint_save(struct checkpoint *c, struct wfsa *fsm, struct hmm *hmm) {
+    struct ckpt_buf b = { NULL, 0, 0 };
+    PROB *table, *table2;
+    size_t n1, n2;
+    int i, header[5];
+    unsigned short zero[3] = { 0, 0, 0 }, *rand48;
+    struct wfsa *bestfsm;
+    struct hmm *besthmm;
+
+    ckpt_put(&b, CHECKPOINT_MAGIC, 8);
+    c->use_hmm = hmm != NULL;
+    c->num_states = fsm != NULL ? fsm->num_states : hmm->num_states;
+    c->alphabet_size = fsm != NULL ? fsm->alphabet_size : hmm->alphabet_size;
+    header[0] = ckpt.algorithm;
+    header[1] = c->use_hmm;
+    header[2] = c->num_states;
+    header[3] = c->alphabet_size;
+    header[4] = c->iteration;
+    ckpt_put(&b, header, sizeof(header));
+    ckpt_put(&b, &c->beta, sizeof(PROB));
+    ckpt_put(&b, &c->loglikelihood, sizeof(PROB));
+    rand48 = seed48(zero);
+    memcpy(c->rand48, rand48, sizeof(c->rand48));
+    seed48(c->rand48);
+    ckpt_put(&b, c->rand48, sizeof(c->rand48));
+#ifndef _WIN32
+    checkpoint_randstate_init();
+    setstate(checkpoint_randstate[checkpoint_randstate_active]); /* Stores the position */
+    memcpy(c->randstate, checkpoint_randstate[checkpoint_randstate_active], CHECKPOINT_RANDSTATE);
+#endif /* _WIN32 */
+    ckpt_put(&b, c->randstate, CHECKPOINT_RANDSTATE);
+    n1 = checkpoint_tables(fsm, hmm, &table, &table2, &n2);
+    ckpt_put_array(&b, table, n1, sizeof(PROB));
+    ckpt_put_array(&b, table2, n2, sizeof(PROB));
+    header[0] = c->burnin;
+    header[1] = c->lag;
+    header[2] = c->samplecount;
+    header[3] = c->num_count_tables;
+    ckpt_put(&b, header, 4 * sizeof(int));
+    ckpt_put_array(&b, c->chain, c->chain_length, sizeof(int));
+    for (i = 0; i < c->num_count_tables; i++)
+	ckpt_put_array(&b, c->count_tables[i], c->count_sizes[i], sizeof(unsigned int));
+    header[0] = c->heldout_best != NULL ? c->heldout_iter : 0;
+    header[1] = c->heldout_waiting;
+    ckpt_put(&b, header, 2 * sizeof(int));
+    ckpt_put(&b, &c->heldout_bestll, sizeof(PROB));
+    ckpt_put(&b, &c->heldout_trainll, sizeof(PROB));
+    n1 = n2 = 0;
+    if (c->heldout_best != NULL) {
+	bestfsm = c->use_hmm ? NULL : c->heldout_best;
+	besthmm = c->use_hmm ? c->heldout_best : NULL;
+	n1 = checkpoint_tables(bestfsm, besthmm, &table, &table2, &n2);
+    }
+    ckpt_put_array(&b, table, n1, sizeof(PROB));
+    ckpt_put_array(&b, table2, n2, sizeof(PROB));
+
+    pthread_mutex_lock(&ckpt.mutex);
+    free(ckpt.pending);
+    ckpt.pending = b.data;
+    ckpt.pending_size = b.size;
+    if (!ckpt.running) {
+	ckpt.stop = 0;
+	if (pthread_create(&ckpt.thread, NULL, &checkpoint_writer, NULL) != 0) {
+	    fprintf(stderr, "Error: could not create checkpoint thread\n");
+	    exit(1);
+	}
+	ckpt.running = 1;
+    }
+    pthread_cond_broadcast(&ckpt.cond);
+    pthread_mutex_unlock(&ckpt.mutex);
+    ckpt.last = time(NULL);
+}
+
+/* Waits until the last checkpoint is written */
+void checkpoint_finish(void) {
+    if (!ckpt.running)
+	return;
+    pthread_mutex_lock(&ckpt.mutex);
+    ckpt.stop = 1;
+    pthread_cond_broadcast(&ckpt.cond);
+    pthread_mutex_unlock(&ckpt.mutex);
+    pthread_join(ckpt.thread, NULL);
+    ckpt.running = 0;
+}
+
+static int ckpt_get(char **p, char *end, void *dest, size_t n) {
+    if ((size_t) (end - *p) < n)
+	return(0);
+    memcpy(dest, *p, n);
+    *p += n;
+    return(1);
+}
+
+static void *ckpt_get_array(char **p, char *end, size_t *n, size_t size) {
+    uint64_t len;
+    void *a;
+    if (!ckpt_get(p, end, &len, sizeof(uint64_t)) || len > (uint64_t) (end - *p) / size)
+	return(NULL);
+    *n = len;
+    a = malloc(len * size + 1);
+    ckpt_get(p, end, a, len * size);
+    return(a);
+}
+
+struct checkpoint *checkpoint_read(char *filename) {
+    struct checkpoint *c;
+    char *data, *p, *end;
+    size_t size;
+    int i, header[5];
+    FILE *f;
+
+    if ((f = fopen(filename, "rb")) == NULL) {
+	fprintf(stderr, "Error opening file '%s'\n", filename);
+	return(NULL);
+    }
+    fseek(f, 0L, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    data = malloc(size + 1);
+    if (fread(data, 1, size, f) != size) {
+	fclose(f);
+	free(data);
+	fprintf(stderr, "Error reading checkpoint '%s'\n", filename);
+	return(NULL);
+    }
+    fclose(f);
+    c = calloc(1, sizeof(struct checkpoint));
+    p = data;
+    end = data + size;
+    if (size < 8 || memcmp(data, CHECKPOINT_MAGIC, 8) != 0)
+	goto error;
+    p += 8;
+    if (!ckpt_get(&p, end, header, sizeof(header)))
+	goto error;
+    c->algorithm = header[0];
+    c->use_hmm = header[1];
+    c->num_states = header[2];
+    c->alphabet_size = header[3];
+    c->iteration = header[4];
+    if (!ckpt_get(&p, end, &c->beta, sizeof(PROB)) || !ckpt_get(&p, end, &c->loglikelihood, sizeof(PROB)) ||
+	!ckpt_get(&p, end, c->rand48, sizeof(c->rand48)) || !ckpt_get(&p, end, c->randstate, CHECKPOINT_RANDSTATE))
+	goto error;
+    if ((c->weights = ckpt_get_array(&p, end, &c->num_weights, sizeof(PROB))) == NULL ||
+	(c->weights2 = ckpt_get_array(&p, end, &c->num_weights2, sizeof(PROB))) == NULL)
+	goto error;
+    if (!ckpt_get(&p, end, header, 4 * sizeof(int)) || header[3] < 0 || header[3] > CHECKPOINT_MAX_TABLES)
+	goto error;
+    c->burnin = header[0];
+    c->lag = header[1];
+    c->samplecount = header[2];
+    c->num_count_tables = header[3];
+    if ((c->chain = ckpt_get_array(&p, end, &size, sizeof(int))) == NULL)
+	goto error;
+    c->chain_length = (int) size;
+    for (i = 0; i < c->num_count_tables; i++)
+	if ((c->count_tables[i] = ckpt_get_array(&p, end, &c->count_sizes[i], sizeof(unsigned int))) == NULL)
+	    goto error;
+    if (!ckpt_get(&p, end, header, 2 * sizeof(int)) || !ckpt_get(&p, end, &c->heldout_bestll, sizeof(PROB)) ||
+	!ckpt_get(&p, end, &c->heldout_trainll, sizeof(PROB)))
+	goto error;
+    c->heldout_iter = header[0];
+    c->heldout_waiting = header[1];
+    if ((c->heldout_weights = ckpt_get_array(&p, end, &c->num_heldout_weights, sizeof(PROB))) == NULL ||
+	(c->heldout_weights2 = ckpt_get_array(&p, end, &c->num_heldout_weights2, sizeof(PROB))) == NULL)
+	goto error;
+    free(data);
+    return(c);
+ error:
+    fprintf(stderr, "Error: '%s' is not a valid checkpoint\n", filename);
+    free(data);
+    checkpoint_destroy(c);
+    return(NULL);
+}
+
+/* A model of the checkpoint's size with its weights */
+void checkpoint_restore_model(struct checkpoint *c, struct wfsa **fsm, struct hmm **hmm) {
+    PROB *table, *table2;
+    size_t n1, n2;
+    if (!c->use_hmm)
+	*fsm = wfsa_init(c->num_states, c->alphabet_size);
+    else
+	*hmm = hmm_init(c->num_states, c->alphabet_size);
+    n1 = checkpoint_tables(c->use_hmm ? NULL : *fsm, c->use_hmm ? *hmm : NULL, &table, &table2, &n2);
+    if (n1 != c->num_weights || n2 != c->num_weights2) {
+	fprintf(stderr, "Error: checkpoint model does not match its size\n");
+	exit(1);
+    }
+    memcpy(table, c->weights, n1 * sizeof(PROB));
+    memcpy(table2, c->weights2, n2 * sizeof(PROB));
+}
+
+/* Copies the best --heldout model of the checkpoint into fsm or hmm, */
+/* which have the size of the checkpoint's model                       */
+void checkpoint_restore_heldout(struct checkpoint *c, struct wfsa *fsm, struct hmm *hmm) {
+    PROB *table, *table2;
+    size_t n1, n2;
+    n1 = checkpoint_tables(fsm, hmm, &table, &table2, &n2);
+    if (n1 != c->num_heldout_weights || n2 != c->num_heldout_weights2) {
+	fprintf(stderr, "Error: checkpoint held-out model does not match its size\n");
+	exit(1);
+    }
+    memcpy(table, c->heldout_weights, n1 * sizeof(PROB));
+    memcpy(table2, c->heldout_weights2, n2 * sizeof(PROB));
+}
+
+void checkpoint_restore_rng(struct checkpoint *c) {
+    seed48(c->rand48);
+#ifndef _WIN32
+    checkpoint_randstate_active = checkpoint_randstate_active == 0 ? 1 : 0;
+    memcpy(checkpoint_randstate[checkpoint_randstate_active], c->randstate, CHECKPOINT_RANDSTATE);
+    setstate(checkpoint_randstate[checkpoint_randstate_active]);
+#endif /* _WIN32 */
+}
+
+void checkpoint_destroy(struct checkpoint *c) {
+    int i;
+    if (c == NULL)
+	return;
+    free(c->weights);
+    free(c->weights2);
+    free(c->heldout_weights);
+    free(c->heldout_weights2);
+    free(c->chain);
+    for (i = 0; i < c->num_count_tables; i++)
+	free(c->count_tables[i]);
+    free(c);
+}
@@ -29,9 +29,7 @@
 #include <assert.h>
 #include <math.h>
 
-inline PROB log1plus_minimax(PROB x) {
-
-    static const double mm[61][5] = {
+static const double log1plus_mm[61][5] = {
 	//{1.0000000000000000000,0.50001046104880397131,0.086736084604588520792,0.00024467657550238233989,0.0015184462591259856854},
 		{1.000000294523528266023080641747018118200,5.000137983039909745599685077166821586592e-1,8.674565581413996689083361220979003743259e-2,2.535058752268224328526728558807895816915e-4,-1.516439960822520490434771183446816832550e-3},
 	{1.001540902819038643868034951278937150423,5.053932724630792281026719430573953839270e-1,9.398019953671193331596899635167916987335e-2,4.736317746519460505191161205702483284235e-3,-4.285606238356233021835429915032331912140e-4},
@@ -94,6 +92,9 @@ inline PROB log1plus_minimax(PROB x) {
 	{4.441718222138073850369447942491187321448e-13,2.958629470570710761933540111534370365459e-14,7.394916178896801286037976165702941221125e-16,8.219639968047704791288806932600800180116e-18,3.428082923607146688983887328733425427010e-20},
 	{2.372529312291007305416992289952648321370e-13,1.554503699235377778851416441800192491369e-14,3.821781113846198396276457417988564726094e-16,4.178381642495995370799785893038057035617e-18,1.714041461803573361668044501268528909826e-20},
 	{1.265921709274481217042301748631126620573e-13,8.160998460854488837838924972198941773707e-15,1.974080493999080210366980627204357045868e-16,2.123471650484069163148941014954164434567e-18,8.570207309017866851280474598597185316012e-21}};
+
+static inline PROB log1plus_minimax(PROB x) {
+    const double (*mm)[5] = log1plus_mm;
     int ptr;
     double xsq;
     ptr = -(int)(x);
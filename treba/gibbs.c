@@ -25,10 +25,13 @@
 #include <float.h>
 #include <math.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "treba.h"
 
 extern int g_alphabet_size;
+extern int g_cpu;
+extern struct checkpoint *g_resume;
 
 struct gibbs_state_chain *gibbs_init_fsm(struct observations *o, int num_states, int alphabet_size, int *obslen) {
     int i,j,*data;
@@ -128,6 +131,89 @@ struct gibbs_state_chain *gibbs_init_hmm(struct observations *o, int num_states,
 #define CsampledHMMemit(STATE, SYMBOL) (*((gibbs_sampled_counts_emit) + (alphabet_size * (STATE) + (SYMBOL))))
 #define CsampledHMMtrans(SOURCE_STATE, TARGET_STATE) (*((gibbs_sampled_counts_trans) + (num_states * (SOURCE_STATE) + (TARGET_STATE))))
 
+/* Current emission counts are symbol-major: the sampler reads all states for one symbol */
+#define CcurrHMMemit(STATE, SYMBOL) (*((gibbs_counts_emit) + (num_states * (SYMBOL) + (STATE))))
+#define CcurrHMMtrans(SOURCE_STATE, TARGET_STATE) (*((gibbs_counts_trans) + (num_states * (SOURCE_STATE) + (TARGET_STATE))))
+
+/* Sampling inner loops, one version per instruction set */
+
+#include "gibbs_kernel.h"
+#ifdef CPU_DISPATCH
+#define TARGET_AVX2
+#include "gibbs_kernel.h"
+#undef TARGET_AVX2
+#define TARGET_AVX512
+#include "gibbs_kernel.h"
+#undef TARGET_AVX512
+#endif /* CPU_DISPATCH */
+
+typedef PROB (*gibbs_weights_fsm_fn)(PROB *, uint32_t *, uint32_t *, int, int, int, int, int, int, PROB, PROB);
+typedef PROB (*gibbs_weights_hmm_fn)(PROB *, uint32_t *, uint32_t *, uint32_t *, int, int, int, int, int, PROB, PROB);
+
+static gibbs_weights_fsm_fn gibbs_weights_fsm_select(void) {
+#ifdef CPU_DISPATCH
+    if (g_cpu == CPU_AVX512) return(gibbs_weights_fsm_avx512);
+    if (g_cpu == CPU_AVX2)   return(gibbs_weights_fsm_avx2);
+#endif /* CPU_DISPATCH */
+    return(gibbs_weights_fsm);
+}
+
+static gibbs_weights_hmm_fn gibbs_weights_hmm_select(void) {
+#ifdef CPU_DISPATCH
+    if (g_cpu == CPU_AVX512) return(gibbs_weights_hmm_avx512);
+    if (g_cpu == CPU_AVX2)   return(gibbs_weights_hmm_avx2);
+#endif /* CPU_DISPATCH */
+    return(gibbs_weights_hmm);
+}
+
+/* Checkpoint of a sampler after iteration iterations (--checkpoint): the */
+/* states of the chain and the count tables                              */
+static void gibbs_checkpoint(struct wfsa *fsm, struct hmm *hmm, struct gibbs_state_chain *chain, int obslen, unsigned int **tables, size_t *sizes, int num_tables, int iteration, int burnin, int lag, int samplecount) {
+    struct checkpoint c;
+    int i;
+    memset(&c, 0, sizeof(struct checkpoint));
+    c.iteration = iteration;
+    c.burnin = burnin;
+    c.lag = lag;
+    c.samplecount = samplecount;
+    c.chain_length = obslen;
+    c.chain = malloc(sizeof(int) * obslen);
+    for (i = 0; i < obslen; i++)
+	c.chain[i] = (chain+i)->state;
+    c.num_count_tables = num_tables;
+    for (i = 0; i < num_tables; i++) {
+	c.count_tables[i] = tables[i];
+	c.count_sizes[i] = sizes[i];
+    }
+    checkpoint_save(&c, fsm, hmm);
+    free(c.chain);
+}
+
+/* Continues the run of g_resume (--resume) */
+static void gibbs_resume(struct gibbs_state_chain *chain, int obslen, unsigned int **tables, size_t *sizes, int num_tables, int *iteration, int *burnin, int *lag, int *samplecount) {
+    struct checkpoint *c = g_resume;
+    int i;
+    if (c->chain_length != obslen || c->num_count_tables != num_tables) {
+	fprintf(stderr, "Error: the checkpoint does not match the observations\n");
+	exit(1);
+    }
+    for (i = 0; i < num_tables; i++) {
+	if (c->count_sizes[i] != sizes[i]) {
+	    fprintf(stderr, "Error: the checkpoint does not match the observations\n");
+	    exit(1);
+	}
+	memcpy(tables[i], c->count_tables[i], sizes[i] * sizeof(unsigned int));
+    }
+    for (i = 0; i < obslen; i++)
+	(chain+i)->state = c->chain[i];
+    *iteration = c->iteration;
+    *burnin = c->burnin;
+    *lag = c->lag;
+    *samplecount = c->samplecount;
+    checkpoint_restore_rng(c);
+    g_resume = NULL;
+}
+
 struct hmm *gibbs_counts_to_hmm(struct hmm *hmm, unsigned int *gibbs_sampled_counts_trans, unsigned int *gibbs_sampled_counts_emit, unsigned int *gibbs_counts_sampled_states, int alphabet_size, int num_states, double beta_t, double beta_e) {
     int i, j;
     PROB newprob;
@@ -191,14 +277,17 @@ struct wfsa *gibbs_counts_to_wfsa(struct wfsa *fsm, unsigned int *gibbs_sampled_
 
 PROB gibbs_sampler_fsm(struct wfsa *fsm, struct observations *o, double beta, int num_states, int maxiter, int burnin, int lag) {
 
-    int i, j, k, l, obslen, alphabet_size, z, zprev, znext, a, aprev, indicator, newstate, samplecount, high, low, mid;
+    int i, j, l, obslen, alphabet_size, z, zprev, znext, a, aprev, newstate, samplecount, high, low, mid;
 
     uint32_t steps, *gibbs_counts, *gibbs_counts_states;
-    unsigned int *gibbs_sampled_counts, *gibbs_counts_sampled_states;
+    unsigned int *gibbs_sampled_counts, *gibbs_counts_sampled_states, *tables[3];
+    size_t sizes[3];
 
-    PROB ANbeta, g_k, g_sum, *current_prob, cointoss;
+    PROB ANbeta, g_sum, *current_prob, cointoss;
     struct gibbs_state_chain *chain;
-	
+    gibbs_weights_fsm_fn gibbs_weights;
+
+    gibbs_weights = gibbs_weights_fsm_select();
     alphabet_size = g_alphabet_size + 1; /* Use extra symbol for end-of-word (#) */
     /* Build initial array of states */
     chain = gibbs_init_fsm(o, num_states, g_alphabet_size, &obslen);
@@ -211,15 +300,28 @@ PROB gibbs_sampler_fsm(struct wfsa *fsm, struct observations *o, double beta, in
 
     current_prob = calloc(num_states, sizeof(PROB));
 
-    /* Accumulate initial counts from initial random sequence */
-    for (i = 0; i < obslen-1; i++) {
-	Ccurr( (chain+i)->state , (chain+i)->sym, (chain+i+1)->state )++;
-	gibbs_counts_states[(chain+i)->state]++;
+    tables[0] = gibbs_counts;
+    tables[1] = gibbs_counts_states;
+    tables[2] = gibbs_sampled_counts;
+    sizes[0] = sizes[2] = (size_t) num_states * num_states * alphabet_size;
+    sizes[1] = num_states;
+
+    i = 0;
+    samplecount = 1;
+    if (g_resume != NULL) {
+	gibbs_resume(chain, obslen, tables, sizes, 3, &i, &burnin, &lag, &samplecount);
+    } else {
+	/* Accumulate initial counts from initial random sequence */
+	for (i = 0; i < obslen-1; i++) {
+	    Ccurr( (chain+i)->state , (chain+i)->sym, (chain+i+1)->state )++;
+	    gibbs_counts_states[(chain+i)->state]++;
+	}
+	i = 0;
     }
 
     ANbeta = alphabet_size * num_states * beta;
 
-    for (i = 0, samplecount = 1, steps = 0; i < maxiter; i++) {
+    for (steps = 0; i < maxiter; i++) {
 	for (j = 0; j < obslen; j++) {
 	    if (j == 0 || ((chain+j-1)->sym == g_alphabet_size)) { /* Don't resample "initial" states, i.e. first */
 		continue;                                          /* state in chain, or states preceded by #     */
@@ -236,14 +338,8 @@ PROB gibbs_sampler_fsm(struct wfsa *fsm, struct observations *o, double beta, in
 	    Ccurr(z,a,znext)--;
 
 	    gibbs_counts_states[z]--;
-	    for (k = 0, g_sum = 0; k < num_states; k++) {
-		/* Sample */
-		indicator = (k == zprev && aprev == a && znext == k) ? 1 : 0;
-		g_k = (((double)Ccurr(k,a,znext)) + beta + indicator) * (((double)Ccurr(zprev,aprev,k)) + beta) / ((double)gibbs_counts_states[k] + ANbeta);
-		assert(g_k >= 0);
-		g_sum += g_k;
-		current_prob[k] = g_sum;
-	    }
+	    /* Sample */
+	    g_sum = gibbs_weights(current_prob, gibbs_counts, gibbs_counts_states, num_states, alphabet_size, a, aprev, zprev, znext, beta, ANbeta);
 
 	    /* Do #num_states-way weighted coin toss to select new state        */
 	    /* This is done by a binary search through the array current_prob[] */
@@ -288,8 +384,10 @@ PROB gibbs_sampler_fsm(struct wfsa *fsm, struct observations *o, double beta, in
 		gibbs_sampled_counts[l] = 0;
 	    }
 	}
-
+	if (checkpoint_due(i + 1))
+	    gibbs_checkpoint(fsm, NULL, chain, obslen, tables, sizes, 3, i + 1, burnin, lag, samplecount);
     }
+    checkpoint_finish();
 
     fsm = gibbs_counts_to_wfsa(fsm, gibbs_sampled_counts, gibbs_counts_sampled_states, alphabet_size, num_states, beta, ANbeta);
     free(chain);
@@ -304,16 +402,17 @@ PROB gibbs_sampler_fsm(struct wfsa *fsm, struct observations *o, double beta, in
 
 PROB gibbs_sampler_hmm(struct hmm *hmm, struct observations *o, double beta_e, double beta_t, int num_states, int maxiter, int burnin, int lag) {
 
-    #define CcurrHMMemit(STATE, SYMBOL) (*((gibbs_counts_emit) + (alphabet_size * (STATE) + (SYMBOL))))
-    #define CcurrHMMtrans(SOURCE_STATE, TARGET_STATE) (*((gibbs_counts_trans) + (num_states * (SOURCE_STATE) + (TARGET_STATE))))
-
-    int i, j, k, l, obslen, alphabet_size, z, zprev, znext, a, indicator, newstate, samplecount, high, low, mid;
+    int i, j, l, obslen, alphabet_size, z, zprev, znext, a, newstate, samplecount, high, low, mid;
 
     uint32_t steps, *gibbs_counts_trans, *gibbs_counts_emit, *gibbs_counts_states;
-    unsigned int *gibbs_sampled_counts_trans, *gibbs_sampled_counts_emit, *gibbs_counts_sampled_states;
+    unsigned int *gibbs_sampled_counts_trans, *gibbs_sampled_counts_emit, *gibbs_counts_sampled_states, *tables[5];
+    size_t sizes[5];
 
-    PROB g_k, g_sum, *current_prob, cointoss;
+    PROB g_sum, *current_prob, cointoss;
     struct gibbs_state_chain *chain;
+    gibbs_weights_hmm_fn gibbs_weights;
+
+    gibbs_weights = gibbs_weights_hmm_select();
 
     alphabet_size = g_alphabet_size;
 
@@ -330,18 +429,34 @@ PROB gibbs_sampler_hmm(struct hmm *hmm, struct observations *o, double beta_e, d
 
     current_prob = calloc(num_states, sizeof(PROB));
 
-    /* Accumulate initial counts from initial random sequence */
-    for (i = 0; i < obslen-1; i++) {
-	CcurrHMMtrans( (chain+i)->state, (chain+i+1)->state )++;
-	gibbs_counts_states[(chain+i)->state]++;
-    }
-    for (i = 0; i < obslen-1; i++) {
-      if ((chain+i)->sym >= 0) {
-	  CcurrHMMemit( (chain+i)->state, (chain+i)->sym)++;
-      }
+    tables[0] = gibbs_counts_trans;
+    tables[1] = gibbs_counts_emit;
+    tables[2] = gibbs_counts_states;
+    tables[3] = gibbs_sampled_counts_trans;
+    tables[4] = gibbs_sampled_counts_emit;
+    sizes[0] = sizes[3] = (size_t) num_states * num_states;
+    sizes[1] = sizes[4] = (size_t) num_states * alphabet_size;
+    sizes[2] = num_states;
+
+    i = 0;
+    samplecount = 1;
+    if (g_resume != NULL) {
+	gibbs_resume(chain, obslen, tables, sizes, 5, &i, &burnin, &lag, &samplecount);
+    } else {
+	/* Accumulate initial counts from initial random sequence */
+	for (i = 0; i < obslen-1; i++) {
+	    CcurrHMMtrans( (chain+i)->state, (chain+i+1)->state )++;
+	    gibbs_counts_states[(chain+i)->state]++;
+	}
+	for (i = 0; i < obslen-1; i++) {
+	    if ((chain+i)->sym >= 0) {
+		CcurrHMMemit( (chain+i)->state, (chain+i)->sym)++;
+	    }
+	}
+	i = 0;
     }
 
-    for (i = 0, samplecount = 1, steps = 0; i < maxiter; i++) {
+    for (steps = 0; i < maxiter; i++) {
 	for (j = 0; j < obslen; j++) {
 	    if ((chain+j)->sym < 0) {  /* Don't resample states INIT(0) or END(last state) */
 		continue;
@@ -358,17 +473,8 @@ PROB gibbs_sampler_hmm(struct hmm *hmm, struct observations *o, double beta_e, d
 	    CcurrHMMtrans(zprev,z)--;
 	    gibbs_counts_states[z]--;
 
-	    for (k = 1, g_sum = 0; k < num_states - 1; k++) {
-		/* Sample */
-		indicator = (k == zprev && znext == k) ? 1 : 0;
-		g_k = ((((double)CcurrHMMemit(k,a)) + beta_e) / (((double)gibbs_counts_states[k]) + alphabet_size * beta_e)) *
-		    (((((double)CcurrHMMtrans(zprev,k)) + beta_t) * (((double)CcurrHMMtrans(k,znext)) + indicator + beta_t)) /
-                      (((double)gibbs_counts_states[k]) + num_states * beta_t));
-
-		assert(g_k >= 0);
-		g_sum += g_k;
-		current_prob[k] = g_sum;
-	    }
+	    /* Sample */
+	    g_sum = gibbs_weights(current_prob, gibbs_counts_trans, gibbs_counts_emit, gibbs_counts_states, num_states, alphabet_size, a, zprev, znext, beta_e, beta_t);
 
 	    /* Do #num_states-way weighted coin toss to select new state        */
 	    /* This is done by a binary search through the array current_prob[] */
@@ -420,7 +526,10 @@ PROB gibbs_sampler_hmm(struct hmm *hmm, struct observations *o, double beta_e, d
 		gibbs_sampled_counts_emit[l] = 0;
 	    }
 	}
+	if (checkpoint_due(i + 1))
+	    gibbs_checkpoint(NULL, hmm, chain, obslen, tables, sizes, 5, i + 1, burnin, lag, samplecount);
     }
+    checkpoint_finish();
 
     hmm = gibbs_counts_to_hmm(hmm, gibbs_sampled_counts_trans, gibbs_sampled_counts_emit, gibbs_counts_sampled_states, alphabet_size, num_states, beta_t, beta_e);
 
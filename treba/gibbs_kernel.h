@@ -0,0 +1,67 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Inner loop of the collapsed Gibbs samplers: the cumulative (unnormalized) */
+/* probabilities of each state at one point in the chain. This file is a     */
+/* template included from gibbs.c once per instruction set (see              */
+/* trellis_kernel.h for the TARGET_AVX2/TARGET_AVX512 convention).           */
+
+#if defined(TARGET_AVX512)
+ #define GK_FN(NAME) NAME##_avx512
+ #define GK_ATTR     CPU_ATTR_AVX512
+#elif defined(TARGET_AVX2)
+ #define GK_FN(NAME) NAME##_avx2
+ #define GK_ATTR     CPU_ATTR_AVX2
+#else
+ #define GK_FN(NAME) NAME
+ #define GK_ATTR
+#endif
+
+GK_ATTR static PROB GK_FN(gibbs_weights_fsm)(PROB *current_prob, uint32_t *gibbs_counts, uint32_t *gibbs_counts_states, int num_states, int alphabet_size, int a, int aprev, int zprev, int znext, PROB beta, PROB ANbeta) {
+    int k, indicator;
+    PROB g_k, g_sum;
+    for (k = 0, g_sum = 0; k < num_states; k++) {
+	indicator = (k == zprev && aprev == a && znext == k) ? 1 : 0;
+	g_k = (((double)Ccurr(k,a,znext)) + beta + indicator) * (((double)Ccurr(zprev,aprev,k)) + beta) / ((double)gibbs_counts_states[k] + ANbeta);
+	assert(g_k >= 0);
+	g_sum += g_k;
+	current_prob[k] = g_sum;
+    }
+    return(g_sum);
+}
+
+GK_ATTR static PROB GK_FN(gibbs_weights_hmm)(PROB *current_prob, uint32_t *gibbs_counts_trans, uint32_t *gibbs_counts_emit, uint32_t *gibbs_counts_states, int num_states, int alphabet_size, int a, int zprev, int znext, PROB beta_e, PROB beta_t) {
+    int k, indicator;
+    uint32_t *emit;
+    PROB g_k, g_sum;
+    emit = gibbs_counts_emit + num_states * a;
+    for (k = 1, g_sum = 0; k < num_states - 1; k++) {
+	indicator = (k == zprev && znext == k) ? 1 : 0;
+	g_k = ((((double)emit[k]) + beta_e) / (((double)gibbs_counts_states[k]) + alphabet_size * beta_e)) *
+	    (((((double)CcurrHMMtrans(zprev,k)) + beta_t) * (((double)CcurrHMMtrans(k,znext)) + indicator + beta_t)) /
+	     (((double)gibbs_counts_states[k]) + num_states * beta_t));
+	assert(g_k >= 0);
+	g_sum += g_k;
+	current_prob[k] = g_sum;
+    }
+    return(g_sum);
+}
+
+#undef GK_FN
+#undef GK_ATTR
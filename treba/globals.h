@@ -11,15 +11,46 @@ PROB g_viterbi_pseudocount = 1;
 PROB g_viterbi_pseudocount_emit = 1;
 int g_random_restarts = 0;
 int g_random_restart_iterations = 3;
+int g_random_restarts_parallel = 1; /* Restarts run at once, see --restarts */
+int g_restart_halving = 0;          /* Successive halving factor, see --halving */
 int g_generate_type = 0;
 int g_gen_max_length = 100000;
 int g_num_states = 5;
 int g_alphabet_size = -1;
 int g_initialize_uniform = 0;
 int g_train_da_bw = 0;
+int g_online_batch = 1000;          /* Mini-batch size of online EM, see --online */
+PROB g_online_alpha = 0.7;          /* Step size exponent of online EM */
+int g_incremental_shards = 0;       /* Shards of incremental EM, see --incremental */
+size_t g_stream_chunk = 0;          /* Bytes read at a time with --stream, 0 if off */
+int g_squarem = 0;                  /* Accelerate Baum-Welch with SQUAREM, see --squarem */
+char *g_checkpoint_file = NULL;     /* Written by --checkpoint, NULL if off */
+int g_checkpoint_every = 10;        /* Iterations between checkpoints */
+PROB g_checkpoint_minutes = 0;      /* Minutes between checkpoints, 0 = off */
+struct checkpoint *g_resume = NULL; /* Checkpoint the run continues, see --resume */
+struct observations *g_heldout = NULL; /* Held-out observations for early stopping, see --heldout */
+int g_heldout_patience = 5;         /* Iterations without held-out improvement before stopping */
 int g_generate_words = 0;
+int g_cpu = CPU_GENERIC;  /* Instruction set of the kernels in use, set by cpu_detect() */
+char *g_jit_cachedir = NULL; /* Non-NULL if likelihoods use compiled model-specific scorers */
+int g_threshold_mode = 0;    /* THRESHOLD_ACCEPT/THRESHOLD_PRINT_PROB with --threshold */
+PROB g_threshold = 0;        /* Cutoff for --threshold, log2 once options are parsed */
+int g_kbest = 1;             /* Number of paths for --decode=vit,k=N */
+int g_hugepages = HUGEPAGES_THP;          /* How big_alloc() maps large buffers, see --hugepages */
+size_t g_hugepage_threshold = 2 << 20;    /* Smallest buffer mapped with huge pages */
+int g_verbose = 0;
+int g_quantize = 0;           /* Bits per weight of the quantized model for --quantize, 0 = off */
+int g_quantize_check = 0;     /* Observations also scored at full precision with --quantize */
+#if defined(LOG_LUT)
+int g_logadd = LOGADD_TABLE; /* log2(1+2^x) approximation in log_add(), see --logadd */
+#elif defined(LOG_LIB)
+int g_logadd = LOGADD_LIB;
+#else
+int g_logadd = LOGADD_MINIMAX;
+#endif
 /* Thread variables */
 int g_num_threads = 1;
+int g_pin_threads = 0;        /* Pin each thread to a CPU, see --pin-threads */
 /* Deterministic annealing default parameters */
 PROB g_betamin = 0.02;
 PROB g_betamax = 1;
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <float.h>
 #include "treba.h"
 
@@ -42,8 +43,12 @@ PROB output_convert(PROB x) {
 }
 
 PROB input_convert(PROB x) {
+    return(format_to_log2(x, g_input_format));
+}
+
+PROB format_to_log2(PROB x, int format) {
     /* Internal format is log2 */
-    switch (g_input_format) {
+    switch (format) {
         case FORMAT_LOG2:   return(x);
         case FORMAT_LOG10:  return(3.32192809488736234787 * x);
         case FORMAT_LN:     return(1.44269504088896340736 * x);
@@ -164,6 +169,23 @@ int line_count_elements(char **ptr) {
     return(elements);
 }
 
+/* sscanf() a line of a file in memory; next is the start of the next line */
+/* as set by line_count_elements(). The line is terminated while scanning, */
+/* since sscanf() may otherwise take the length of the whole buffer.       */
+int line_sscanf(char *line, char *next, const char *format, ...) {
+    va_list ap;
+    int ret, terminated;
+    terminated = next > line && *(next-1) == '\n';
+    if (terminated)
+	*(next-1) = '\0';
+    va_start(ap, format);
+    ret = vsscanf(line, format, ap);
+    va_end(ap);
+    if (terminated)
+	*(next-1) = '\n';
+    return(ret);
+}
+
 char *line_to_int_array(char *ptr, int **line, int *size) {
     /* Reads (destructively) a line of integers (separated by non-integers) and returns a malloced array  */
     /* of numbers (ints) with the line in it + a size count, and also a pointer to the next line.         */
@@ -0,0 +1,456 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Model-specialized scorers: C source for forward/Viterbi likelihood with */
+/* the weights of one WFSA/HMM compiled in as constants (zero arcs removed, */
+/* loops over states and symbols unrolled) is compiled with the system      */
+/* compiler into a shared object and loaded with dlopen(). Objects are      */
+/* cached as <cachedir>/treba-jit-<hash>.so, keyed by a hash of the model,  */
+/* so a model is only compiled the first time it is used. The default      */
+/* cache directory is private to the user (see jit_default_cachedir()),    */
+/* and a cached object is only loaded if it belongs to the user and cannot */
+/* be written by anyone else.                                              */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+ #include <dlfcn.h>
+ #include <sys/wait.h>
+#endif
+
+#include "treba.h"
+
+#define JIT_VERSION   1        /* Bump when the generated code changes */
+#define JIT_MAX_TERMS 4000000  /* Refuse to generate larger scorers (weights in the code) */
+
+/* FNV-1a */
+static uint64_t jit_hash(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+	h ^= p[i];
+	h *= 0x100000001b3ULL;
+    }
+    return(h);
+}
+
+static uint64_t jit_hash_fsm(struct wfsa *fsm) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int header[4] = {JIT_VERSION, 0, fsm->num_states, fsm->alphabet_size};
+    h = jit_hash(h, header, sizeof(header));
+    h = jit_hash(h, fsm->state_table, sizeof(PROB) * fsm->num_states * fsm->num_states * fsm->alphabet_size);
+    h = jit_hash(h, fsm->final_table, sizeof(PROB) * fsm->num_states);
+    return(h);
+}
+
+static uint64_t jit_hash_hmm(struct hmm *hmm) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int header[4] = {JIT_VERSION, 1, hmm->num_states, hmm->alphabet_size};
+    h = jit_hash(h, header, sizeof(header));
+    h = jit_hash(h, hmm->transition_table, sizeof(PROB) * hmm->num_states * hmm->num_states);
+    h = jit_hash(h, hmm->emission_table, sizeof(PROB) * hmm->num_states * hmm->alphabet_size);
+    return(h);
+}
+
+static void jit_emit_prologue(FILE *f, int num_states) {
+    fprintf(f, "/* Generated by treba: model-specialized scorer */\n");
+    fprintf(f, "#include <math.h>\n#include <float.h>\n\n");
+    fprintf(f, "#define N %i\n", num_states);
+    fprintf(f, "#define NEG (-HUGE_VAL)\n");
+    fprintf(f, "#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))\n\n");
+    /* Forward scores are computed with reals, rescaling every column */
+    fprintf(f, "static int rescale(double *a, double *b, double *logscale) {\n");
+    fprintf(f, "    double sum = 0.0;\n    int s;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) sum += b[s];\n");
+    fprintf(f, "    if (sum <= 0.0) return 0;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) a[s] = b[s] / sum;\n");
+    fprintf(f, "    *logscale += log2(sum);\n    return 1;\n}\n\n");
+}
+
+static int jit_emit_fsm(FILE *f, struct wfsa *fsm) {
+    int s, t, sym, first;
+    size_t k, terms;
+    PROB w;
+    int N = fsm->num_states;
+
+    for (k = 0, terms = 0; k < (size_t) N * N * fsm->alphabet_size; k++) {
+	if (fsm->state_table[k] > SMRZERO_LOG)
+	    terms++;
+    }
+    if (terms > JIT_MAX_TERMS)
+	return(0);
+
+    jit_emit_prologue(f, N);
+
+    /* Forward */
+    fprintf(f, "double treba_jit_forward(int *obs, int length) {\n");
+    fprintf(f, "    double a[N], b[N], sum, logscale = 0.0;\n    int i, s;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) a[s] = 0.0;\n    a[0] = 1.0;\n");
+    fprintf(f, "    for (i = 0; i < length; i++) {\n\tswitch (obs[i]) {\n");
+    for (sym = 0; sym < fsm->alphabet_size; sym++) {
+	fprintf(f, "\tcase %i:\n", sym);
+	for (t = 0; t < N; t++) {
+	    fprintf(f, "\t    b[%i] = ", t);
+	    for (s = 0, first = 1; s < N; s++) {
+		if ((w = *TRANSITION(fsm, s, sym, t)) <= SMRZERO_LOG) { continue; }
+		fprintf(f, "%sa[%i]*%.17g", first ? "" : " + ", s, EXP(w));
+		first = 0;
+	    }
+	    fprintf(f, "%s;\n", first ? "0.0" : "");
+	}
+	fprintf(f, "\t    break;\n");
+    }
+    fprintf(f, "\tdefault:\n\t    return -DBL_MAX;\n\t}\n");
+    fprintf(f, "\tif (!rescale(a, b, &logscale)) return -DBL_MAX;\n    }\n");
+    fprintf(f, "    sum = 0.0");
+    for (s = 0; s < N; s++) {
+	if ((w = *FINALPROB(fsm, s)) > SMRZERO_LOG)
+	    fprintf(f, " + a[%i]*%.17g", s, EXP(w));
+    }
+    fprintf(f, ";\n    return sum > 0.0 ? log2(sum) + logscale : -DBL_MAX;\n}\n\n");
+
+    /* Viterbi */
+    fprintf(f, "double treba_jit_viterbi(int *obs, int length) {\n");
+    fprintf(f, "    double a[N], b[N], best;\n    int i, s;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) a[s] = NEG;\n    a[0] = 0.0;\n");
+    fprintf(f, "    for (i = 0; i < length; i++) {\n\tswitch (obs[i]) {\n");
+    for (sym = 0; sym < fsm->alphabet_size; sym++) {
+	fprintf(f, "\tcase %i:\n", sym);
+	for (t = 0; t < N; t++) {
+	    fprintf(f, "\t    b[%i] = NEG;\n", t);
+	    for (s = 0; s < N; s++) {
+		if ((w = *TRANSITION(fsm, s, sym, t)) <= SMRZERO_LOG) { continue; }
+		fprintf(f, "\t    b[%i] = MAX(b[%i], a[%i] + %.17g);\n", t, t, s, w);
+	    }
+	}
+	fprintf(f, "\t    break;\n");
+    }
+    fprintf(f, "\tdefault:\n\t    return -DBL_MAX;\n\t}\n");
+    fprintf(f, "\tfor (s = 0; s < N; s++) a[s] = b[s];\n    }\n");
+    fprintf(f, "    best = NEG;\n");
+    for (s = 0; s < N; s++) {
+	if ((w = *FINALPROB(fsm, s)) > SMRZERO_LOG)
+	    fprintf(f, "    best = MAX(best, a[%i] + %.17g);\n", s, w);
+    }
+    fprintf(f, "    return best == NEG ? -DBL_MAX : best;\n}\n");
+    return(1);
+}
+
+static int jit_emit_hmm(FILE *f, struct hmm *hmm) {
+    int s, t, sym, first, end;
+    size_t k, terms;
+    PROB w;
+    int N = hmm->num_states;
+
+    /* The transitions, and the two emission tables of N x |alphabet| */
+    terms = 2 * (size_t) N * hmm->alphabet_size;
+    for (k = 0; k < (size_t) N * N; k++) {
+	if (hmm->transition_table[k] > SMRZERO_LOG)
+	    terms++;
+    }
+    if (terms > JIT_MAX_TERMS)
+	return(0);
+    end = N - 1;
+
+    jit_emit_prologue(f, N);
+
+    /* Emission tables, symbol-major */
+    fprintf(f, "static const double E[%i][N] = {\n", hmm->alphabet_size);
+    for (sym = 0; sym < hmm->alphabet_size; sym++) {
+	fprintf(f, "    {");
+	for (t = 0; t < N; t++) {
+	    w = *HMM_EMISSION_PROB(hmm, t, sym);
+	    fprintf(f, "%.17g%s", (t == 0 || t == end || w <= SMRZERO_LOG) ? 0.0 : EXP(w), t < N - 1 ? "," : "");
+	}
+	fprintf(f, "}%s\n", sym < hmm->alphabet_size - 1 ? "," : "");
+    }
+    fprintf(f, "};\n");
+    fprintf(f, "static const double LE[%i][N] = {\n", hmm->alphabet_size);
+    for (sym = 0; sym < hmm->alphabet_size; sym++) {
+	fprintf(f, "    {");
+	for (t = 0; t < N; t++) {
+	    w = *HMM_EMISSION_PROB(hmm, t, sym);
+	    if (t == 0 || t == end || w <= SMRZERO_LOG)
+		fprintf(f, "NEG%s", t < N - 1 ? "," : "");
+	    else
+		fprintf(f, "%.17g%s", w, t < N - 1 ? "," : "");
+	}
+	fprintf(f, "}%s\n", sym < hmm->alphabet_size - 1 ? "," : "");
+    }
+    fprintf(f, "};\n\n");
+
+    /* Forward */
+    fprintf(f, "double treba_jit_forward(int *obs, int length) {\n");
+    fprintf(f, "    double a[N], b[N], sum, logscale = 0.0;\n    const double *e;\n    int i, s;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) a[s] = b[s] = 0.0;\n    a[0] = 1.0;\n");
+    fprintf(f, "    for (i = 0; i < length; i++) {\n");
+    fprintf(f, "\tif (obs[i] < 0 || obs[i] >= %i) return -DBL_MAX;\n", hmm->alphabet_size);
+    fprintf(f, "\te = E[obs[i]];\n");
+    for (t = 1; t < end; t++) {
+	fprintf(f, "\tb[%i] = e[%i] * (", t, t);
+	for (s = 0, first = 1; s < end; s++) {
+	    if ((w = *HMM_TRANSITION_PROB(hmm, s, t)) <= SMRZERO_LOG) { continue; }
+	    fprintf(f, "%sa[%i]*%.17g", first ? "" : " + ", s, EXP(w));
+	    first = 0;
+	}
+	fprintf(f, "%s);\n", first ? "0.0" : "");
+    }
+    fprintf(f, "\tif (!rescale(a, b, &logscale)) return -DBL_MAX;\n    }\n");
+    fprintf(f, "    sum = 0.0");
+    for (s = 0; s < end; s++) {
+	if ((w = *HMM_TRANSITION_PROB(hmm, s, end)) > SMRZERO_LOG)
+	    fprintf(f, " + a[%i]*%.17g", s, EXP(w));
+    }
+    fprintf(f, ";\n    return sum > 0.0 ? log2(sum) + logscale : -DBL_MAX;\n}\n\n");
+
+    /* Viterbi */
+    fprintf(f, "double treba_jit_viterbi(int *obs, int length) {\n");
+    fprintf(f, "    double a[N], b[N], m, best;\n    const double *e;\n    int i, s;\n");
+    fprintf(f, "    for (s = 0; s < N; s++) a[s] = b[s] = NEG;\n    a[0] = 0.0;\n");
+    fprintf(f, "    for (i = 0; i < length; i++) {\n");
+    fprintf(f, "\tif (obs[i] < 0 || obs[i] >= %i) return -DBL_MAX;\n", hmm->alphabet_size);
+    fprintf(f, "\te = LE[obs[i]];\n");
+    for (t = 1; t < end; t++) {
+	fprintf(f, "\tm = NEG;\n");
+	for (s = 0; s < end; s++) {
+	    if ((w = *HMM_TRANSITION_PROB(hmm, s, t)) <= SMRZERO_LOG) { continue; }
+	    fprintf(f, "\tm = MAX(m, a[%i] + %.17g);\n", s, w);
+	}
+	fprintf(f, "\tb[%i] = m + e[%i];\n", t, t);
+    }
+    fprintf(f, "\tfor (s = 0; s < N; s++) a[s] = b[s];\n    }\n");
+    fprintf(f, "    best = NEG;\n");
+    for (s = 0; s < end; s++) {
+	if ((w = *HMM_TRANSITION_PROB(hmm, s, end)) > SMRZERO_LOG)
+	    fprintf(f, "    best = MAX(best, a[%i] + %.17g);\n", s, w);
+    }
+    fprintf(f, "    return best == NEG ? -DBL_MAX : best;\n}\n");
+    return(1);
+}
+
+#ifndef _WIN32
+
+/* Creates dir (mode 0700) if missing; returns 0 unless it is then a */
+/* directory of the user's that only the user can access             */
+static int jit_private_dir(char *dir) {
+    struct stat st;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+	return(0);
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+	fprintf(stderr, "JIT: '%s' is not a private directory of the user\n", dir);
+	return(0);
+    }
+    return(1);
+}
+
+/* Cache directory of --jit without DIR: $XDG_CACHE_HOME/treba-jit,    */
+/* $HOME/.cache/treba-jit or, without a home directory,                */
+/* $TMPDIR/treba-jit-<uid>, created mode 0700. NULL if it is not private */
+char *jit_default_cachedir(void) {
+    char *base, *dir;
+    size_t len;
+    if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] == '/') {
+	len = strlen(base) + 16;
+	dir = malloc(len);
+	snprintf(dir, len, "%s/treba-jit", base);
+    } else if ((base = getenv("HOME")) != NULL && base[0] == '/') {
+	len = strlen(base) + 24;
+	dir = malloc(len);
+	snprintf(dir, len, "%s/.cache", base);
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+	    free(dir);
+	    return(NULL);
+	}
+	snprintf(dir, len, "%s/.cache/treba-jit", base);
+    } else {
+	if ((base = getenv("TMPDIR")) == NULL)
+	    base = "/tmp";
+	len = strlen(base) + 40;
+	dir = malloc(len);
+	snprintf(dir, len, "%s/treba-jit-%lu", base, (unsigned long) getuid());
+    }
+    if (!jit_private_dir(dir)) {
+	free(dir);
+	return(NULL);
+    }
+    return(dir);
+}
+
+/* Loads sofile if it is a regular file owned by the user and not writable */
+/* by group or others; it is loaded through the descriptor checked where   */
+/* /proc/self/fd exists, so it cannot be swapped in between                */
+static struct jit_scorer *jit_load(char *sofile) {
+    struct jit_scorer *js;
+    struct stat st;
+    void *handle;
+    char fdpath[64];
+    int fd;
+    if ((fd = open(sofile, O_RDONLY | O_NOFOLLOW)) < 0)
+	return(NULL);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+	fprintf(stderr, "JIT: not loading '%s': not owned by the user or writable by others\n", sofile);
+	close(fd);
+	return(NULL);
+    }
+    snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%i", fd);
+    handle = dlopen(access(fdpath, R_OK) == 0 ? fdpath : sofile, RTLD_NOW | RTLD_LOCAL);
+    close(fd);
+    if (handle == NULL) {
+	fprintf(stderr, "JIT: %s\n", dlerror());
+	return(NULL);
+    }
+    js = malloc(sizeof(struct jit_scorer));
+    js->handle = handle;
+    *(void **)(&js->forward) = dlsym(handle, "treba_jit_forward");
+    *(void **)(&js->viterbi) = dlsym(handle, "treba_jit_viterbi");
+    if (js->forward == NULL || js->viterbi == NULL) {
+	fprintf(stderr, "JIT: %s is not a treba scorer\n", sofile);
+	dlclose(handle);
+	free(js);
+	return(NULL);
+    }
+    return(js);
+}
+
+/* Runs $CC (default cc, a program name, not a shell command) on cfile */
+/* without a shell; returns 1 on success                               */
+static int jit_compile(char *cfile, char *sofile) {
+    char *cc, *argv[12];
+    pid_t pid;
+    int status;
+    if ((cc = getenv("CC")) == NULL || cc[0] == '\0')
+	cc = "cc";
+    argv[0] = cc;
+    argv[1] = "-O2";
+    argv[2] = "-fPIC";
+    argv[3] = "-shared";
+    argv[4] = "-o";
+    argv[5] = sofile;
+    argv[6] = "-x";
+    argv[7] = "c";
+    argv[8] = cfile;
+    argv[9] = "-lm";
+    argv[10] = NULL;
+    fflush(NULL);
+    if ((pid = fork()) < 0)
+	return(0);
+    if (pid == 0) {
+	execvp(cc, argv);
+	fprintf(stderr, "JIT: cannot run '%s'\n", cc);
+	_exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0)
+	if (errno != EINTR)
+	    return(0);
+    return(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static struct jit_scorer *jit_scorer(void *model, int use_hmm, uint64_t hash, char *cachedir) {
+    char *sofile, *cfile, *tmpfile;
+    size_t len;
+    FILE *f;
+    int ok, fd;
+    struct jit_scorer *js;
+
+    len = strlen(cachedir) + 64;
+    sofile = malloc(len);
+    cfile = malloc(len);
+    tmpfile = malloc(len);
+    snprintf(sofile, len, "%s/treba-jit-%016llx.so", cachedir, (unsigned long long) hash);
+    snprintf(cfile, len, "%s/treba-jit-%016llx.c.XXXXXX", cachedir, (unsigned long long) hash);
+    snprintf(tmpfile, len, "%s/treba-jit-%016llx.so.XXXXXX", cachedir, (unsigned long long) hash);
+
+    if ((js = jit_load(sofile)) != NULL)
+	goto out;
+    /* Source and object are written to fresh files of our own, and the */
+    /* object is renamed into place once complete                        */
+    if ((fd = mkstemp(cfile)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+	fprintf(stderr, "JIT: cannot write in '%s'\n", cachedir);
+	if (fd >= 0) {
+	    close(fd);
+	    remove(cfile);
+	}
+	goto out;
+    }
+    ok = use_hmm ? jit_emit_hmm(f, model) : jit_emit_fsm(f, model);
+    fclose(f);
+    if (!ok) {
+	fprintf(stderr, "JIT: model too large to specialize\n");
+	remove(cfile);
+	goto out;
+    }
+    if ((fd = mkstemp(tmpfile)) < 0) {
+	fprintf(stderr, "JIT: cannot write in '%s'\n", cachedir);
+	remove(cfile);
+	goto out;
+    }
+    close(fd);
+    fprintf(stderr, "JIT: compiling %s\n", cfile);
+    ok = jit_compile(cfile, tmpfile) && chmod(tmpfile, 0755) == 0 && rename(tmpfile, sofile) == 0;
+    remove(cfile);
+    if (!ok) {
+	fprintf(stderr, "JIT: compilation failed\n");
+	remove(tmpfile);
+	goto out;
+    }
+    js = jit_load(sofile);
+ out:
+    free(sofile);
+    free(cfile);
+    free(tmpfile);
+    return(js);
+}
+
+void jit_scorer_destroy(struct jit_scorer *js) {
+    dlclose(js->handle);
+    free(js);
+}
+
+#else
+
+char *jit_default_cachedir(void) {
+    return(".");
+}
+
+static struct jit_scorer *jit_scorer(void *model, int use_hmm, uint64_t hash, char *cachedir) {
+    fprintf(stderr, "JIT: not supported on this platform\n");
+    return(NULL);
+}
+
+void jit_scorer_destroy(struct jit_scorer *js) {
+    free(js);
+}
+
+#endif /* _WIN32 */
+
+struct jit_scorer *jit_scorer_fsm(struct wfsa *fsm, char *cachedir) {
+    return(jit_scorer(fsm, 0, jit_hash_fsm(fsm), cachedir));
+}
+
+struct jit_scorer *jit_scorer_hmm(struct hmm *hmm, char *cachedir) {
+    return(jit_scorer(hmm, 1, jit_hash_hmm(hmm), cachedir));
+}
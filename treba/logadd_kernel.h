@@ -0,0 +1,88 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Batch versions of the log2(1+2^x) approximations in fastlogexp.h, for   */
+/* arrays of differences x <= 0. As in log_add(), x <= -61 gives 0. The    */
+/* loops are branch-free so that the compiler vectorizes them (gathers for */
+/* the table lookups). This file is a template included from treba.c once  */
+/* per instruction set (see trellis_kernel.h for the TARGET_ convention).  */
+
+/* GCC's generic tuning turns off gather instructions, which the table */
+/* lookups need to vectorize, so the SIMD versions are tuned for a CPU  */
+/* that has fast gathers.                                               */
+
+#if defined(__GNUC__) && !defined(__clang__)
+ #define LK_TUNE_AVX2   __attribute__((target("tune=haswell")))
+ #define LK_TUNE_AVX512 __attribute__((target("tune=skylake-avx512")))
+#else
+ #define LK_TUNE_AVX2
+ #define LK_TUNE_AVX512
+#endif
+
+#if defined(TARGET_AVX512)
+ #define LK_FN(NAME) NAME##_avx512
+ #define LK_ATTR     CPU_ATTR_AVX512 LK_TUNE_AVX512
+#elif defined(TARGET_AVX2)
+ #define LK_FN(NAME) NAME##_avx2
+ #define LK_ATTR     CPU_ATTR_AVX2 LK_TUNE_AVX2
+#else
+ #define LK_FN(NAME) NAME
+ #define LK_ATTR
+#endif
+
+LK_ATTR void LK_FN(log1plus_minimax_batch)(PROB *restrict out, const PROB *restrict x, int n) {
+    int i, ptr;
+    PROB xc, xsq, r;
+    const double *mm = &log1plus_mm[0][0]; /* Flat indexing, or GCC won't gather */
+    for (i = 0; i < n; i++) {
+	xc = fmax(x[i], -60.9999);
+	ptr = -(int)(xc) * 5;
+	xsq = xc * xc;
+	r = mm[ptr+4]*xsq*xsq + (mm[ptr+3]*xc+mm[ptr+2]) * xsq + (mm[ptr+1] * xc + mm[ptr]);
+	out[i] = x[i] > -61 ? r : 0;
+    }
+}
+
+LK_ATTR void LK_FN(log1plus_table_batch)(PROB *restrict out, const PROB *restrict x, int n) {
+    int i, index;
+    PROB xc, w, val1, val2;
+    const PROB *table = g_logplustable;
+    for (i = 0; i < n; i++) {
+	xc = fmax(x[i], -60.9999);
+	index = -(int)(xc * LOGPLUSTABLETICKS);
+	w = -(xc * LOGPLUSTABLETICKS) - index;
+	val1 = table[index];
+	val2 = table[index+1];
+	out[i] = x[i] > -61 ? val1 + w * (val2-val1) : 0;
+    }
+}
+
+LK_ATTR void LK_FN(log1plus_lib_batch)(PROB *restrict out, const PROB *restrict x, int n) {
+    int i;
+    PROB xc;
+    for (i = 0; i < n; i++) {
+	xc = fmax(x[i], -60.9999);
+	out[i] = x[i] > -61 ? log2(exp2(xc)+1) : 0;
+    }
+}
+
+#undef LK_FN
+#undef LK_ATTR
+#undef LK_TUNE_AVX2
+#undef LK_TUNE_AVX512
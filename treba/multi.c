@@ -0,0 +1,454 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Scoring observations against several models in one run (-f given more */
+/* than once). Observations are read once and divided among threads, each */
+/* of which scores its observations against all models. With --batch,     */
+/* models with identical topology (same states, alphabet, and nonzero     */
+/* transitions) are scored together: the trellis holds one value per      */
+/* model in each cell, and the innermost loop runs over the models.       */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "treba.h"
+
+extern int g_verbose;
+extern int g_input_format;
+extern struct trellis_kernels *g_kernel;
+
+/* A group of models with identical topology, as a list of arcs per symbol */
+/* (an HMM arc s->t on symbol a has weight trans(s,t) * emit(t,a), and the */
+/* final weight of s is trans(s,end))                                      */
+struct model_batch {
+    int num_models;
+    int *models;          /* Indices of the models in the batch        */
+    int num_states;
+    int *arc_offset;      /* Arcs on symbol a: arc_offset[a] ... [a+1]-1 */
+    int *arc_source;
+    int *arc_target;
+    PROB *arc_weight;     /* [arc][model], reals or log2 (Viterbi)      */
+    PROB *final_weight;   /* [state][model], reals or log2 (Viterbi)    */
+};
+
+struct multi_thread_args {
+    struct multi_models *mm;
+    struct observations **obsarray;
+    struct model_batch *batches;
+    int num_batches;
+    struct sched *sched;  /* Hands out the observations, see pool.c */
+    int thread;
+    int algorithm;
+    PROB *results;        /* [observation][model] */
+};
+
+/* Weight of the arc source->target on symbol, SMRZERO_LOG if none */
+static PROB multi_arc(struct multi_models *mm, int m, int source, int symbol, int target) {
+    struct hmm *hmm;
+    int end_state;
+    if (!mm->use_hmm)
+	return(*TRANSITION(mm->fsms[m], source, symbol, target));
+    hmm = mm->hmms[m];
+    end_state = hmm->num_states - 1;
+    if (source == end_state || target == 0 || target == end_state)
+	return(SMRZERO_LOG);
+    if (*HMM_TRANSITION_PROB(hmm, source, target) <= SMRZERO_LOG || *HMM_EMISSION_PROB(hmm, target, symbol) <= SMRZERO_LOG)
+	return(SMRZERO_LOG);
+    return(*HMM_TRANSITION_PROB(hmm, source, target) + *HMM_EMISSION_PROB(hmm, target, symbol));
+}
+
+static PROB multi_final(struct multi_models *mm, int m, int state) {
+    struct hmm *hmm;
+    if (!mm->use_hmm)
+	return(*FINALPROB(mm->fsms[m], state));
+    hmm = mm->hmms[m];
+    if (state == hmm->num_states - 1)
+	return(SMRZERO_LOG);
+    return(*HMM_TRANSITION_PROB(hmm, state, hmm->num_states - 1));
+}
+
+static int multi_num_states(struct multi_models *mm, int m) {
+    return(mm->use_hmm ? mm->hmms[m]->num_states : mm->fsms[m]->num_states);
+}
+
+static int multi_alphabet_size(struct multi_models *mm, int m) {
+    return(mm->use_hmm ? mm->hmms[m]->alphabet_size : mm->fsms[m]->alphabet_size);
+}
+
+static int multi_same_topology(struct multi_models *mm, int m1, int m2) {
+    int s, t, a, N, A;
+    N = multi_num_states(mm, m1);
+    A = multi_alphabet_size(mm, m1);
+    if (N != multi_num_states(mm, m2) || A != multi_alphabet_size(mm, m2))
+	return(0);
+    for (s = 0; s < N; s++) {
+	if ((multi_final(mm, m1, s) > SMRZERO_LOG) != (multi_final(mm, m2, s) > SMRZERO_LOG))
+	    return(0);
+	for (a = 0; a < A; a++)
+	    for (t = 0; t < N; t++)
+		if ((multi_arc(mm, m1, s, a, t) > SMRZERO_LOG) != (multi_arc(mm, m2, s, a, t) > SMRZERO_LOG))
+		    return(0);
+    }
+    return(1);
+}
+
+/* Group models by topology; groups of one model are not batched */
+static struct model_batch *multi_make_batches(struct multi_models *mm, int algorithm, int *num_batches) {
+    struct model_batch *batches, *b;
+    int *group, m, m2, g, k, s, t, a, N, A, arc, numarcs;
+    PROB w;
+
+    group = malloc(sizeof(int) * mm->num_models);
+    for (m = 0; m < mm->num_models; m++)
+	group[m] = -1;
+    batches = malloc(sizeof(struct model_batch) * mm->num_models);
+    for (m = 0, g = 0; m < mm->num_models; m++) {
+	if (group[m] != -1) { continue; }
+	group[m] = g;
+	for (m2 = m + 1, k = 1; m2 < mm->num_models; m2++) {
+	    if (group[m2] == -1 && multi_same_topology(mm, m, m2)) {
+		group[m2] = g;
+		k++;
+	    }
+	}
+	if (k == 1) {
+	    group[m] = -2;
+	    continue;
+	}
+	b = &batches[g++];
+	b->num_models = k;
+	b->models = malloc(sizeof(int) * k);
+	for (m2 = m, k = 0; m2 < mm->num_models; m2++)
+	    if (group[m2] == group[m])
+		b->models[k++] = m2;
+	N = b->num_states = multi_num_states(mm, m);
+	A = multi_alphabet_size(mm, m);
+	for (s = 0, numarcs = 0; s < N; s++)
+	    for (a = 0; a < A; a++)
+		for (t = 0; t < N; t++)
+		    if (multi_arc(mm, m, s, a, t) > SMRZERO_LOG)
+			numarcs++;
+	b->arc_offset = malloc(sizeof(int) * (A + 1));
+	b->arc_source = malloc(sizeof(int) * numarcs);
+	b->arc_target = malloc(sizeof(int) * numarcs);
+	b->arc_weight = malloc(sizeof(PROB) * numarcs * b->num_models);
+	b->final_weight = malloc(sizeof(PROB) * N * b->num_models);
+	for (a = 0, arc = 0; a < A; a++) {
+	    b->arc_offset[a] = arc;
+	    for (s = 0; s < N; s++) {
+		for (t = 0; t < N; t++) {
+		    if (multi_arc(mm, m, s, a, t) <= SMRZERO_LOG) { continue; }
+		    b->arc_source[arc] = s;
+		    b->arc_target[arc] = t;
+		    for (k = 0; k < b->num_models; k++) {
+			w = multi_arc(mm, b->models[k], s, a, t);
+			b->arc_weight[arc * b->num_models + k] = algorithm == LIKELIHOOD_VITERBI ? w : EXP(w);
+		    }
+		    arc++;
+		}
+	    }
+	}
+	b->arc_offset[A] = arc;
+	for (s = 0; s < N; s++) {
+	    for (k = 0; k < b->num_models; k++) {
+		w = multi_final(mm, b->models[k], s);
+		if (algorithm == LIKELIHOOD_VITERBI)
+		    b->final_weight[s * b->num_models + k] = w;
+		else
+		    b->final_weight[s * b->num_models + k] = w <= SMRZERO_LOG ? 0 : EXP(w);
+	    }
+	}
+    }
+    free(group);
+    *num_batches = g;
+    return(batches);
+}
+
+/* Score one observation against all models of a batch at once. Forward */
+/* probabilities are calculated with reals, rescaling each model's part  */
+/* of a column to sum to one; Viterbi with max-plus on log2 weights.     */
+static void multi_batch_score(struct model_batch *b, int *obs, int length, int algorithm, PROB *col, PROB *next, PROB *aux, PROB *result) {
+    int i, k, s, t, arc, K, N;
+    PROB *w, *tmp, *logscale, *sum;
+
+    K = b->num_models;
+    N = b->num_states;
+    logscale = aux;
+    sum = aux + K;
+    if (algorithm == LIKELIHOOD_VITERBI) {
+	for (s = 0; s < N * K; s++)
+	    col[s] = SMRZERO_LOG;
+	for (k = 0; k < K; k++)
+	    col[k] = 0;
+	for (i = 0; i < length; i++) {
+	    for (s = 0; s < N * K; s++)
+		next[s] = SMRZERO_LOG;
+	    for (arc = b->arc_offset[obs[i]]; arc < b->arc_offset[obs[i]+1]; arc++) {
+		s = b->arc_source[arc] * K;
+		t = b->arc_target[arc] * K;
+		w = b->arc_weight + arc * K;
+		for (k = 0; k < K; k++)
+		    next[t+k] = next[t+k] > col[s+k] + w[k] ? next[t+k] : col[s+k] + w[k];
+	    }
+	    tmp = col; col = next; next = tmp;
+	}
+	for (k = 0; k < K; k++)
+	    result[k] = SMRZERO_LOG;
+	for (s = 0; s < N; s++) {
+	    for (k = 0; k < K; k++) {
+		if (b->final_weight[s*K+k] <= SMRZERO_LOG) { continue; }
+		result[k] = result[k] > col[s*K+k] + b->final_weight[s*K+k] ? result[k] : col[s*K+k] + b->final_weight[s*K+k];
+	    }
+	}
+	for (k = 0; k < K; k++)
+	    if (result[k] < SMRZERO_LOG / 2)
+		result[k] = SMRZERO_LOG;
+	return;
+    }
+
+    for (s = 0; s < N * K; s++)
+	col[s] = 0;
+    for (k = 0; k < K; k++) {
+	col[k] = 1;
+	logscale[k] = 0;
+    }
+    for (i = 0; i < length; i++) {
+	for (s = 0; s < N * K; s++)
+	    next[s] = 0;
+	for (arc = b->arc_offset[obs[i]]; arc < b->arc_offset[obs[i]+1]; arc++) {
+	    s = b->arc_source[arc] * K;
+	    t = b->arc_target[arc] * K;
+	    w = b->arc_weight + arc * K;
+	    for (k = 0; k < K; k++)
+		next[t+k] += col[s+k] * w[k];
+	}
+	for (k = 0; k < K; k++)
+	    sum[k] = 0;
+	for (s = 0; s < N; s++)
+	    for (k = 0; k < K; k++)
+		sum[k] += next[s*K+k];
+	for (k = 0; k < K; k++) {
+	    if (sum[k] > 0) {
+		logscale[k] += LOG(sum[k]);
+		sum[k] = 1 / sum[k];
+	    }
+	}
+	for (s = 0; s < N; s++)
+	    for (k = 0; k < K; k++)
+		next[s*K+k] *= sum[k];
+	tmp = col; col = next; next = tmp;
+    }
+    for (k = 0; k < K; k++)
+	result[k] = 0;
+    for (s = 0; s < N; s++)
+	for (k = 0; k < K; k++)
+	    result[k] += col[s*K+k] * b->final_weight[s*K+k];
+    for (k = 0; k < K; k++)
+	result[k] = result[k] > 0 ? LOG(result[k]) + logscale[k] : SMRZERO_LOG;
+}
+
+static PROB multi_score(struct multi_models *mm, int m, struct trellis *trellis, int *obs, int length, int algorithm) {
+    if (!mm->use_hmm) {
+	switch (algorithm) {
+	case LIKELIHOOD_VITERBI:        return(trellis_viterbi(trellis, obs, length, mm->fsms[m]));
+	case LIKELIHOOD_FORWARD_SCALED: return(g_kernel->forward_fsm_real(trellis, obs, length, mm->fsms[m]));
+	case LIKELIHOOD_BACKWARD:       return(trellis_backward(trellis, obs, length, mm->fsms[m]));
+	default:                        return(trellis_forward_fsm(trellis, obs, length, mm->fsms[m]));
+	}
+    }
+    switch (algorithm) {
+    case LIKELIHOOD_VITERBI:        return(trellis_viterbi_hmm(trellis, obs, length, mm->hmms[m]));
+    case LIKELIHOOD_FORWARD_SCALED: return(g_kernel->forward_hmm_real(trellis, obs, length, mm->hmms[m]));
+    case LIKELIHOOD_BACKWARD:       return(trellis_backward_hmm(trellis, obs, length, mm->hmms[m]));
+    default:                        return(trellis_forward_hmm(trellis, obs, length, mm->hmms[m]));
+    }
+}
+
+static void *multi_thread(void *threadargs) {
+    struct multi_thread_args *args;
+    struct multi_models *mm;
+    struct observations *obs;
+    struct model_batch *b;
+    struct trellis *trellis;
+    PROB *col, *next, *aux, *bresult, *results;
+    const int *idx;
+    int i, j, k, m, n, maxstates, maxbatch, *batched;
+
+    args = (struct multi_thread_args *) threadargs;
+    mm = args->mm;
+    for (m = 0, maxstates = 0; m < mm->num_models; m++)
+	maxstates = multi_num_states(mm, m) > maxstates ? multi_num_states(mm, m) : maxstates;
+    for (j = 0, maxbatch = 1; j < args->num_batches; j++)
+	maxbatch = args->batches[j].num_models > maxbatch ? args->batches[j].num_models : maxbatch;
+    batched = calloc(mm->num_models, sizeof(int));
+    for (j = 0; j < args->num_batches; j++)
+	for (k = 0; k < args->batches[j].num_models; k++)
+	    batched[args->batches[j].models[k]] = 1;
+
+    trellis = trellis_init(mm->o, maxstates);
+    col = malloc(sizeof(PROB) * maxstates * maxbatch);
+    next = malloc(sizeof(PROB) * maxstates * maxbatch);
+    aux = malloc(sizeof(PROB) * 2 * maxbatch);
+    bresult = malloc(sizeof(PROB) * maxbatch);
+
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (i = 0; i < n; i++) {
+	    obs = args->obsarray[idx[i]];
+	    results = args->results + (size_t) idx[i] * mm->num_models;
+	    for (j = 0; j < args->num_batches; j++) {
+		b = &args->batches[j];
+		multi_batch_score(b, obs->data, obs->size, args->algorithm, col, next, aux, bresult);
+		for (k = 0; k < b->num_models; k++)
+		    results[b->models[k]] = bresult[k];
+	    }
+	    for (m = 0; m < mm->num_models; m++) {
+		if (!batched[m])
+		    results[m] = multi_score(mm, m, trellis, obs->data, obs->size, args->algorithm);
+	    }
+	}
+    }
+    big_free(trellis);
+    free(col);
+    free(next);
+    free(aux);
+    free(bresult);
+    free(batched);
+    return(NULL);
+}
+
+/* Add a model file given with -f, or all files (one per line) listed in */
+/* the file named by an argument of the form @FILE                       */
+char **multi_files_add(char **files, int *num_files, char *arg) {
+    FILE *list;
+    char line[4096], *end;
+    if (arg[0] != '@') {
+	files = realloc(files, sizeof(char *) * (*num_files + 1));
+	files[(*num_files)++] = strdup(arg);
+	return(files);
+    }
+    if ((list = fopen(arg + 1, "r")) == NULL) {
+	fprintf(stderr, "Error opening model list '%s'\n", arg + 1);
+	exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), list) != NULL) {
+	for (end = line + strlen(line); end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'); end--)
+	    *(end - 1) = '\0';
+	if (line[0] == '\0') { continue; }
+	files = realloc(files, sizeof(char *) * (*num_files + 1));
+	files[(*num_files)++] = strdup(line);
+    }
+    fclose(list);
+    return(files);
+}
+
+struct multi_models *multi_models_read(char **files, int num_files, int use_hmm) {
+    struct multi_models *mm;
+    int m;
+    mm = malloc(sizeof(struct multi_models));
+    mm->num_models = num_files;
+    mm->use_hmm = use_hmm;
+    mm->fsms = use_hmm ? NULL : malloc(sizeof(struct wfsa *) * num_files);
+    mm->hmms = use_hmm ? malloc(sizeof(struct hmm *) * num_files) : NULL;
+    mm->o = NULL;
+    for (m = 0; m < num_files; m++) {
+	if (!use_hmm) {
+	    mm->fsms[m] = wfsa_read_file(files[m]);
+	    if (g_input_format != FORMAT_LOG2)
+		wfsa_to_log2(mm->fsms[m]);
+	} else {
+	    mm->hmms[m] = hmm_read_file(files[m]);
+	    if (g_input_format != FORMAT_LOG2)
+		hmm_to_log2(mm->hmms[m]);
+	    hmm_emission_columns(mm->hmms[m]);
+	}
+    }
+    return(mm);
+}
+
+/* Print one line per observation: the likelihood under each model, TAB-  */
+/* separated, or (MULTI_ARGMAX) the index of the best model (counting      */
+/* from 0 in the order the models were given) and its likelihood           */
+void multi_likelihood(struct multi_models *mm, struct observations *o, int algorithm, int output, int batch) {
+    struct multi_thread_args *threadargs, **args;
+    struct observations **obsarray;
+    struct model_batch *batches;
+    struct sched *sched;
+    PROB *results, *r;
+    int i, m, best, numobs, num_batches, num_threads;
+
+    mm->o = o;
+    obsarray = observations_to_array(o, &numobs);
+    if (numobs == 0)
+	return;
+    results = malloc(sizeof(PROB) * (size_t) numobs * mm->num_models);
+    num_batches = 0;
+    batches = NULL;
+    if (batch && algorithm != LIKELIHOOD_BACKWARD)
+	batches = multi_make_batches(mm, algorithm, &num_batches);
+
+    /* The observations are shared out by the scheduler over the pool */
+    num_threads = pool_threads() > numobs ? numobs : pool_threads();
+    sched = sched_create(obsarray, numobs, num_threads);
+    threadargs = malloc(sizeof(struct multi_thread_args) * num_threads);
+    args = malloc(sizeof(struct multi_thread_args *) * num_threads);
+    for (i = 0; i < num_threads; i++) {
+	args[i] = &threadargs[i];
+	threadargs[i].mm = mm;
+	threadargs[i].obsarray = obsarray;
+	threadargs[i].batches = batches;
+	threadargs[i].num_batches = num_batches;
+	threadargs[i].algorithm = algorithm;
+	threadargs[i].results = results;
+	threadargs[i].sched = sched;
+	threadargs[i].thread = i;
+    }
+    pool_run(num_threads, &multi_thread, (void **) args);
+    if (g_verbose)
+	sched_report(sched, "Likelihood");
+
+    for (i = 0; i < numobs; i++) {
+	r = results + (size_t) i * mm->num_models;
+	if (output == MULTI_ARGMAX) {
+	    for (m = 1, best = 0; m < mm->num_models; m++)
+		if (r[m] > r[best])
+		    best = m;
+	    printf("%i\t%.17g\n", best, output_convert(r[best]));
+	} else {
+	    for (m = 0; m < mm->num_models; m++)
+		printf("%.17g%s", output_convert(r[m]), m < mm->num_models - 1 ? "\t" : "\n");
+	}
+    }
+    for (i = 0; i < num_batches; i++) {
+	free(batches[i].models);
+	free(batches[i].arc_offset);
+	free(batches[i].arc_source);
+	free(batches[i].arc_target);
+	free(batches[i].arc_weight);
+	free(batches[i].final_weight);
+    }
+    free(batches);
+    sched_destroy(sched);
+    free(threadargs);
+    free(args);
+    free(results);
+    free(obsarray);
+}
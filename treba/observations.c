@@ -17,6 +17,7 @@
 /*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
 /**************************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "treba.h"
@@ -53,6 +54,14 @@ int observations_alphabet_size(struct observations *ohead) {
     return(maxsigma+1);
 }
 
+int observations_max_length(struct observations *ohead) {
+    int maxlen;
+    for (maxlen = 0; ohead != NULL; ohead = ohead->next) {
+	maxlen = ohead->size > maxlen ? ohead->size : maxlen;
+    }
+    return(maxlen);
+}
+
 struct observations **observations_to_array(struct observations *ohead, int *numobs) {
     int i;
     struct observations **obsarray, *o;
@@ -0,0 +1,580 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Persistent worker threads. The first pool_run() starts the workers,   */
+/* which then sleep between jobs, so iterative training (every E-step of */
+/* Baum-Welch, over restarts and Viterbi+B-W) does not create and join   */
+/* threads each time. A job runs fn(args[i]) on thread i, with the       */
+/* calling thread as thread 0, and returns when all threads are done.    */
+/* The threads of a job can synchronize with pool_barrier_wait(), and    */
+/* share out observations with the scheduler below. With --pin-threads,  */
+/* every thread stays on one CPU, see pool_pin().                        */
+/*                                                                       */
+/* A thread running a job can start jobs of its own, on a pool of its    */
+/* own: this is how concurrent training runs (random restarts) each get  */
+/* a team of threads. pool_set_threads() sets the size of the team that  */
+/* the calling thread's jobs should use, see pool_threads().             */
+
+#ifdef __linux__
+ #define _GNU_SOURCE
+ #include <sched.h>
+#endif /* __linux__ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "treba.h"
+
+/* Reusable barrier (pthread_barrier_t is optional in POSIX) */
+struct barrier {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+    int waiting;
+    unsigned int phase;
+};
+
+struct pool {
+    int num_workers;          /* Threads besides the caller */
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;     /* Signalled when a job is posted */
+    pthread_cond_t done;      /* Signalled when the last worker finishes */
+    unsigned int job;         /* Incremented for every job */
+    int active;               /* Threads in the current job, caller included */
+    int pending;              /* Workers still running the current job */
+    int shutdown;
+    void *(*fn)(void *);
+    void **args;
+    struct barrier barrier;
+    int base;                 /* Slot (see pool_pin()) of the caller */
+    struct pool_worker *workers;
+};
+
+struct pool_worker {
+    struct pool *pool;
+    int thread;
+};
+
+static struct pool *pool_shared = NULL;              /* Pool of the main thread */
+static __thread struct pool *pool_nested = NULL;     /* Pool of jobs started within a job */
+static __thread struct pool *pool_current = NULL;    /* Pool of the job being run */
+static __thread int pool_is_worker = 0;
+static __thread int pool_slot = 0;                   /* Slot of this thread */
+static __thread int pool_pinned = -1;                /* Slot pinned to, or -1 */
+static __thread int pool_budget = 0;                 /* See pool_set_threads() */
+
+extern int g_pin_threads;
+extern int g_verbose;
+extern int g_num_threads;
+
+/* Thread placement. The CPUs the process may run on are listed node by */
+/* node (NUMA nodes from /sys/devices/system/node), and the thread in   */
+/* slot i is pinned to the i-th of them, so consecutive threads share a */
+/* node. Thread i of a job started by the thread in slot s takes slot   */
+/* s * num_threads + i; for the main thread (slot 0) that is slot i,    */
+/* and teams started by the threads of a job get disjoint slots. The    */
+/* caller of pool_run() is thread 0 of its job. Pinning is Linux only;   */
+/* elsewhere, and without --pin-threads, all threads count as node 0.   */
+
+static int pool_num_cpus = 0;
+static int *pool_cpus = NULL;      /* Allowed CPUs, node by node */
+static int *pool_cpu_nodes = NULL; /* Node of each of pool_cpus */
+
+#ifdef __linux__
+
+/* Parses a sysfs list such as "0-3,8-11" into the set */
+static int pool_read_list(char *filename, cpu_set_t *set) {
+    FILE *f;
+    char buf[4096], *p;
+    long lo, hi;
+    CPU_ZERO(set);
+    if ((f = fopen(filename, "r")) == NULL)
+	return(0);
+    if (fgets(buf, sizeof(buf), f) == NULL)
+	buf[0] = '\0';
+    fclose(f);
+    for (p = buf; *p >= '0' && *p <= '9'; ) {
+	lo = hi = strtol(p, &p, 10);
+	if (*p == '-')
+	    hi = strtol(p + 1, &p, 10);
+	for ( ; lo <= hi && lo < CPU_SETSIZE; lo++)
+	    CPU_SET(lo, set);
+	if (*p == ',')
+	    p++;
+    }
+    return(1);
+}
+
+static void pool_topology(void) {
+    cpu_set_t allowed, nodes, cpus, placed;
+    char filename[128];
+    int cpu, node, n = 0;
+    if (pool_cpus != NULL)
+	return;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+	CPU_ZERO(&allowed);
+	CPU_SET(0, &allowed);
+    }
+    pool_cpus = malloc(sizeof(int) * CPU_COUNT(&allowed));
+    pool_cpu_nodes = malloc(sizeof(int) * CPU_COUNT(&allowed));
+    CPU_ZERO(&placed);
+    if (pool_read_list("/sys/devices/system/node/online", &nodes)) {
+	for (node = 0; node < CPU_SETSIZE; node++) {
+	    if (!CPU_ISSET(node, &nodes))
+		continue;
+	    snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%i/cpulist", node);
+	    if (!pool_read_list(filename, &cpus))
+		continue;
+	    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpus) && CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placed)) {
+		    CPU_SET(cpu, &placed);
+		    pool_cpus[n] = cpu;
+		    pool_cpu_nodes[n++] = node;
+		}
+	    }
+	}
+    }
+    /* CPUs without a node (no NUMA support) go on node 0 */
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placed)) {
+	    pool_cpus[n] = cpu;
+	    pool_cpu_nodes[n++] = 0;
+	}
+    }
+    pool_num_cpus = n;
+}
+
+/* Pins the calling thread to the CPU of slot */
+static void pool_pin(int slot) {
+    cpu_set_t set;
+    int i;
+    if (pool_pinned == slot)
+	return;
+    pool_pinned = slot;
+    i = slot % pool_num_cpus;
+    CPU_ZERO(&set);
+    CPU_SET(pool_cpus[i], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+	perror("sched_setaffinity");
+    else if (g_verbose)
+	fprintf(stderr, "Thread in slot %i pinned to CPU %i (node %i)\n", slot, pool_cpus[i], pool_cpu_nodes[i]);
+}
+
+#else
+
+static void pool_topology(void) {
+    if (pool_cpus != NULL)
+	return;
+    pool_cpus = calloc(1, sizeof(int));
+    pool_cpu_nodes = calloc(1, sizeof(int));
+    pool_num_cpus = 1;
+}
+
+static void pool_pin(int slot) {
+}
+
+#endif /* __linux__ */
+
+/* NUMA node that thread of a job of num_threads threads started by the */
+/* calling thread runs on when pinned, otherwise 0                      */
+int pool_thread_node(int thread, int num_threads) {
+    if (!g_pin_threads)
+	return(0);
+    if (!pool_is_worker)
+	pool_topology();
+    return(pool_cpu_nodes[(pool_slot * num_threads + thread) % pool_num_cpus]);
+}
+
+/* Number of threads for the jobs of the calling thread: its team size if */
+/* set with pool_set_threads(), otherwise --threads                       */
+int pool_threads(void) {
+    return(pool_budget > 0 ? pool_budget : g_num_threads);
+}
+
+void pool_set_threads(int num_threads) {
+    pool_budget = num_threads;
+}
+
+static void barrier_wait(struct barrier *b) {
+    unsigned int phase;
+    pthread_mutex_lock(&b->mutex);
+    phase = b->phase;
+    if (++b->waiting == b->count) {
+	b->waiting = 0;
+	b->phase++;
+	pthread_cond_broadcast(&b->cond);
+    } else {
+	while (phase == b->phase)
+	    pthread_cond_wait(&b->cond, &b->mutex);
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void pool_destroy(struct pool *pool);
+
+static void *pool_worker_main(void *workerargs) {
+    struct pool_worker *w = workerargs;
+    struct pool *pool = w->pool;
+    unsigned int seen = 0;
+    void *(*fn)(void *);
+    void *arg;
+    pool_is_worker = 1;
+    pool_current = pool;
+    pool_slot = pool->base + w->thread;
+    for (;;) {
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->job == seen && !pool->shutdown)
+	    pthread_cond_wait(&pool->start, &pool->mutex);
+	if (pool->shutdown) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    break;
+	}
+	seen = pool->job;
+	if (w->thread >= pool->active) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    continue;
+	}
+	fn = pool->fn;
+	arg = pool->args[w->thread];
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (g_pin_threads)
+	    pool_pin(pool_slot);
+	fn(arg);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (--pool->pending == 0)
+	    pthread_cond_signal(&pool->done);
+	pthread_mutex_unlock(&pool->mutex);
+    }
+    if (pool_nested != NULL)
+	pool_destroy(pool_nested);
+    return(NULL);
+}
+
+static struct pool *pool_create(int num_threads, int base) {
+    struct pool *pool;
+    int i;
+    pool = calloc(1, sizeof(struct pool));
+    pool->num_workers = num_threads - 1;
+    pool->base = base;
+    pool->threads = malloc(sizeof(pthread_t) * num_threads);
+    pool->workers = malloc(sizeof(struct pool_worker) * num_threads);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_mutex_init(&pool->barrier.mutex, NULL);
+    pthread_cond_init(&pool->barrier.cond, NULL);
+    for (i = 1; i < num_threads; i++) {
+	pool->workers[i].pool = pool;
+	pool->workers[i].thread = i;
+	if (pthread_create(&pool->threads[i], NULL, &pool_worker_main, &pool->workers[i]) != 0) {
+	    fprintf(stderr, "Error: could not create thread %i\n", i);
+	    exit(1);
+	}
+    }
+    return(pool);
+}
+
+/* Stops and joins the workers of pool */
+static void pool_destroy(struct pool *pool) {
+    int i;
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 1; i <= pool->num_workers; i++)
+	pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->barrier.mutex);
+    pthread_cond_destroy(&pool->barrier.cond);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+/* Stops the pool of the calling thread; its next pool_run() starts a new one */
+void pool_shutdown(void) {
+    if (pool_is_worker || pool_current != NULL) {
+	if (pool_nested != NULL)
+	    pool_destroy(pool_nested);
+	pool_nested = NULL;
+	return;
+    }
+    if (pool_nested != NULL)
+	pool_destroy(pool_nested);
+    if (pool_shared != NULL)
+	pool_destroy(pool_shared);
+    pool_nested = pool_shared = NULL;
+    free(pool_cpus);
+    free(pool_cpu_nodes);
+    pool_cpus = pool_cpu_nodes = NULL;
+}
+
+void pool_run(int num_threads, void *(*fn)(void *), void **args) {
+    struct pool **owner, *pool, *outer;
+    int base;
+    outer = pool_current;
+    if (num_threads <= 1) {
+	pool_current = NULL;
+	fn(args[0]);
+	pool_current = outer;
+	return;
+    }
+    owner = pool_is_worker || outer != NULL ? &pool_nested : &pool_shared;
+    base = pool_slot * num_threads;
+    if (g_pin_threads) {
+	if (!pool_is_worker)
+	    pool_topology();
+	pool_pin(base);
+    }
+    if (*owner != NULL && ((*owner)->num_workers < num_threads - 1 || (*owner)->base != base)) {
+	pool_destroy(*owner);
+	*owner = NULL;
+    }
+    if (*owner == NULL)
+	*owner = pool_create(num_threads, base);
+    pool = *owner;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->args = args;
+    pool->active = num_threads;
+    pool->pending = num_threads - 1;
+    pool->barrier.count = num_threads;
+    pool->job++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool_current = pool;
+    fn(args[0]);
+    pool_current = outer;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0)
+	pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Waits for all threads of the current job; only valid inside pool_run() */
+void pool_barrier_wait(void) {
+    if (pool_current != NULL && pool_current->active > 1)
+	barrier_wait(&pool_current->barrier);
+}
+
+/* Dynamic scheduling of observations over the threads of a job. The     */
+/* observations are ordered by weight (length x occurrences), heaviest   */
+/* first, and cut into chunks of about equal weight, SCHED_CHUNKS chunks */
+/* per thread. The chunks are dealt round-robin into one deque per       */
+/* thread. A thread takes chunks from the front of its own deque, and    */
+/* when that is empty steals from the back of the others, so the long    */
+/* sequences are started early and the short ones fill in at the end.    */
+/* With one thread the observations keep their original order.          */
+
+#define SCHED_CHUNKS 16
+
+struct sched_deque {
+    pthread_mutex_t lock;
+    int head;                /* Chunks left are chunks[head ... tail-1] */
+    int tail;
+    int num_chunks;
+    int *chunks;
+    int running;             /* Owner is working on a chunk since chunkstart */
+    double chunkstart;
+    double weight;           /* Work done by the owner, for sched_report() */
+    double busy;             /* Seconds spent on chunks */
+    int steals;
+    char pad[64];            /* Keep owners off each other's cache lines */
+};
+
+struct sched {
+    int num_threads;
+    int num_chunks;
+    int *order;              /* Observation indices, heaviest first */
+    int *chunkstart;         /* Chunk c is order[chunkstart[c] ... chunkstart[c+1]-1] */
+    double *chunkweight;
+    double totalweight;
+    double wall;             /* Seconds spent in jobs */
+    double jobstart;
+    struct sched_deque *deques;
+};
+
+struct sched_item {
+    double weight;
+    int index;
+};
+
+static double sched_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static int sched_item_cmp(const void *a, const void *b) {
+    const struct sched_item *x = a, *y = b;
+    if (x->weight != y->weight)
+	return(x->weight < y->weight ? 1 : -1);
+    return(x->index - y->index);
+}
+
+struct sched *sched_create(struct observations **obsarray, int numobs, int num_threads) {
+    struct sched *s;
+    struct sched_item *items;
+    struct sched_deque *d;
+    double target, w;
+    int i, c, t;
+
+    s = calloc(1, sizeof(struct sched));
+    s->num_threads = num_threads;
+    s->order = malloc(sizeof(int) * (numobs + 1));
+    s->chunkstart = malloc(sizeof(int) * (numobs + 1));
+    s->chunkweight = malloc(sizeof(double) * (numobs + 1));
+    items = malloc(sizeof(struct sched_item) * (numobs + 1));
+    for (i = 0; i < numobs; i++) {
+	items[i].weight = (double) (obsarray[i]->size + 1) * obsarray[i]->occurrences;
+	items[i].index = i;
+	s->totalweight += items[i].weight;
+    }
+    if (num_threads > 1)
+	qsort(items, numobs, sizeof(struct sched_item), sched_item_cmp);
+
+    /* Cut into chunks of at least target weight */
+    target = num_threads > 1 ? s->totalweight / (num_threads * SCHED_CHUNKS) : s->totalweight;
+    for (i = 0, c = 0, w = 0; i < numobs; i++) {
+	if (i == 0 || w >= target) {
+	    if (i > 0)
+		s->chunkweight[c-1] = w;
+	    s->chunkstart[c++] = i;
+	    w = 0;
+	}
+	s->order[i] = items[i].index;
+	w += items[i].weight;
+    }
+    if (c > 0)
+	s->chunkweight[c-1] = w;
+    s->num_chunks = c;
+    s->chunkstart[c] = numobs;
+    free(items);
+
+    s->deques = calloc(num_threads, sizeof(struct sched_deque));
+    for (t = 0; t < num_threads; t++) {
+	d = &s->deques[t];
+	pthread_mutex_init(&d->lock, NULL);
+	d->chunks = malloc(sizeof(int) * (s->num_chunks / num_threads + 1));
+	for (c = t; c < s->num_chunks; c += num_threads)
+	    d->chunks[d->num_chunks++] = c;
+    }
+    sched_reset(s);
+    return(s);
+}
+
+/* Refills the deques; call before each job that uses the scheduler */
+void sched_reset(struct sched *s) {
+    int t;
+    for (t = 0; t < s->num_threads; t++) {
+	s->deques[t].head = 0;
+	s->deques[t].tail = s->deques[t].num_chunks;
+    }
+    s->jobstart = sched_time();
+}
+
+/* Hands thread the next chunk: *idx points to its *n observation indices. */
+/* Returns 0 when there is no work left for this job.                      */
+int sched_next(struct sched *s, int thread, const int **idx, int *n) {
+    struct sched_deque *d, *victim;
+    double now;
+    int c = -1, v;
+
+    d = &s->deques[thread];
+    now = sched_time();
+    if (d->running) {
+	d->busy += now - d->chunkstart;
+	d->running = 0;
+    }
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+	c = d->chunks[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    for (v = 1; c < 0 && v < s->num_threads; v++) {
+	victim = &s->deques[(thread + v) % s->num_threads];
+	pthread_mutex_lock(&victim->lock);
+	if (victim->head < victim->tail)
+	    c = victim->chunks[--victim->tail];
+	pthread_mutex_unlock(&victim->lock);
+	if (c >= 0)
+	    d->steals++;
+    }
+    if (c < 0) {
+	if (thread == 0)
+	    s->wall += now - s->jobstart;
+	return(0);
+    }
+    d->weight += s->chunkweight[c];
+    d->running = 1;
+    d->chunkstart = now;
+    *idx = s->order + s->chunkstart[c];
+    *n = s->chunkstart[c+1] - s->chunkstart[c];
+    return(1);
+}
+
+/* Prints the share of the work and busy time of each thread, and the load */
+/* imbalance: the largest busy time over the mean                          */
+void sched_report(struct sched *s, char *what) {
+    double total = 0, busy = 0, maxbusy = 0;
+    int t;
+    for (t = 0; t < s->num_threads; t++) {
+	total += s->deques[t].weight;
+	busy += s->deques[t].busy;
+	maxbusy = s->deques[t].busy > maxbusy ? s->deques[t].busy : maxbusy;
+    }
+    fprintf(stderr, "%s load per thread (share of length x occurrences, busy seconds, chunks stolen):\n", what);
+    for (t = 0; t < s->num_threads; t++)
+	fprintf(stderr, "  thread %i: %5.1f%% %.3fs %i\n", t, total > 0 ? 100 * s->deques[t].weight / total : 0, s->deques[t].busy, s->deques[t].steals);
+    fprintf(stderr, "%s load imbalance (max/mean busy time): %.3f, %.3fs in parallel sections\n", what, busy > 0 ? maxbusy * s->num_threads / busy : 1, s->wall);
+}
+
+/* Adds the load of s to that of total, a scheduler of as many threads: */
+/* for reporting jobs run over the observations part by part            */
+void sched_add(struct sched *total, struct sched *s) {
+    int t;
+    for (t = 0; t < s->num_threads && t < total->num_threads; t++) {
+	total->deques[t].weight += s->deques[t].weight;
+	total->deques[t].busy += s->deques[t].busy;
+	total->deques[t].steals += s->deques[t].steals;
+    }
+    total->wall += s->wall;
+}
+
+void sched_destroy(struct sched *s) {
+    int t;
+    for (t = 0; t < s->num_threads; t++) {
+	pthread_mutex_destroy(&s->deques[t].lock);
+	free(s->deques[t].chunks);
+    }
+    free(s->deques);
+    free(s->order);
+    free(s->chunkstart);
+    free(s->chunkweight);
+    free(s);
+}
@@ -0,0 +1,412 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Quantized models for scoring (--quantize). The log2 weights of a model  */
+/* are stored as 8- or 16-bit codes, one scale/offset pair per row of      */
+/* num_states weights: WFSA rows are (source state, symbol), HMM rows are  */
+/* the transitions out of a state and the emissions of a symbol. Within a  */
+/* row, the range of nonzero weights is divided linearly into 2^bits - 1   */
+/* codes; code 0 is a zero weight. The kernels (quant_kernel.h) decode the */
+/* weights as they go. The model file is read straight into codes, see    */
+/* quant_read_file(), so the double-precision tables are never resident.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+
+#include "treba.h"
+
+#define QTRELLIS_CELL(STATE, TIME) ((trellis) + (qm->num_states) * (TIME) + (STATE))
+
+/* Forward (scaled reals) and Viterbi kernels for 8- and 16-bit codes */
+
+#define SEMIRING_REAL
+#define QUANT_BITS 8
+#include "quant_kernel.h"
+#undef QUANT_BITS
+#define QUANT_BITS 16
+#include "quant_kernel.h"
+#undef QUANT_BITS
+#undef SEMIRING_REAL
+#define SEMIRING_MAX
+#define QUANT_BITS 8
+#include "quant_kernel.h"
+#undef QUANT_BITS
+#define QUANT_BITS 16
+#include "quant_kernel.h"
+#undef QUANT_BITS
+#undef SEMIRING_MAX
+
+/* Indexed by [hmm][viterbi][16-bit] */
+static PROB (*quant_kernels[2][2][2])(struct trellis *, int *, int, struct qmodel *) = {
+    {{quant_forward_fsm_real_8, quant_forward_fsm_real_16}, {quant_forward_fsm_max_8, quant_forward_fsm_max_16}},
+    {{quant_forward_hmm_real_8, quant_forward_hmm_real_16}, {quant_forward_hmm_max_8, quant_forward_hmm_max_16}}
+};
+
+/* Reading a model file into a quantized model. The file is read three  */
+/* times: for the number of states and the alphabet, for the range of    */
+/* weights of each row, and for the codes, so that the full-precision    */
+/* tables are never allocated. A weight missing from the file gets the   */
+/* value a zeroed table gets from input_convert(), as in wfsa_read_file() */
+/* and hmm_read_file(), and the last line of a weight given twice wins.  */
+
+#define QUANT_ARCS  0        /* WFSA and HMM transitions */
+#define QUANT_EMIT  1        /* HMM emissions */
+#define QUANT_FINAL 2        /* WFSA final weights */
+
+struct quant_line {
+    int table;               /* QUANT_ARCS, QUANT_EMIT or QUANT_FINAL */
+    int source, target, symbol;
+    PROB weight;             /* Converted with input_convert() */
+};
+
+/* Parses a line of a model file; returns 0 for lines without a weight */
+static int quant_parse_line(char *line, int use_hmm, struct quant_line *l) {
+    char *w;
+    int elements;
+    PROB prob = SMRONE_REAL;
+    w = line;
+    elements = line_count_elements(&w);
+    if (elements <= 0)
+	return(0);
+    if (!use_hmm) {
+	if (memchr(line, '>', w - line) != NULL) {
+	    fprintf(stderr, "ERROR: Expecting FSA file: for HMMs use the --hmm flag.\n");
+	    exit(EXIT_FAILURE);
+	}
+	l->table = elements <= 2 ? QUANT_FINAL : QUANT_ARCS;
+	if ((elements == 1 && line_sscanf(line, w, "%i", &l->source) != 1) ||
+	    (elements == 2 && line_sscanf(line, w, "%i %lg", &l->source, &prob) != 2) ||
+	    (elements == 3 && line_sscanf(line, w, "%i %i %i", &l->source, &l->target, &l->symbol) != 3) ||
+	    (elements == 4 && line_sscanf(line, w, "%i %i %i %lg", &l->source, &l->target, &l->symbol, &prob) != 4) ||
+	    elements > 4) {
+	    fprintf(stderr, "WFSA file format error\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (l->table == QUANT_FINAL)
+	    l->target = l->symbol = 0;
+    } else {
+	l->table = elements == 3 ? QUANT_EMIT : QUANT_ARCS;
+	if ((elements == 3 && line_sscanf(line, w, "%i %i %lg", &l->source, &l->symbol, &prob) != 3) ||
+	    (elements == 4 && line_sscanf(line, w, "%i > %i %lg", &l->source, &l->target, &prob) != 3) ||
+	    (elements != 3 && elements != 4)) {
+	    fprintf(stderr, "HMM file format error\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (l->table == QUANT_EMIT)
+	    l->target = 0;
+	else
+	    l->symbol = 0;
+    }
+    if (l->source < 0 || l->target < 0 || l->symbol < 0) {
+	fprintf(stderr, "%s file format error\n", use_hmm ? "HMM" : "WFSA");
+	exit(EXIT_FAILURE);
+    }
+    l->weight = input_convert(prob);
+    return(1);
+}
+
+/* Row and column of a parsed weight in its table of qm */
+static struct qtable *quant_place(struct qmodel *qm, struct quant_line *l, size_t *row, size_t *col) {
+    if (l->table == QUANT_EMIT) {
+	*row = l->symbol;
+	*col = l->source;
+	return(&qm->emit);
+    }
+    *row = qm->use_hmm ? (size_t) l->source : (size_t) l->source * qm->alphabet_size + l->symbol;
+    *col = l->target;
+    return(&qm->arcs);
+}
+
+static void quant_table_init(struct qtable *qt, int num_rows, int row_len, int bits) {
+    qt->bits = bits;
+    qt->num_rows = num_rows;
+    qt->row_len = row_len;
+    qt->codes = big_alloc((size_t) num_rows * row_len * (bits / 8));
+    qt->scale = malloc(sizeof(float) * num_rows);
+    qt->offset = malloc(sizeof(float) * num_rows);
+}
+
+/* Code of weight w in row r, updating *maxerr with its rounding error */
+static long quant_code(struct qtable *qt, size_t r, PROB w, PROB *maxerr) {
+    long code, levels;
+    PROB dw;
+    if (w <= SMRZERO_LOG)
+	return(0);
+    levels = (1L << qt->bits) - 1;
+    code = qt->scale[r] > 0 ? 1 + lrint((w - qt->offset[r]) / qt->scale[r]) : 1;
+    code = code < 1 ? 1 : code > levels ? levels : code;
+    dw = fabs(qt->offset[r] + (code - 1) * (PROB) qt->scale[r] - w);
+    *maxerr = dw > *maxerr ? dw : *maxerr;
+    return(code);
+}
+
+static void quant_set(struct qtable *qt, size_t r, size_t j, long code) {
+    if (qt->bits == 8)
+	((uint8_t *) qt->codes)[r * qt->row_len + j] = (uint8_t) code;
+    else
+	((uint16_t *) qt->codes)[r * qt->row_len + j] = (uint16_t) code;
+}
+
+/* Sets the scale and offset of every row of qt from the range lo[r] ...  */
+/* hi[r] of its nonzero weights, widened by the weight missing if the row */
+/* has weights missing from the file (not marked in seen)                 */
+static void quant_rows(struct qtable *qt, PROB *lo, PROB *hi, uint8_t *seen, PROB missing) {
+    size_t r, j;
+    int levels;
+    levels = (1 << qt->bits) - 1;
+    for (r = 0; r < (size_t) qt->num_rows; r++) {
+	for (j = 0; j < (size_t) qt->row_len && missing > SMRZERO_LOG; j++) {
+	    if (!(seen[(r * qt->row_len + j) / 8] & (1 << ((r * qt->row_len + j) % 8)))) {
+		lo[r] = missing < lo[r] ? missing : lo[r];
+		hi[r] = missing > hi[r] ? missing : hi[r];
+		break;
+	    }
+	}
+	qt->offset[r] = lo[r] <= hi[r] ? (float) lo[r] : 0;
+	qt->scale[r] = lo[r] < hi[r] ? (float) ((hi[r] - qt->offset[r]) / (levels - 1)) : 0;
+    }
+}
+
+struct qmodel *quant_read_file(char *filename, int use_hmm, int bits, PROB *maxerr, size_t *bytes) {
+    struct qmodel *qm;
+    struct quant_line l;
+    struct qtable *qt;
+    FILE *f;
+    char line[4096];
+    PROB missing, *lo[2], *hi[2];
+    uint8_t *seen[2];
+    size_t r, j, cells;
+    int t, pass, maxstate = 0, maxsymbol = 0;
+    long code;
+
+    if ((f = fopen(filename, "r")) == NULL) {
+	fprintf(stderr, "Error opening file '%s'\n", filename);
+	exit(EXIT_FAILURE);
+    }
+    qm = calloc(1, sizeof(struct qmodel));
+    qm->use_hmm = use_hmm;
+    missing = input_convert(0);
+    *maxerr = 0;
+    for (pass = 0; pass < 3; pass++) {
+	if (pass > 0 && fseek(f, 0L, SEEK_SET) != 0) {
+	    fprintf(stderr, "Error: --quantize reads the model file '%s' more than once, it cannot be a pipe\n", filename);
+	    exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+	    if (!quant_parse_line(line, use_hmm, &l))
+		continue;
+	    if (pass == 0) {
+		maxstate = l.source > maxstate ? l.source : maxstate;
+		maxstate = l.target > maxstate ? l.target : maxstate;
+		maxsymbol = l.symbol > maxsymbol ? l.symbol : maxsymbol;
+		continue;
+	    }
+	    if (l.table == QUANT_FINAL) {
+		qm->final[l.source] = l.weight;
+		continue;
+	    }
+	    qt = quant_place(qm, &l, &r, &j);
+	    t = qt == &qm->emit;
+	    if (pass == 1) {
+		seen[t][(r * qt->row_len + j) / 8] |= 1 << ((r * qt->row_len + j) % 8);
+		if (l.weight > SMRZERO_LOG) {
+		    lo[t][r] = l.weight < lo[t][r] ? l.weight : lo[t][r];
+		    hi[t][r] = l.weight > hi[t][r] ? l.weight : hi[t][r];
+		}
+	    } else {
+		quant_set(qt, r, j, quant_code(qt, r, l.weight, maxerr));
+	    }
+	}
+	if (ferror(f)) {
+	    fprintf(stderr, "Error reading file '%s'\n", filename);
+	    exit(EXIT_FAILURE);
+	}
+	if (pass == 0) {
+	    qm->num_states = maxstate + 1;
+	    qm->alphabet_size = maxsymbol + 1;
+	    if (!use_hmm) {
+		quant_table_init(&qm->arcs, qm->num_states * qm->alphabet_size, qm->num_states, bits);
+		qm->final = malloc(sizeof(PROB) * qm->num_states);
+		for (r = 0; r < (size_t) qm->num_states; r++)
+		    qm->final[r] = missing;
+	    } else {
+		quant_table_init(&qm->arcs, qm->num_states, qm->num_states, bits);
+		quant_table_init(&qm->emit, qm->alphabet_size, qm->num_states, bits);
+	    }
+	    for (t = 0; t < 1 + use_hmm; t++) {
+		qt = t ? &qm->emit : &qm->arcs;
+		cells = (size_t) qt->num_rows * qt->row_len;
+		seen[t] = calloc(cells / 8 + 1, 1);
+		lo[t] = malloc(sizeof(PROB) * qt->num_rows);
+		hi[t] = malloc(sizeof(PROB) * qt->num_rows);
+		for (r = 0; r < (size_t) qt->num_rows; r++) {
+		    lo[t][r] = DBL_MAX;
+		    hi[t][r] = -DBL_MAX;
+		}
+	    }
+	} else if (pass == 1) {
+	    for (t = 0; t < 1 + use_hmm; t++)
+		quant_rows(t ? &qm->emit : &qm->arcs, lo[t], hi[t], seen[t], missing);
+	}
+    }
+    fclose(f);
+    /* The weights missing from the file */
+    *bytes = 0;
+    for (t = 0; t < 1 + use_hmm; t++) {
+	qt = t ? &qm->emit : &qm->arcs;
+	for (r = 0; r < (size_t) qt->num_rows; r++) {
+	    for (j = 0, code = -1; j < (size_t) qt->row_len; j++) {
+		if (seen[t][(r * qt->row_len + j) / 8] & (1 << ((r * qt->row_len + j) % 8)))
+		    continue;
+		if (code < 0)
+		    code = quant_code(qt, r, missing, maxerr);
+		quant_set(qt, r, j, code);
+	    }
+	}
+	*bytes += (size_t) qt->num_rows * qt->row_len * (bits / 8) + 2 * sizeof(float) * qt->num_rows;
+	free(seen[t]);
+	free(lo[t]);
+	free(hi[t]);
+    }
+    if (!use_hmm)
+	*bytes += sizeof(PROB) * qm->num_states;
+    return(qm);
+}
+
+static void quant_table_destroy(struct qtable *qt) {
+    big_free(qt->codes);
+    free(qt->scale);
+    free(qt->offset);
+}
+
+void quant_destroy(struct qmodel *qm) {
+    quant_table_destroy(&qm->arcs);
+    if (qm->use_hmm)
+	quant_table_destroy(&qm->emit);
+    free(qm->final);
+    free(qm);
+}
+
+PROB quant_score(struct qmodel *qm, struct trellis *trellis, int *obs, int length, int viterbi) {
+    return(quant_kernels[qm->use_hmm][viterbi != 0][qm->arcs.bits == 16](trellis, obs, length, qm));
+}
+
+/* Model scored by quant_observation(), see decode_observations() */
+static struct qmodel *quant_decode_model = NULL;
+
+static void quant_observation(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm) {
+    PROB prob;
+    int viterbi;
+    viterbi = algorithm == LIKELIHOOD_VITERBI || algorithm == DECODE_VITERBI || algorithm == DECODE_VITERBI_PROB;
+    prob = quant_score(quant_decode_model, trellis, obs->data, obs->size, viterbi);
+    if (algorithm == DECODE_VITERBI_PROB)
+	fprintf(out, "%.17g\t", output_convert(prob));
+    if (algorithm == LIKELIHOOD_VITERBI || algorithm == LIKELIHOOD_FORWARD || algorithm == LIKELIHOOD_FORWARD_SCALED)
+	fprintf(out, "%.17g\n", output_convert(prob));
+    if (algorithm == DECODE_VITERBI_PROB || algorithm == DECODE_VITERBI) {
+	if (prob <= SMRZERO_LOG)
+	    fprintf(out, "\n");
+	else if (fsm != NULL)
+	    viterbi_print_path(out, trellis, fsm, obs->size);
+	else
+	    viterbi_print_path_hmm(out, trellis, hmm, obs->size);
+    }
+}
+
+/* Scores the first check observations with the full-precision model as  */
+/* well, which is read for this and freed, and prints the deviation       */
+static void quant_check(struct qmodel *qm, char *filename, struct observations *o, int viterbi, int check) {
+    struct wfsa *fsm = NULL;
+    struct hmm *hmm = NULL;
+    struct observations *obs;
+    struct trellis *trellis;
+    PROB prob, full, dev, maxdev = 0, sumdev = 0;
+    int checked, compared = 0;
+
+    if (!qm->use_hmm) {
+	fsm = wfsa_read_file(filename);
+	wfsa_to_log2(fsm);
+    } else {
+	hmm = hmm_read_file(filename);
+	hmm_to_log2(hmm);
+	hmm_emission_columns(hmm);
+    }
+    trellis = trellis_init(o, qm->num_states);
+    for (obs = o, checked = 0; obs != NULL && checked < check; obs = obs->next, checked++) {
+	if (fsm != NULL)
+	    full = viterbi ? trellis_viterbi(trellis, obs->data, obs->size, fsm) : trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
+	else
+	    full = viterbi ? trellis_viterbi_hmm(trellis, obs->data, obs->size, hmm) : trellis_forward_hmm(trellis, obs->data, obs->size, hmm);
+	prob = quant_score(qm, trellis, obs->data, obs->size, viterbi);
+	if (full <= SMRZERO_LOG || prob <= SMRZERO_LOG) { continue; }
+	dev = fabs(prob - full);
+	maxdev = dev > maxdev ? dev : maxdev;
+	sumdev += dev;
+	compared++;
+    }
+    big_free(trellis);
+    if (fsm != NULL)
+	wfsa_destroy(fsm);
+    else
+	hmm_destroy(hmm);
+    fprintf(stderr, "Deviation from full precision (log2) over %i observations: mean %.3g, max %.3g\n", compared, compared ? sumdev / compared : 0, maxdev);
+}
+
+/* --likelihood=f|fs|vit and --decode=vit[,p] with the model in filename */
+/* read straight into a quantized model, scored on the threads of        */
+/* --threads. With check > 0, the first check observations are also     */
+/* scored with the full-precision model and the deviation is reported.   */
+
+void quant_likelihood(char *filename, int use_hmm, struct observations *o, int algorithm, int bits, int check) {
+    struct qmodel *qm;
+    struct wfsa fsm;
+    struct hmm hmm;
+    PROB maxerr;
+    size_t bytes, fullbytes;
+    int viterbi;
+
+    viterbi = algorithm == LIKELIHOOD_VITERBI || algorithm == DECODE_VITERBI || algorithm == DECODE_VITERBI_PROB;
+    qm = quant_read_file(filename, use_hmm, bits, &maxerr, &bytes);
+    if (o != NULL && observations_alphabet_size(o) > qm->alphabet_size) {
+	fprintf(stderr, "Error: the observations file has symbols outside the model's alphabet.\n");
+	exit(EXIT_FAILURE);
+    }
+    if (!use_hmm)
+	fullbytes = sizeof(PROB) * qm->num_states * ((size_t) qm->num_states * qm->alphabet_size + 1);
+    else
+	fullbytes = sizeof(PROB) * qm->num_states * ((size_t) qm->num_states + 2 * qm->alphabet_size);
+    fprintf(stderr, "Quantized model: %i-bit codes, %.2f MB (full precision %.2f MB), max weight error %.3g (log2)\n", bits, bytes / 1048576.0, fullbytes / 1048576.0, maxerr);
+    if (check > 0 && o != NULL)
+	quant_check(qm, filename, o, viterbi, check);
+
+    /* The decoding functions only need the size of the model */
+    memset(&fsm, 0, sizeof(struct wfsa));
+    memset(&hmm, 0, sizeof(struct hmm));
+    fsm.num_states = hmm.num_states = qm->num_states;
+    fsm.alphabet_size = hmm.alphabet_size = qm->alphabet_size;
+    quant_decode_model = qm;
+    if (o != NULL)
+	decode_observations(use_hmm ? NULL : &fsm, use_hmm ? &hmm : NULL, o, algorithm, &quant_observation);
+    quant_decode_model = NULL;
+    quant_destroy(qm);
+}
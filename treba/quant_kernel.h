@@ -0,0 +1,142 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Forward/Viterbi over a quantized model (see quant.c). This file is a     */
+/* template included from quant.c once per semiring (SEMIRING_REAL or       */
+/* SEMIRING_MAX, see semiring.h) and code width (QUANT_BITS 8 or 16), and   */
+/* produces                                                                 */
+/*                                                                          */
+/*   quant_forward_fsm_<suffix>_<bits>()  quant_forward_hmm_<suffix>_<bits>() */
+/*                                                                          */
+/* with the trellis layout and return values of trellis_kernel.h. Weights   */
+/* are dequantized as they are read: code c > 0 of a row stands for        */
+/* offset + (c-1) * scale, code 0 for a zero-probability arc.               */
+
+#include "semiring.h"
+
+#if QUANT_BITS == 8
+ #define QK_CODE uint8_t
+#else
+ #define QK_CODE uint16_t
+#endif
+
+#define QK_CAT2(A,B,C) A##_##B##_##C
+#define QK_CAT(A,B,C)  QK_CAT2(A,B,C)
+#define QK_FN(NAME)    QK_CAT(NAME, SR_SUFFIX, QUANT_BITS)
+
+PROB QK_FN(quant_forward_fsm)(struct trellis *trellis, int *obs, int length, struct qmodel *qm) {
+    int i, sourcestate, targetstate, final_state, row;
+    PROB source_prob, final_prob, base, scale;
+    const QK_CODE *codes;
+    SR_LOCALS
+
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < qm->num_states; sourcestate++)
+	    QTRELLIS_CELL(sourcestate,i)->fp = SR_ZERO;
+
+    QTRELLIS_CELL(0,0)->fp = SR_ONE;
+    for (i = 0; i < length; i++) {
+	for (sourcestate = 0; sourcestate < qm->num_states; sourcestate++) {
+	    source_prob = QTRELLIS_CELL(sourcestate,i)->fp;
+	    if (source_prob == SR_ZERO) { continue; }
+	    row = sourcestate * qm->alphabet_size + obs[i];
+	    codes = (const QK_CODE *) qm->arcs.codes + (size_t) row * qm->num_states;
+	    scale = qm->arcs.scale[row];
+	    base = qm->arcs.offset[row] - scale;
+	    for (targetstate = 0; targetstate < qm->num_states; targetstate++) {
+		if (codes[targetstate] == 0) { continue; }
+		SR_ACCUM(QTRELLIS_CELL(targetstate,i+1)->fp, QTRELLIS_CELL(targetstate,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(base + codes[targetstate] * scale)), sourcestate);
+	    }
+	}
+	SR_COLUMN_END(QTRELLIS_CELL(0,i+1), qm->num_states, fp);
+    }
+
+    /* Final weights are not quantized */
+    i = length;
+    final_prob = SR_ZERO;
+    final_state = -1;
+    for (targetstate = 0; targetstate < qm->num_states; targetstate++) {
+	QTRELLIS_CELL(targetstate,i+1)->backstate = -1;
+	if (QTRELLIS_CELL(targetstate,i)->fp == SR_ZERO) { continue; }
+	if (qm->final[targetstate] <= SMRZERO_LOG) { continue; }
+	QTRELLIS_CELL(targetstate,i+1)->fp = SR_TIMES(QTRELLIS_CELL(targetstate,i)->fp, SR_WEIGHT(qm->final[targetstate]));
+	SR_ACCUM(final_prob, final_state, QTRELLIS_CELL(targetstate,i+1)->fp, targetstate);
+    }
+    if (final_state >= 0) {
+	QTRELLIS_CELL(final_state,i+1)->backstate = final_state;
+    }
+    return(SR_TO_LOG(final_prob));
+}
+
+PROB QK_FN(quant_forward_hmm)(struct trellis *trellis, int *obs, int length, struct qmodel *qm) {
+    int i, sourcestate, targetstate, end_state;
+    PROB source_prob, tbase, tscale, ebase, escale;
+    const QK_CODE *tcodes, *ecodes;
+    SR_LOCALS
+
+    end_state = qm->num_states - 1;
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < qm->num_states; sourcestate++)
+	    QTRELLIS_CELL(sourcestate,i)->fp = SR_ZERO;
+
+    QTRELLIS_CELL(0,0)->fp = SR_ONE;
+    for (i = 0; i < length; i++) {
+	ecodes = (const QK_CODE *) qm->emit.codes + (size_t) obs[i] * qm->num_states;
+	escale = qm->emit.scale[obs[i]];
+	ebase = qm->emit.offset[obs[i]] - escale;
+	for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	    source_prob = QTRELLIS_CELL(sourcestate,i)->fp;
+	    if (source_prob == SR_ZERO) { continue; }
+	    tcodes = (const QK_CODE *) qm->arcs.codes + (size_t) sourcestate * qm->num_states;
+	    tscale = qm->arcs.scale[sourcestate];
+	    tbase = qm->arcs.offset[sourcestate] - tscale + ebase;
+	    for (targetstate = 1; targetstate < end_state; targetstate++) {
+		if (tcodes[targetstate] == 0 || ecodes[targetstate] == 0) { continue; }
+		SR_ACCUM(QTRELLIS_CELL(targetstate,i+1)->fp, QTRELLIS_CELL(targetstate,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(tbase + tcodes[targetstate] * tscale + ecodes[targetstate] * escale)), sourcestate);
+	    }
+	}
+	SR_COLUMN_END(QTRELLIS_CELL(0,i+1), qm->num_states, fp);
+    }
+
+    /* Transition into the end state */
+    i = length;
+    for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	source_prob = QTRELLIS_CELL(sourcestate,i)->fp;
+	if (source_prob == SR_ZERO) { continue; }
+	tcodes = (const QK_CODE *) qm->arcs.codes + (size_t) sourcestate * qm->num_states;
+	if (tcodes[end_state] == 0) { continue; }
+	SR_ACCUM(QTRELLIS_CELL(end_state,i+1)->fp, QTRELLIS_CELL(end_state,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(qm->arcs.offset[sourcestate] + (tcodes[end_state] - 1) * qm->arcs.scale[sourcestate])), sourcestate);
+    }
+    return(SR_TO_LOG(QTRELLIS_CELL(end_state,i+1)->fp));
+}
+
+#undef QK_CODE
+#undef QK_CAT2
+#undef QK_CAT
+#undef QK_FN
+#undef SR_SUFFIX
+#undef SR_ZERO
+#undef SR_ONE
+#undef SR_WEIGHT
+#undef SR_TIMES
+#undef SR_PLUS
+#undef SR_ACCUM
+#undef SR_LOCALS
+#undef SR_COLUMN_END
+#undef SR_TO_LOG
@@ -0,0 +1,102 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Semiring definitions for the generic trellis engine (trellis_kernel.h)   */
+/* This file is deliberately not include-guarded: it is included once per   */
+/* instantiation of the engine with exactly one of SEMIRING_LOG,            */
+/* SEMIRING_MAX, SEMIRING_REAL defined, and all SR_ macros are #undef'd at  */
+/* the end of trellis_kernel.h.                                             */
+/*                                                                          */
+/* Model weights are always stored as log2 probabilities (SMRZERO_LOG for   */
+/* zero), and arcs with weight <= SMRZERO_LOG are skipped by the engine     */
+/* before SR_WEIGHT is applied. Trellis cells are in the semiring domain.   */
+/*                                                                          */
+/* SR_SUFFIX                   suffix for instantiated function names       */
+/* SR_ZERO, SR_ONE             additive/multiplicative identity             */
+/* SR_WEIGHT(W)                log2 model weight -> semiring element        */
+/* SR_TIMES(X,Y)               semiring product                             */
+/* SR_PLUS(DST,VAL)            DST = DST (+) VAL                            */
+/* SR_ACCUM(DST,BACK,VAL,SRC)  as SR_PLUS, and records SRC in BACK if the   */
+/*                             semiring is selective (Viterbi backpointers) */
+/* SR_LOCALS                   per-call state declared by each kernel       */
+/* SR_COLUMN_END(COL,N,FIELD)  hook run after a trellis column is complete  */
+/* SR_TO_LOG(X)                semiring element -> log2 probability         */
+
+#if defined(SEMIRING_LOG)
+
+/* Log semiring: (log_add, +) over log2 probabilities */
+
+ #define SR_SUFFIX                    log
+ #define SR_ZERO                      LOGZERO
+ #define SR_ONE                       0
+ #define SR_WEIGHT(W)                 (W)
+ #define SR_TIMES(X,Y)                ((X) + (Y))
+ #define SR_PLUS(DST,VAL)             ((DST) = log_add((VAL), (DST)))
+ #define SR_ACCUM(DST,BACK,VAL,SRC)   SR_PLUS(DST,VAL)
+ #define SR_LOCALS
+ #define SR_COLUMN_END(COL,N,FIELD)
+ #define SR_TO_LOG(X)                 ((X) == SR_ZERO ? SMRZERO_LOG : (X))
+
+#elif defined(SEMIRING_MAX)
+
+/* Tropical (max-plus) semiring over log2 probabilities, with backpointers */
+
+ #define SR_SUFFIX                    max
+ #define SR_ZERO                      LOGZERO
+ #define SR_ONE                       0
+ #define SR_WEIGHT(W)                 (W)
+ #define SR_TIMES(X,Y)                ((X) + (Y))
+ #define SR_PLUS(DST,VAL)             do { PROB sr_v = (VAL); if ((DST) == SR_ZERO || (DST) < sr_v) { (DST) = sr_v; } } while (0)
+ #define SR_ACCUM(DST,BACK,VAL,SRC)   do { PROB sr_v = (VAL); if ((DST) == SR_ZERO || (DST) < sr_v) { (DST) = sr_v; (BACK) = (SRC); } } while (0)
+ #define SR_LOCALS
+ #define SR_COLUMN_END(COL,N,FIELD)
+ #define SR_TO_LOG(X)                 ((X) == SR_ZERO ? SMRZERO_LOG : (X))
+
+#elif defined(SEMIRING_REAL)
+
+/* Real (+,*) semiring. Every column is rescaled to sum to one and the      */
+/* log2 of the scale factors is accumulated in sr_logscale, so there is no  */
+/* underflow and no log_add in the inner loop. The trellis then holds       */
+/* scaled reals, so it is only suitable for likelihood calculations.        */
+
+ #define SR_SUFFIX                    real
+ #define SR_ZERO                      0.0
+ #define SR_ONE                       1.0
+ #define SR_WEIGHT(W)                 (EXP(W))
+ #define SR_TIMES(X,Y)                ((X) * (Y))
+ #define SR_PLUS(DST,VAL)             ((DST) += (VAL))
+ #define SR_ACCUM(DST,BACK,VAL,SRC)   SR_PLUS(DST,VAL)
+ #define SR_LOCALS                    PROB sr_logscale = 0;
+ #define SR_COLUMN_END(COL,N,FIELD)   do {				\
+	struct trellis *sr_col = (COL);					\
+	PROB sr_sum = 0;						\
+	int sr_i;							\
+	for (sr_i = 0; sr_i < (N); sr_i++)				\
+	    sr_sum += sr_col[sr_i].FIELD;				\
+	if (sr_sum > 0) {						\
+	    for (sr_i = 0; sr_i < (N); sr_i++)				\
+		sr_col[sr_i].FIELD /= sr_sum;				\
+	    sr_logscale += LOG(sr_sum);					\
+	}								\
+    } while (0)
+ #define SR_TO_LOG(X)                 ((X) == SR_ZERO ? SMRZERO_LOG : LOG(X) + sr_logscale)
+
+#else
+ #error "semiring.h: define one of SEMIRING_LOG, SEMIRING_MAX, SEMIRING_REAL"
+#endif
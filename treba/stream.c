@@ -0,0 +1,231 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Reading observation files in chunks (--stream), for training on files  */
+/* that do not fit in memory. A reader thread reads about chunk bytes of  */
+/* the file at a time and parses the complete lines into a chunk of       */
+/* observations, while the caller works on the previous chunk: there are  */
+/* two chunks, one being filled and one in use. Lines are parsed as by    */
+/* observations_read(): symbols are runs of digits, lines starting with   */
+/* '#' are skipped, and an empty line is an empty observation.            */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "treba.h"
+
+struct obs_stream {
+    FILE *file;
+    size_t chunkbytes;
+    char *buf;                 /* Text read but not yet parsed */
+    size_t bufsize;
+    size_t buflen;
+    struct obs_chunk chunks[2];
+    int full[2];               /* Chunk parsed and not yet released */
+    int next;                  /* Chunk the caller gets next */
+    int done;                  /* Reader has reached the end of the file */
+    int stop;                  /* Caller closed the stream */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/* Parses the lines of text[0 ... len-1] into c */
+static void obs_chunk_parse(struct obs_chunk *c, char *text, size_t len) {
+    char *p, *end, *eol;
+    int i, n;
+    size_t sym;
+    c->num_obs = 0;
+    for (p = text, end = text + len, sym = 0; p < end; p = eol + 1) {
+	if ((eol = memchr(p, '\n', end - p)) == NULL)
+	    eol = end;
+	if (*p == '#')
+	    continue;
+	if (c->num_obs == c->max_obs) {
+	    c->max_obs = c->max_obs * 2 + 64;
+	    c->obs = realloc(c->obs, sizeof(struct observations) * c->max_obs);
+	    c->obsarray = realloc(c->obsarray, sizeof(struct observations *) * c->max_obs);
+	}
+	for (n = 0; p < eol; ) {
+	    while (p < eol && !isdigit(*p))
+		p++;
+	    if (p == eol)
+		break;
+	    if (sym == c->max_symbols) {
+		c->max_symbols = c->max_symbols * 2 + 1024;
+		c->symbols = realloc(c->symbols, sizeof(int) * c->max_symbols);
+	    }
+	    for (c->symbols[sym] = 0; p < eol && isdigit(*p); p++)
+		c->symbols[sym] = c->symbols[sym] * 10 + (*p - '0');
+	    sym++;
+	    n++;
+	}
+	c->obs[c->num_obs].size = n;
+	c->obs[c->num_obs].occurrences = 1;
+	c->num_obs++;
+    }
+    /* Symbols are stored in line order */
+    for (i = 0, sym = 0; i < c->num_obs; sym += c->obs[i].size, i++) {
+	c->obs[i].data = c->symbols + sym;
+	c->obs[i].next = i + 1 < c->num_obs ? &c->obs[i+1] : NULL;
+	c->obsarray[i] = &c->obs[i];
+    }
+}
+
+/* End of the last complete line in buf[0 ... len-1], 0 if none */
+static size_t obs_stream_lines(char *buf, size_t len) {
+    for ( ; len > 0; len--)
+	if (buf[len-1] == '\n')
+	    break;
+    return(len);
+}
+
+static void *obs_stream_reader(void *streamargs) {
+    struct obs_stream *s = streamargs;
+    size_t n, used;
+    int slot = 0, eof = 0, stop;
+    for (;;) {
+	pthread_mutex_lock(&s->mutex);
+	while (s->full[slot] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->mutex);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->mutex);
+	if (stop)
+	    break;
+	/* Read until there is a chunk's worth of text with a complete line */
+	for (used = 0; !eof; ) {
+	    if (s->bufsize - s->buflen < s->chunkbytes / 2 + 1) {
+		s->bufsize = s->bufsize * 2 > s->buflen + s->chunkbytes ? s->bufsize * 2 : s->buflen + s->chunkbytes;
+		s->buf = realloc(s->buf, s->bufsize);
+	    }
+	    n = fread(s->buf + s->buflen, 1, s->bufsize - s->buflen, s->file);
+	    s->buflen += n;
+	    eof = n == 0;
+	    if (s->buflen >= s->chunkbytes && (used = obs_stream_lines(s->buf, s->buflen)) > 0)
+		break;
+	}
+	used = eof ? s->buflen : used;
+	if (used == 0)
+	    break;
+	obs_chunk_parse(&s->chunks[slot], s->buf, used);
+	memmove(s->buf, s->buf + used, s->buflen - used);
+	s->buflen -= used;
+	if (s->chunks[slot].num_obs > 0) {
+	    pthread_mutex_lock(&s->mutex);
+	    s->full[slot] = 1;
+	    pthread_cond_broadcast(&s->cond);
+	    pthread_mutex_unlock(&s->mutex);
+	    slot ^= 1;
+	}
+	if (eof && s->buflen == 0)
+	    break;
+    }
+    pthread_mutex_lock(&s->mutex);
+    s->done = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    return(NULL);
+}
+
+/* Starts reading filename in chunks of about chunkbytes bytes */
+struct obs_stream *obs_stream_open(char *filename, size_t chunkbytes) {
+    struct obs_stream *s;
+    FILE *file;
+    if ((file = fopen(filename, "rb")) == NULL) {
+	fprintf(stderr, "Error opening file '%s'\n", filename);
+	return(NULL);
+    }
+    s = calloc(1, sizeof(struct obs_stream));
+    s->file = file;
+    s->chunkbytes = chunkbytes > 0 ? chunkbytes : 1;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, &obs_stream_reader, s) != 0) {
+	fprintf(stderr, "Error: could not create reader thread\n");
+	exit(1);
+    }
+    return(s);
+}
+
+/* Returns the next chunk of observations, NULL at the end of the file. */
+/* The chunk stays valid until it is given back with obs_stream_release() */
+struct obs_chunk *obs_stream_next(struct obs_stream *s) {
+    struct obs_chunk *c = NULL;
+    pthread_mutex_lock(&s->mutex);
+    while (!s->full[s->next] && !s->done)
+	pthread_cond_wait(&s->cond, &s->mutex);
+    if (s->full[s->next])
+	c = &s->chunks[s->next];
+    pthread_mutex_unlock(&s->mutex);
+    return(c);
+}
+
+void obs_stream_release(struct obs_stream *s, struct obs_chunk *c) {
+    pthread_mutex_lock(&s->mutex);
+    s->full[c - s->chunks] = 0;
+    s->next ^= 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void obs_stream_close(struct obs_stream *s) {
+    int i;
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, NULL);
+    fclose(s->file);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    for (i = 0; i < 2; i++) {
+	free(s->chunks[i].obs);
+	free(s->chunks[i].obsarray);
+	free(s->chunks[i].symbols);
+    }
+    free(s->buf);
+    free(s);
+}
+
+/* Reads through filename once, for the alphabet size, the length of the */
+/* longest observation and the number of observations. Returns -1 if the */
+/* file cannot be read.                                                   */
+int obs_stream_scan(char *filename, size_t chunkbytes, int *alphabet_size, int *maxlen, long *numobs) {
+    struct obs_stream *s;
+    struct obs_chunk *c;
+    int i;
+    if ((s = obs_stream_open(filename, chunkbytes)) == NULL)
+	return(-1);
+    *maxlen = 0;
+    *numobs = 0;
+    *alphabet_size = 0;
+    while ((c = obs_stream_next(s)) != NULL) {
+	i = observations_alphabet_size(c->obs);
+	*alphabet_size = i > *alphabet_size ? i : *alphabet_size;
+	i = observations_max_length(c->obs);
+	*maxlen = i > *maxlen ? i : *maxlen;
+	*numobs += c->num_obs;
+	obs_stream_release(s, c);
+    }
+    obs_stream_close(s);
+    return(0);
+}
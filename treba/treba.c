@@ -25,10 +25,12 @@
 #include <time.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <signal.h>
 #include <getopt.h>
+#include <gsl/gsl_multimin.h>
 
 #include "treba.h"
 #include "globals.h"
@@ -50,10 +52,13 @@ static char *helpstring =
 " -T , --train=ALG        Train FSM with state merging, Baum-Welch, B-W +\n"
 "                         deterministic annealing, Gibbs sampling, Viterbi\n"
 "                         training, Viterbi+B-W,...\n"
-"                         ALG is one of merge,mdi,bw,dabw,gs,vb,vit,vitbw\n"
+"                         ALG is one of merge,mdi,bw,dabw,obw,lbfgs,gs,vb,vit,\n"
+"                         vitbw\n"
 "                         merge = State-merging algorithms (such as ALERGIA)\n"
 "                         mdi = MDI algorithm\n"
 "                         bw = Baum-Welch, dabw = Baum-Welch w/ det. annealing.\n"
+"                         obw = online Baum-Welch on mini-batches (see -O)\n"
+"                         lbfgs = quasi-Newton maximum likelihood\n"
 "                         vit = Viterbi-Baum-Welch (Hard EM)\n"
 "                         vitbw = vit until convergence followed by B-W\n"
 "                         vb = Variational Bayes\n"
@@ -65,9 +70,40 @@ static char *helpstring =
 "                         forward, backward, or Viterbi.\n"
 "                         METHOD one of f[,p],b[,p],vit[,p]; adding ,p specifies\n"
 "                         probabilities to be printed as well as the path.\n"
+"                         vit,k=N prints the N best Viterbi paths of each\n"
+"                         observation with their probabilities, one per line,\n"
+"                         followed by an empty line.\n"
 " -L , --likelihood=TYPE  Calculate probability of sequences; forward\n"
 "                         probability or best path (Viterbi). TYPE one of f,vit,b\n"
-"                         (forward, Viterbi, backward)\n"
+"                         (forward, Viterbi, backward), or fs (forward computed\n"
+"                         with scaled reals instead of logs)\n"
+" -c , --threshold=NUM[,p] With --likelihood=f|fs|vit, only decide whether each\n"
+"                         probability is at least NUM (in --output-format) and\n"
+"                         print accept or reject, or with ,p the probability of\n"
+"                         accepted sequences. Scoring stops early once a\n"
+"                         sequence cannot reach NUM.\n"
+" -J , --jit[=DIR]        Compute f/fs/vit likelihoods with C code generated for\n"
+"                         the model and compiled with $CC (default cc). The\n"
+"                         compiled scorer is cached in DIR (default a private\n"
+"                         directory, ~/.cache/treba-jit) and reused for the\n"
+"                         same model.\n"
+" -q , --quantize=BITS[,N] With --likelihood=f|fs|vit or --decode=vit[,p],\n"
+"                         read the model (-f) straight into 8- or 16-bit codes\n"
+"                         (BITS 8 or 16) and score with those. With N, the\n"
+"                         first N observations are also scored at full\n"
+"                         precision and the deviation is reported on stderr.\n"
+" -P , --posteriors=FILE  Write the posterior probabilities of all states at\n"
+"                         each time step of each observation to FILE, in\n"
+"                         binary (see man page for the format).\n"
+" -e , --logadd=TYPE      Approximation of log2(1+2^x) in log-space sums: TYPE\n"
+"                         one of minimax (default; 4th order polynomials),\n"
+"                         table (interpolated lookup table), lib (libm).\n"
+"                         bench prints the error and speed of each and exits.\n"
+" -Z , --hugepages=MODE[,MB] How to allocate trellises, models and counts of\n"
+"                         at least MB megabytes (default 2): thp (default;\n"
+"                         transparent huge pages), hugetlb (hugetlbfs pool),\n"
+"                         or off.\n"
+" -V , --verbose          Print memory page sizes and per-thread load to stderr.\n"
 " -G , --generate=NUM     Generate (randomly) NUM words from HMM of HMM/PFSA\n"
 " -M , --merge=ALG        Set merge test for merge-based learning algorithms.\n"
 "                         ALG one of alergia,chi2,lr,binomial,exactm,exact\n"
@@ -77,7 +113,15 @@ static char *helpstring =
 " -o , --output-format=F  Set  probability/weight format from FSMs/HMMs\n"
 "                         F one of real,log10,ln,log2,nlog10,nln,nlog2.\n"
 "                         n prefix to FMT is negative. Default is real.\n"
-" -f , --file=FILE        Specify FSM/PFSA/HMM to read from file.\n"
+" -f , --file=FILE        Specify FSM/PFSA/HMM to read from file. With\n"
+"                         --likelihood, -f may be repeated, or FILE given as\n"
+"                         @LIST with LIST holding one model file per line, to\n"
+"                         print the likelihood of each observation under each\n"
+"                         model (TAB-separated, in the order given).\n"
+" -m , --argmax           With several models, print only the index (from 0)\n"
+"                         of the most likely model and its likelihood.\n"
+" -B , --batch            With several models, score models with the same\n"
+"                         topology together in one pass.\n"
 " -g , --initialize=TYPE  Specify type of initial random FSM. TYPE in\n"
 "                         [b,d]NUMSTATES[,#NUMSYMS] b=Bakis,d=deterministic,n=ergodic\n"
 " -u , --uniform-probs    Set uniform probabilities on initially generated FSM.\n"
@@ -97,14 +141,36 @@ static char *helpstring =
 "                         NUM1 = state-to-state prior, NUM2 = emission prior\n"
 " -r , --restarts=OPT     Number of restarts and iterations per restart before\n"
 "                         beginning final run of B-W. Restart OPT is given as\n"
-"                         numrestarts,iterations-per-restart\n"
+"                         numrestarts,iterations-per-restart[,parallel]\n"
+"                         where parallel restarts run at once, sharing the\n"
+"                         threads (default 1).\n"
+" -S , --halving[=ETA]    Run the restarts of -r by successive halving: after\n"
+"                         each round keep the best 1/ETA of the models and\n"
+"                         train them ETA times as long (default ETA 2).\n"
 " -R , --recursive-merge  Do merge tests recursively (for merging algorithms).\n"
 " -a , --annealopts=PAR   Parameters for deterministic annealing.\n"
 "                         PAR specified as betamin,betamax,alpha.\n"
-" -t , --threads=NUM      Number of threads to launch in parallel for Baum-Welch\n"
-"                         Can be specified as fraction of available CPUs c/NUM\n";
-
-PROB g_loglikelihood = 0;
+" -E , --squarem          Accelerate bw, vb and dabw by extrapolating the\n"
+"                         weights from pairs of EM steps (SQUAREM).\n"
+" -s , --stream=MB        Train (bw, vb) reading the observations from disk\n"
+"                         on every iteration, MB megabytes at a time.\n"
+" -I , --incremental=NUM  Incremental EM for bw, vb and vitbw: keep the counts\n"
+"                         of NUM shards of the data, re-estimate after each\n"
+"                         shard.\n"
+" -W , --checkpoint=FILE[,N[,MIN]]  Save the training state (bw, vb, dabw,\n"
+"                         gs) to FILE every N iterations (default 10) or MIN\n"
+"                         minutes, written by a background thread.\n"
+" -U , --resume=FILE      Continue training from a checkpoint FILE.\n"
+" -Q , --heldout=FILE[,PATIENCE]  Stop bw, vb and dabw when the loglikelihood\n"
+"                         of the observations in FILE has not improved for\n"
+"                         PATIENCE iterations (default 5), keeping the model\n"
+"                         that scored best on them.\n"
+" -O , --online=BATCH[,ALPHA]  Mini-batch size (default 1000) and step size\n"
+"                         exponent (default 0.7, in (0.5,1]) for -T obw.\n"
+" -t , --threads=NUM      Number of threads to launch in parallel for training\n"
+"                         (bw, dabw, vb, vit) and decoding/likelihood.\n"
+"                         Can be specified as fraction of available CPUs c/NUM\n"
+" -N , --pin-threads      Pin each thread to one CPU, filling NUMA nodes in turn.\n";
 
 #ifdef USE_CUDA
  static char *versionstring = "treba v1.01 (compiled with CUDA support)";
@@ -114,6 +180,27 @@ PROB g_loglikelihood = 0;
  static char *versionstring = "treba v1.01 (compiled without CUDA support)";
 #endif /* USE_CUDA */
 
+/* Find the best instruction set the CPU supports for which */
+/* kernels have been compiled                                */
+int cpu_detect(void) {
+#ifdef CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+	return(CPU_AVX512);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	return(CPU_AVX2);
+#endif /* CPU_DISPATCH */
+    return(CPU_GENERIC);
+}
+
+char *cpu_name(int cpu) {
+    switch (cpu) {
+    case CPU_AVX2:   return("avx2");
+    case CPU_AVX512: return("avx512");
+    }
+    return("generic");
+}
+
 PROB rand_double() {
     return (drand48());
 }
@@ -224,8 +311,9 @@ struct hmm *hmm_init(int num_states, int alphabet_size) {
     hmm = malloc(sizeof(struct hmm));
     hmm->num_states = num_states;
     hmm->alphabet_size = alphabet_size;
-    hmm->transition_table = calloc(num_states * num_states, sizeof(PROB));
-    hmm->emission_table = calloc(num_states * alphabet_size, sizeof(PROB));
+    hmm->transition_table = big_alloc(num_states * num_states * sizeof(PROB));
+    hmm->emission_table = big_alloc(num_states * alphabet_size * sizeof(PROB));
+    hmm->emission_columns = big_alloc(num_states * alphabet_size * sizeof(PROB));
     return(hmm);
 }
 
@@ -237,11 +325,8 @@ struct wfsa *wfsa_init(int num_states, int alphabet_size) {
     }
     fsm->num_states = num_states;
     fsm->alphabet_size = alphabet_size;
-    fsm->state_table = calloc(num_states * num_states * alphabet_size, sizeof(PROB));
-    if (fsm->state_table == NULL) {
-	fprintf(stderr, "Out of memory. Fatal.\n"); exit(1);
-    }
-    fsm->final_table = calloc(num_states, sizeof(PROB));
+    fsm->state_table = big_alloc((size_t) num_states * num_states * alphabet_size * sizeof(PROB));
+    fsm->final_table = big_alloc(num_states * sizeof(PROB));
     return(fsm);
 }
 
@@ -250,10 +335,12 @@ struct hmm *hmm_copy(struct hmm *hmm) {
     newhmm = malloc(sizeof(struct hmm));
     newhmm->num_states = hmm->num_states;
     newhmm->alphabet_size = hmm->alphabet_size;
-    newhmm->transition_table = malloc(hmm->num_states * hmm->num_states * sizeof(PROB));
-    newhmm->emission_table = malloc(hmm->num_states * hmm->alphabet_size * sizeof(PROB));
+    newhmm->transition_table = big_alloc(hmm->num_states * hmm->num_states * sizeof(PROB));
+    newhmm->emission_table = big_alloc(hmm->num_states * hmm->alphabet_size * sizeof(PROB));
     memcpy(newhmm->transition_table, hmm->transition_table, hmm->num_states * hmm->num_states * sizeof(PROB));
     memcpy(newhmm->emission_table, hmm->emission_table, hmm->num_states * hmm->alphabet_size * sizeof(PROB));
+    newhmm->emission_columns = big_alloc(hmm->num_states * hmm->alphabet_size * sizeof(PROB));
+    memcpy(newhmm->emission_columns, hmm->emission_columns, hmm->num_states * hmm->alphabet_size * sizeof(PROB));
     return(newhmm);
 }
 
@@ -262,25 +349,36 @@ struct wfsa *wfsa_copy(struct wfsa *fsm) {
     newfsm = malloc(sizeof(struct wfsa));
     newfsm->num_states = fsm->num_states;
     newfsm->alphabet_size = fsm->alphabet_size;
-    newfsm->state_table = malloc(fsm->num_states * fsm->num_states * fsm->alphabet_size * sizeof(PROB));
-    newfsm->final_table = malloc(fsm->num_states * sizeof(PROB));
+    newfsm->state_table = big_alloc((size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size * sizeof(PROB));
+    newfsm->final_table = big_alloc(fsm->num_states * sizeof(PROB));
     memcpy(newfsm->state_table, fsm->state_table, fsm->num_states * fsm->num_states * fsm->alphabet_size * sizeof(PROB));
     memcpy(newfsm->final_table, fsm->final_table, fsm->num_states * sizeof(PROB));
     return(newfsm);
 }
 
 void wfsa_destroy(struct wfsa *fsm) {
-    free(fsm->state_table);
-    free(fsm->final_table);
+    big_free(fsm->state_table);
+    big_free(fsm->final_table);
     free(fsm);
 }
 
 void hmm_destroy(struct hmm *hmm) {
-    free(hmm->transition_table);
-    free(hmm->emission_table);
+    big_free(hmm->transition_table);
+    big_free(hmm->emission_table);
+    big_free(hmm->emission_columns);
     free(hmm);
 }
 
+/* The kernels read the emission probabilities of all states for one     */
+/* symbol at each time step; emission_columns keeps them contiguous.      */
+/* Must be called after emission_table changes, before decoding/training. */
+void hmm_emission_columns(struct hmm *hmm) {
+    int state, symbol;
+    for (symbol = 0; symbol < hmm->alphabet_size; symbol++)
+	for (state = 0; state < hmm->num_states; state++)
+	    *(HMM_EMISSION_COLUMN(hmm, symbol) + state) = *HMM_EMISSION_PROB(hmm, state, symbol);
+}
+
 void wfsa_to_log2(struct wfsa *fsm) {
     int i,j,k;
     for (i = 0; i < fsm->num_states; i++) {
@@ -327,27 +425,27 @@ struct wfsa *wfsa_read_file(char *filename) {
 	if (elements == 0) {
 	    continue; /* Comment line */
 	}
-	if (strstr(lastline, ">") != NULL) {
+	if (memchr(lastline, '>', w - lastline) != NULL) {
 	    fprintf(stderr, "ERROR: Expecting FSA file: for HMMs use the --hmm flag.\n");
 	    exit(EXIT_FAILURE);
 	}
 	switch (elements) {
 	case 1:
-	    sscanf(lastline, "%i", &finalstate);
+	    line_sscanf(lastline, w, "%i", &finalstate);
 	    maxstate = maxstate > finalstate ? maxstate : finalstate;
 	    break;
 	case 2:
-	    sscanf(lastline, "%i %lg", &finalstate, &prob);
+	    line_sscanf(lastline, w, "%i %lg", &finalstate, &prob);
 	    maxstate = maxstate > finalstate ? maxstate : finalstate;
 	    break;
 	case 3:
-	    sscanf(lastline, "%i %i %i", &source, &target, &symbol);
+	    line_sscanf(lastline, w, "%i %i %i", &source, &target, &symbol);
 	    maxstate = maxstate > source ? maxstate : source;
 	    maxstate = maxstate > target ? maxstate : target;
 	    maxsymbol = maxsymbol > symbol ? maxsymbol : symbol;
 	    break;
 	case 4:
-	    sscanf(lastline, "%i %i %i %lg", &source, &target, &symbol, &prob);	    
+	    line_sscanf(lastline, w, "%i %i %i %lg", &source, &target, &symbol, &prob);	    
 	    maxstate = maxstate > source ? maxstate : source;
 	    maxstate = maxstate > target ? maxstate : target;
 	    maxsymbol = maxsymbol > symbol ? maxsymbol : symbol;
@@ -370,19 +468,19 @@ struct wfsa *wfsa_read_file(char *filename) {
 	}
 	switch (elements) {
 	case 1:
-	    sscanf(lastline, "%i", &finalstate);
+	    line_sscanf(lastline, w, "%i", &finalstate);
 	    *FINALPROB(fsm, finalstate) = SMRONE_REAL;
 	    break;
 	case 2:
-	    sscanf(lastline, "%i %lg", &finalstate, &prob);
+	    line_sscanf(lastline, w, "%i %lg", &finalstate, &prob);
 	    *FINALPROB(fsm, finalstate) = prob;
 	    break;
 	case 3:
-	    sscanf(lastline, "%i %i %i", &source, &target, &symbol);
+	    line_sscanf(lastline, w, "%i %i %i", &source, &target, &symbol);
 	    *TRANSITION(fsm, source, symbol, target) = SMRONE_REAL;
 	    break;
 	case 4:
-	    sscanf(lastline, "%i %i %i %lg", &source, &target, &symbol, &prob);
+	    line_sscanf(lastline, w, "%i %i %i %lg", &source, &target, &symbol, &prob);
 	    *TRANSITION(fsm, source, symbol, target) = prob;
 	    break;
 	default:
@@ -415,14 +513,14 @@ struct hmm *hmm_read_file(char *filename) {
 	}
 	switch (elements) {
 	case 3:
-	    sscanf(lastline, "%i %i %lg", &source, &symbol, &prob); /* Transition probability */
+	    line_sscanf(lastline, w, "%i %i %lg", &source, &symbol, &prob); /* Transition probability */
 	    maxsymbol = maxsymbol > symbol ? maxsymbol : symbol;
 	    maxstate = maxstate > source ? maxstate : source;
 	    maxstate = maxstate > target ? maxstate : target;
 	    maxsymbol = maxsymbol > symbol ? maxsymbol : symbol;
 	    break;
 	case 4:
-	    sscanf(lastline, "%i > %i %lg", &source, &target, &prob); /* Emission probability */
+	    line_sscanf(lastline, w, "%i > %i %lg", &source, &target, &prob); /* Emission probability */
 	    maxstate = maxstate > source ? maxstate : source;
 	    maxstate = maxstate > target ? maxstate : target;
 	    break;
@@ -445,11 +543,11 @@ struct hmm *hmm_read_file(char *filename) {
 	}
 	switch (elements) {
 	case 3:
-	    sscanf(lastline, "%i %i %lg", &source, &symbol, &prob); /* Transition probability */
+	    line_sscanf(lastline, w, "%i %i %lg", &source, &symbol, &prob); /* Transition probability */
 	    *HMM_EMISSION_PROB(hmm, source, symbol) = prob;
 	    break;
 	case 4:
-	    sscanf(lastline, "%i > %i %lg", &source, &target, &prob); /* Emission probability */
+	    line_sscanf(lastline, w, "%i > %i %lg", &source, &target, &prob); /* Emission probability */
 	    *HMM_TRANSITION_PROB(hmm, source, target) = prob;
 	    break;
 	default:
@@ -464,6 +562,7 @@ struct hmm *hmm_read_file(char *filename) {
 
 struct wfsa *g_lastwfsa = NULL; /* Stores global pointer to last WFSA to spit out in case of SIGINT */
 struct hmm *g_lasthmm = NULL; /* Stores global pointer to last WFSA to spit out in case of SIGINT */
+int g_lastmodel_hold = 0;    /* Set while restarts train; g_lastwfsa/g_lasthmm stay the given model */
 
 void interrupt_sigproc() {
     fprintf(stderr, "Received SIGINT. Exiting.\n");
@@ -481,7 +580,7 @@ void interrupt_sigproc_hmm() {
     exit(1);
 }
 
-inline PROB log_add(PROB x, PROB y) {
+static inline PROB log_add(PROB x, PROB y) {
     PROB temp, negdiff;
     PROB result;
     if (x == LOGZERO) return (y);
@@ -493,281 +592,193 @@ inline PROB log_add(PROB x, PROB y) {
     }
     negdiff = y - x;
     if (negdiff <= -61) { return x; }
-#ifdef LOG_LUT
-    result = log1plus_table_interp(negdiff);
-#elif LOG_LIB
-    result = log2(exp2(negdiff)+1);
-#else
-    result = log1plus_minimax(negdiff);
-#endif /* LOG_LUT */
+    switch (g_logadd) {
+    case LOGADD_TABLE: result = log1plus_table_interp(negdiff); break;
+    case LOGADD_LIB:   result = log2(exp2(negdiff)+1); break;
+    default:           result = log1plus_minimax(negdiff); break;
+    }
     return(result+x);
 }
 
-PROB trellis_backward(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
-    int i, sourcestate, targetstate, symbol;
-    PROB target_prob;
-    for (i = 0; i <= length + 1; i++)
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++)
-	    TRELLIS_CELL(sourcestate,i)->bp = LOGZERO;
-    
-    /* Fill last and penultimate column */
-    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-	TRELLIS_CELL(targetstate,length+1)->bp = 0;
-	TRELLIS_CELL(targetstate,length)->bp = 0 + *FINALPROB(fsm, targetstate);
-    }
-    /* Fill rest */
-    for (i = length-1; i >= 0 ; i--) {
-	symbol = obs[i];
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++) {
-	    TRELLIS_CELL(sourcestate,i)->bp = LOGZERO;
-	    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-		target_prob = *TRANSITION(fsm, sourcestate, symbol, targetstate);
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		TRELLIS_CELL(sourcestate,i)->bp = log_add(TRELLIS_CELL(sourcestate,i)->bp, TRELLIS_CELL(targetstate,i+1)->bp + target_prob);
-	    }
-	}
+/* Batch log2(1+2^x) for arrays of differences, one version per  */
+/* instruction set and approximation, measured by --logadd=bench */
+
+#include "logadd_kernel.h"
+#ifdef CPU_DISPATCH
+#define TARGET_AVX2
+#include "logadd_kernel.h"
+#undef TARGET_AVX2
+#define TARGET_AVX512
+#include "logadd_kernel.h"
+#undef TARGET_AVX512
+#endif /* CPU_DISPATCH */
+
+typedef void (*log1plus_batch_fn)(PROB *restrict, const PROB *restrict, int);
+
+static log1plus_batch_fn log1plus_batch_table[][LOGADD_NUM] = {
+    {log1plus_minimax_batch, log1plus_table_batch, log1plus_lib_batch},
+#ifdef CPU_DISPATCH
+    {log1plus_minimax_batch_avx2, log1plus_table_batch_avx2, log1plus_lib_batch_avx2},
+    {log1plus_minimax_batch_avx512, log1plus_table_batch_avx512, log1plus_lib_batch_avx512},
+#endif /* CPU_DISPATCH */
+};
+
+char *logadd_name(int logadd) {
+    switch (logadd) {
+    case LOGADD_TABLE: return("table");
+    case LOGADD_LIB:   return("lib");
     }
-    return(TRELLIS_CELL(0,0)->bp);
+    return("minimax");
 }
 
-PROB trellis_backward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
-    int i, sourcestate, targetstate, symbol;
-    PROB target_prob;
-    for (i = 0; i <= length + 1; i++) /* Clear all */
-	for (sourcestate = 0; sourcestate < hmm->num_states; sourcestate++)
-	    TRELLIS_CELL_HMM(sourcestate, i)->bp = LOGZERO;
-    
-    /* Fill last and penultimate column */
-    TRELLIS_CELL_HMM(hmm->num_states - 1, length + 1)->bp = 0;  /* Set prob 1.0 for final */
-    for (sourcestate = 0; sourcestate < hmm->num_states - 1; sourcestate++) {
-	TRELLIS_CELL_HMM(sourcestate, length)->bp = *HMM_TRANSITION_PROB(hmm, sourcestate, hmm->num_states - 1);
-    }
-    /* Fill rest */
-    for (i = length-1; i >= 0 ; i--) {
-	symbol = obs[i];
-	for (sourcestate = 0; sourcestate < hmm->num_states - 1; sourcestate++) {
-	    if (sourcestate == 0 && i != 0)
-		continue;
-	    TRELLIS_CELL_HMM(sourcestate, i)->bp = LOGZERO;
-	    for (targetstate = 0; targetstate < hmm->num_states - 1; targetstate++) {
-		target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate) + *HMM_EMISSION_PROB(hmm, targetstate, symbol);
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		TRELLIS_CELL_HMM(sourcestate, i)->bp = log_add(TRELLIS_CELL_HMM(sourcestate, i)->bp, TRELLIS_CELL_HMM(targetstate, i+1)->bp + target_prob);
-	    }
-	}
-    }
-    return(TRELLIS_CELL_HMM(0,0)->bp);
+static double bench_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
 }
 
-PROB trellis_viterbi(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
-    int i, sourcestate, targetstate, symbol, final_state;
-    PROB target_prob, final_prob;
-    
-    for (i = 0; i <= length + 1; i++)
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++)
-	    TRELLIS_CELL(sourcestate,i)->fp = LOGZERO;
-    
-    /* Calculate first transition */
-    TRELLIS_CELL(0,0)->fp = 0;
-    for (i = 0; i < 1 && i < length; i++) {
-	symbol = obs[i];
-	for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-	    target_prob = *TRANSITION(fsm, 0, symbol, targetstate);
-	    if (target_prob > SMRZERO_LOG) {
-		TRELLIS_CELL(targetstate,1)->fp = target_prob;
-		TRELLIS_CELL(targetstate,1)->backstate = 0;
-	    }
-	}
-    }
-    /* Calculate remaining transitions */
-    for (i = 1; i < length; i++) {
-	symbol = obs[i];
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++) {
-	    if (TRELLIS_CELL(sourcestate,i)->fp == LOGZERO) { continue; }
-	    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-		target_prob = *TRANSITION(fsm, sourcestate, symbol, targetstate);	       
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		if (TRELLIS_CELL(targetstate,(i+1))->fp == LOGZERO) {
-		    TRELLIS_CELL(targetstate,(i+1))->fp = TRELLIS_CELL(sourcestate,i)->fp + target_prob;
-		    TRELLIS_CELL(targetstate,(i+1))->backstate = sourcestate;
-		} else {		    
-		    if (TRELLIS_CELL(targetstate,(i+1))->fp < TRELLIS_CELL(sourcestate,i)->fp + target_prob) {
-			TRELLIS_CELL(targetstate,(i+1))->fp = TRELLIS_CELL(sourcestate,i)->fp + target_prob;
-			TRELLIS_CELL(targetstate,(i+1))->backstate = sourcestate;
-		    }
+/* Print, for each log2(1+2^x) approximation (scalar, and batch for every */
+/* instruction set this CPU runs), the max. and mean absolute error over  */
+/* (-61,0] against long double log2l(1+exp2l(x)), and ns per element.    */
+void logadd_bench(void) {
+    int i, r, l, cpu, n = 1 << 16, reps = 200;
+    PROB *x, *out, *exact, maxerr, sumerr, err, sink = 0;
+    double t;
+    x = malloc(n * sizeof(PROB));
+    out = malloc(n * sizeof(PROB));
+    exact = malloc(n * sizeof(PROB));
+    for (i = 0; i < n; i++) {
+	x[i] = -61.0 * (i + 0.5) / n;
+	exact[i] = (PROB) log2l(1 + exp2l((long double) x[i]));
+    }
+    printf("variant\tisa\tmax_abs_err\tmean_abs_err\tns_per_elem\n");
+    for (l = 0; l < LOGADD_NUM; l++) {
+	/* Scalar, as called by log_add() */
+	t = bench_seconds();
+	for (r = 0; r < reps; r++) {
+	    for (i = 0; i < n; i++) {
+		switch (l) {
+		case LOGADD_TABLE: out[i] = log1plus_table_interp(x[i]); break;
+		case LOGADD_LIB:   out[i] = log2(exp2(x[i])+1); break;
+		default:           out[i] = log1plus_minimax(x[i]); break;
 		}
 	    }
+	    sink += out[r % n];
 	}
-    }
-    
-    /* Calculate final state probabilities */
-    i = length;
-    final_state = -1;
-    for (targetstate = 0, final_prob = SMRZERO_LOG; targetstate < fsm->num_states; targetstate++) {
-	if (TRELLIS_CELL(targetstate,i)->fp == LOGZERO) {
-	    TRELLIS_CELL(targetstate,(i+1))->backstate = -1;
-	    continue;
-	}
-	if (*FINALPROB(fsm, targetstate) > SMRZERO_LOG && TRELLIS_CELL(targetstate,i)->fp > SMRZERO_LOG) { 
-	    TRELLIS_CELL(targetstate,(i+1))->fp = TRELLIS_CELL(targetstate,i)->fp + *FINALPROB(fsm, targetstate);
-	} else {
-	    continue;
+	t = bench_seconds() - t;
+	for (i = 0, maxerr = sumerr = 0; i < n; i++) {
+	    err = ABS(out[i] - exact[i]);
+	    maxerr = err > maxerr ? err : maxerr;
+	    sumerr += err;
 	}
-	if (TRELLIS_CELL(targetstate,(i+1))->fp > final_prob) {
-	    final_prob = TRELLIS_CELL(targetstate,(i+1))->fp;
-	    final_state = targetstate;
-	}
-    }
-    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-	if (targetstate != final_state) {
-	    TRELLIS_CELL(targetstate,(i+1))->backstate = -1;
-	} else {
-	    TRELLIS_CELL(targetstate,(i+1))->backstate = targetstate;
+	printf("%s\tscalar\t%.3g\t%.3g\t%.3f\n", logadd_name(l), maxerr, sumerr / n, t * 1e9 / ((double) n * reps));
+	/* Batch versions */
+	for (cpu = 0; cpu <= g_cpu; cpu++) {
+	    t = bench_seconds();
+	    for (r = 0; r < reps; r++) {
+		log1plus_batch_table[cpu][l](out, x, n);
+		sink += out[r % n];
+	    }
+	    t = bench_seconds() - t;
+	    for (i = 0, maxerr = sumerr = 0; i < n; i++) {
+		err = ABS(out[i] - exact[i]);
+		maxerr = err > maxerr ? err : maxerr;
+		sumerr += err;
+	    }
+	    printf("%s\t%s\t%.3g\t%.3g\t%.3f\n", logadd_name(l), cpu_name(cpu), maxerr, sumerr / n, t * 1e9 / ((double) n * reps));
 	}
     }
-    return(final_prob);
+    if (sink == 42) /* Keep the timed loops from being optimized away */
+	printf("\n");
+    free(x);
+    free(out);
+    free(exact);
 }
 
-PROB trellis_forward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
-    int i, sourcestate, targetstate, end_state;
-    PROB target_prob, final_prob;
-    
-    end_state = hmm->num_states - 1;
-    for (i = 0; i <= length + 1; i++)
-	for (sourcestate = 0; sourcestate < hmm->num_states; sourcestate++)
-	    TRELLIS_CELL_HMM(sourcestate,i)->fp = LOGZERO;
-    
-    /* Calculate first transition */
-    TRELLIS_CELL_HMM(0,0)->fp = 0;
-    for (targetstate = 1; targetstate < hmm->num_states ; targetstate++) {
-	if ((targetstate == end_state && length != 0) || (length == 0 && targetstate != end_state)) {
-	    continue;
-	}
-	if (targetstate == end_state)
-	    target_prob = *HMM_TRANSITION_PROB(hmm, 0, targetstate);
-	else
-	    target_prob = *HMM_TRANSITION_PROB(hmm, 0, targetstate) + *HMM_EMISSION_PROB(hmm, targetstate, obs[0]);
-	if (target_prob > SMRZERO_LOG) {
-	    TRELLIS_CELL_HMM(targetstate, 1)->fp = target_prob;
-	}
-    }
+/* Instantiate the trellis engine (trellis_kernel.h) for the log,  */
+/* tropical, and scaled real semirings, once per instruction set   */
 
-    /* Calculate remaining transitions */
-    for (i = 1; i <= length; i++) {
-	for (sourcestate = 1; sourcestate < end_state; sourcestate++) {
-	    if (TRELLIS_CELL_HMM(sourcestate, i)->fp == LOGZERO) { continue; }
-	    for (targetstate = 0; targetstate < hmm->num_states; targetstate++) {
-		if (i != length && targetstate == end_state) {
-		    continue;
-		}
-		if (targetstate == hmm->num_states - 1 || i == length)
-		    target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate);
-		else
-		    target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate) + *HMM_EMISSION_PROB(hmm, targetstate, obs[i]);
+#define SEMIRING_LOG
+#define TRELLIS_KERNEL_BACKWARD
+#include "trellis_kernel.h"
+#undef SEMIRING_LOG
+#define SEMIRING_MAX
+#include "trellis_kernel.h"
+#undef SEMIRING_MAX
+#define SEMIRING_REAL
+#include "trellis_kernel.h"
+#undef SEMIRING_REAL
+#undef TRELLIS_KERNEL_BACKWARD
 
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		TRELLIS_CELL_HMM(targetstate,(i+1))->fp = log_add(TRELLIS_CELL_HMM(sourcestate, i)->fp + target_prob, TRELLIS_CELL_HMM(targetstate,(i+1))->fp);
-	    }
-	}
-    }
-    final_prob = TRELLIS_CELL_HMM(end_state, i)->fp;
-    return(final_prob);
+#ifdef CPU_DISPATCH
+#define TARGET_AVX2
+#define SEMIRING_LOG
+#define TRELLIS_KERNEL_BACKWARD
+#include "trellis_kernel.h"
+#undef TRELLIS_KERNEL_BACKWARD
+#undef SEMIRING_LOG
+#define SEMIRING_MAX
+#include "trellis_kernel.h"
+#undef SEMIRING_MAX
+#define SEMIRING_REAL
+#include "trellis_kernel.h"
+#undef SEMIRING_REAL
+#undef TARGET_AVX2
+
+#define TARGET_AVX512
+#define SEMIRING_LOG
+#define TRELLIS_KERNEL_BACKWARD
+#include "trellis_kernel.h"
+#undef TRELLIS_KERNEL_BACKWARD
+#undef SEMIRING_LOG
+#define SEMIRING_MAX
+#include "trellis_kernel.h"
+#undef SEMIRING_MAX
+#define SEMIRING_REAL
+#include "trellis_kernel.h"
+#undef SEMIRING_REAL
+#undef TARGET_AVX512
+#endif /* CPU_DISPATCH */
+
+/* Kernel dispatch table, indexed by CPU_GENERIC, CPU_AVX2, CPU_AVX512 */
+static struct trellis_kernels trellis_kernel_table[] = {
+    {trellis_forward_fsm_log, trellis_forward_hmm_log, trellis_backward_fsm_log, trellis_backward_hmm_log,
+     trellis_forward_fsm_max, trellis_forward_hmm_max, trellis_forward_fsm_real, trellis_forward_hmm_real,
+     trellis_bounded_fsm_log, trellis_bounded_hmm_log, trellis_bounded_fsm_max, trellis_bounded_hmm_max, trellis_bounded_fsm_real, trellis_bounded_hmm_real},
+#ifdef CPU_DISPATCH
+    {trellis_forward_fsm_log_avx2, trellis_forward_hmm_log_avx2, trellis_backward_fsm_log_avx2, trellis_backward_hmm_log_avx2,
+     trellis_forward_fsm_max_avx2, trellis_forward_hmm_max_avx2, trellis_forward_fsm_real_avx2, trellis_forward_hmm_real_avx2,
+     trellis_bounded_fsm_log_avx2, trellis_bounded_hmm_log_avx2, trellis_bounded_fsm_max_avx2, trellis_bounded_hmm_max_avx2, trellis_bounded_fsm_real_avx2, trellis_bounded_hmm_real_avx2},
+    {trellis_forward_fsm_log_avx512, trellis_forward_hmm_log_avx512, trellis_backward_fsm_log_avx512, trellis_backward_hmm_log_avx512,
+     trellis_forward_fsm_max_avx512, trellis_forward_hmm_max_avx512, trellis_forward_fsm_real_avx512, trellis_forward_hmm_real_avx512,
+     trellis_bounded_fsm_log_avx512, trellis_bounded_hmm_log_avx512, trellis_bounded_fsm_max_avx512, trellis_bounded_hmm_max_avx512, trellis_bounded_fsm_real_avx512, trellis_bounded_hmm_real_avx512},
+#endif /* CPU_DISPATCH */
+};
+
+struct trellis_kernels *g_kernel = &trellis_kernel_table[CPU_GENERIC];
+
+PROB trellis_backward(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
+    return(g_kernel->backward_fsm(trellis, obs, length, fsm));
 }
 
-PROB trellis_viterbi_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
-    int i, sourcestate, targetstate, symbol, end_state;
-    PROB target_prob, final_prob;
-    
-    end_state = hmm->num_states - 1;
-    for (i = 0; i <= length + 1; i++)
-	for (sourcestate = 0; sourcestate < hmm->num_states; sourcestate++)
-	    TRELLIS_CELL_HMM(sourcestate,i)->fp = LOGZERO;
-    
-    /* Calculate first transition */
-    TRELLIS_CELL_HMM(0,0)->fp = 0;
-    for (targetstate = 1; targetstate < hmm->num_states ; targetstate++) {
-	if (targetstate == end_state && length != 0) {
-	    continue;
-	}
-	target_prob = *HMM_TRANSITION_PROB(hmm, 0, targetstate);
-	if (target_prob > SMRZERO_LOG) {
-	    TRELLIS_CELL_HMM(targetstate,1)->fp = target_prob;
-	    TRELLIS_CELL_HMM(targetstate,1)->backstate = 0;
-	}
-    }
+PROB trellis_backward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
+    return(g_kernel->backward_hmm(trellis, obs, length, hmm));
+}
 
-    /* Calculate remaining transitions */
-    for (i = 1; i <= length; i++) {
-	symbol = obs[i-1];
-	for (sourcestate = 1; sourcestate < end_state; sourcestate++) {
-	    if (TRELLIS_CELL_HMM(sourcestate, i)->fp == LOGZERO) { continue; }
-	    for (targetstate = 0; targetstate < hmm->num_states; targetstate++) {
-		if (i != length && targetstate == end_state) {
-		    continue;
-		}
-		target_prob = *HMM_EMISSION_PROB(hmm, sourcestate, symbol) + *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate);
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		if (TRELLIS_CELL_HMM(targetstate, i+1)->fp == LOGZERO) {
-		    TRELLIS_CELL_HMM(targetstate, i+1)->fp = TRELLIS_CELL_HMM(sourcestate, i)->fp + target_prob;
-		    TRELLIS_CELL_HMM(targetstate, i+1)->backstate = sourcestate;
-		} else {
-		    if (TRELLIS_CELL_HMM(targetstate, i+1)->fp < TRELLIS_CELL_HMM(sourcestate,i)->fp + target_prob) {
-			TRELLIS_CELL_HMM(targetstate, i+1)->fp = TRELLIS_CELL_HMM(sourcestate,i)->fp + target_prob;
-			TRELLIS_CELL_HMM(targetstate, i+1)->backstate = sourcestate;
-		    }
-		}
-	    }
-	}
-    }
-    final_prob = TRELLIS_CELL_HMM(end_state, i)->fp;
-    return(final_prob);
+PROB trellis_viterbi(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
+    return(g_kernel->viterbi_fsm(trellis, obs, length, fsm));
+}
+
+PROB trellis_viterbi_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
+    return(g_kernel->viterbi_hmm(trellis, obs, length, hmm));
 }
 
 PROB trellis_forward_fsm(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
-    int i, sourcestate, targetstate, symbol;
-    PROB target_prob, final_prob;
+    return(g_kernel->forward_fsm(trellis, obs, length, fsm));
+}
 
-    for (i = 0; i <= length + 1; i++)
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++)
-	    TRELLIS_CELL(sourcestate,i)->fp = LOGZERO;
-    
-    /* Calculate first transition */
-    TRELLIS_CELL(0,0)->fp = 0;
-    for (i = 0; i < 1 && i < length; i++) {
-	symbol = obs[i];
-	for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-	    target_prob = *TRANSITION(fsm, 0, symbol, targetstate);
-	    if (target_prob > SMRZERO_LOG) {
-		TRELLIS_CELL(targetstate,1)->fp = target_prob;
-		TRELLIS_CELL(targetstate,1)->backstate = 0;
-	    }
-	}
-    }
-    /* Calculate remaining transitions */
-    for (i = 1; i < length; i++) {
-	symbol = obs[i];
-	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++) {
-	    if (TRELLIS_CELL(sourcestate,i)->fp == LOGZERO) { continue; }
-	    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
-		target_prob = *TRANSITION(fsm, sourcestate, symbol, targetstate);
-		if (target_prob <= SMRZERO_LOG) { continue; }
-		TRELLIS_CELL(targetstate,(i+1))->fp = log_add(TRELLIS_CELL(sourcestate,i)->fp + target_prob, TRELLIS_CELL(targetstate,(i+1))->fp);
-	    }
-	}
-    }
-    
-    /* Calculate final state probabilities */
-    i = length;
-    for (targetstate = 0, final_prob = SMRZERO_LOG; targetstate < fsm->num_states; targetstate++) {
-	if (TRELLIS_CELL(targetstate,i)->fp == LOGZERO) { continue; }
-	if (*FINALPROB(fsm, targetstate) > SMRZERO_LOG && TRELLIS_CELL(targetstate,i)->fp > SMRZERO_LOG) {
-	    TRELLIS_CELL(targetstate,(i+1))->fp = TRELLIS_CELL(targetstate,i)->fp + *FINALPROB(fsm, targetstate);
-	} else {
-	    continue;
-	}
-	final_prob = log_add(final_prob, TRELLIS_CELL(targetstate,(i+1))->fp);
-    }
-    return(final_prob);
+PROB trellis_forward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
+    return(g_kernel->forward_hmm(trellis, obs, length, hmm));
 }
 
 struct trellis *trellis_init(struct observations *o, int num_states) {
@@ -776,7 +787,7 @@ struct trellis *trellis_init(struct observations *o, int num_states) {
     for (olenmax = 0 ; o != NULL; o = o->next) {
 	olenmax = olenmax < o->size ? o->size : olenmax;
     }
-    trellis = calloc((olenmax + 2) * num_states, sizeof(struct trellis));
+    trellis = big_alloc((size_t) (olenmax + 2) * num_states * sizeof(struct trellis));
     return(trellis);
 }
 
@@ -790,7 +801,7 @@ void trellis_print(struct trellis *trellis, struct wfsa *fsm, int obs_len) {
     }
 }
 
-void forward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len) {
+void forward_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len) {
     int i, j, beststate;
     PROB bestprob;
     for (i = 0; i <= obs_len+1; i++) {
@@ -807,13 +818,13 @@ void forward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len)
 		beststate = j;
 	    }
 	}
-	printf("%i", beststate);
-	if (i < obs_len) printf(" ");
+	fprintf(out, "%i", beststate);
+	if (i < obs_len) fprintf(out, " ");
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
-void forward_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_len) {
+void forward_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len) {
     int i, j, beststate;
     PROB bestprob;
     for (i = 0; i <= obs_len + 1; i++) {
@@ -830,14 +841,14 @@ void forward_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_le
 		beststate = j;
 	    }
 	}
-	printf("%i", beststate);
-	if (i < obs_len + 1) printf(" ");
+	fprintf(out, "%i", beststate);
+	if (i < obs_len + 1) fprintf(out, " ");
     }
-    printf("%i", hmm->num_states - 1);
-    printf("\n");
+    fprintf(out, "%i", hmm->num_states - 1);
+    fprintf(out, "\n");
 }
 
-void backward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len) {
+void backward_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len) {
     int i, j, beststate;
     PROB bestprob;
     for (i = 0; i <= obs_len; i++) {
@@ -852,13 +863,13 @@ void backward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len)
 		beststate = j;
 	    }
 	}
-	printf("%i", beststate);
-	if (i < obs_len) printf(" ");
+	fprintf(out, "%i", beststate);
+	if (i < obs_len) fprintf(out, " ");
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
-void backward_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_len) {
+void backward_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len) {
     int i, j, beststate;
     PROB bestprob;
     for (i = 0; i <= obs_len + 1; i++) {
@@ -873,13 +884,13 @@ void backward_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_l
 		beststate = j;
 	    }
 	}
-	printf("%i", beststate);
-	if (i <= obs_len) printf(" ");
+	fprintf(out, "%i", beststate);
+	if (i <= obs_len) fprintf(out, " ");
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
-void viterbi_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len) {
+void viterbi_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len) {
     int i, laststate, *path;
     path = malloc(sizeof(int) * (obs_len+1));
     for (i = 0; i < fsm->num_states; i++) {
@@ -893,16 +904,16 @@ void viterbi_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len)
 	laststate = TRELLIS_CELL(laststate, i)->backstate;
     }
     for (i = 0 ; i <= obs_len; i++) {
-	printf("%i", path[i]);
+	fprintf(out, "%i", path[i]);
 	if (i < obs_len) {
-	    printf(" ");
+	    fprintf(out, " ");
 	}
     }
-    printf("\n");
+    fprintf(out, "\n");
     free(path);
 }
 
-void viterbi_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_len) {
+void viterbi_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len) {
     int i, laststate, *path;
     path = malloc(sizeof(int) * (obs_len + 2));
     laststate = hmm->num_states - 1;
@@ -912,57 +923,526 @@ void viterbi_print_path_hmm(struct trellis *trellis, struct hmm *hmm, int obs_le
 	laststate = TRELLIS_CELL_HMM(laststate, i)->backstate;
     }
     for (i = 0 ; i <= obs_len + 1; i++) {
-	printf("%i", path[i]);
+	fprintf(out, "%i", path[i]);
 	if (i < obs_len + 1) {
-	    printf(" ");
+	    fprintf(out, " ");
 	}
     }
-    printf("\n");
+    fprintf(out, "\n");
     free(path);
 }
 
-void viterbi(struct wfsa *fsm, struct observations *o, int algorithm) {
-    struct observations *obs;
+/* k best Viterbi paths by lazy enumeration (Huang & Chiang 2005, Alg. 3) */
+/* over a trellis filled by the Viterbi (max semiring) kernel. Each node   */
+/* (state, column) keeps its derivations found so far, best first, and a   */
+/* heap of candidates with one entry per incoming arc: (source state, rank */
+/* of the derivation used at the source). The heap is only built when a    */
+/* node is first asked for a derivation, and popping a candidate pushes    */
+/* only its successor (same source, next rank), so k paths cost about one */
+/* Viterbi pass plus O(k log k) per node on the paths.                     */
+/* Column length+1 holds one node: the final state (WFSA, as state 0) or   */
+/* the end state (HMM).                                                    */
+
+struct kbest_deriv {
+    PROB score;
+    int source;   /* State in the previous column, -1 at the start node */
+    int rank;     /* Derivation used at the source                      */
+};
+
+struct kbest_node {
+    struct kbest_deriv *derivs;
+    struct kbest_deriv *cand;
+    int numderivs, maxderivs, numcand, initialized, next_pushed;
+};
+
+struct kbest {
+    struct kbest_node *nodes;
+    struct trellis *trellis;
+    struct wfsa *fsm;
+    struct hmm *hmm;
+    int *obs;
+    int length;
+    int num_states;
+};
+
+/* Weight of the arc from source in column col-1 to target in column col */
+PROB kbest_arc(struct kbest *kb, int source, int target, int col) {
+    int end_state;
+    if (kb->fsm != NULL) {
+	if (col == kb->length + 1)
+	    return(*FINALPROB(kb->fsm, source));
+	return(*TRANSITION(kb->fsm, source, kb->obs[col-1], target));
+    }
+    end_state = kb->num_states - 1;
+    if (source == end_state)
+	return(SMRZERO_LOG);
+    if (col == kb->length + 1)
+	return(target == end_state ? *HMM_TRANSITION_PROB(kb->hmm, source, end_state) : SMRZERO_LOG);
+    if (target == 0 || target == end_state || *(HMM_EMISSION_COLUMN(kb->hmm, kb->obs[col-1]) + target) <= SMRZERO_LOG)
+	return(SMRZERO_LOG);
+    return(*HMM_TRANSITION_PROB(kb->hmm, source, target) + *(HMM_EMISSION_COLUMN(kb->hmm, kb->obs[col-1]) + target));
+}
+
+void kbest_heap_push(struct kbest_node *node, struct kbest_deriv d) {
+    int i, parent;
+    for (i = node->numcand++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (node->cand[parent].score >= d.score) { break; }
+	node->cand[i] = node->cand[parent];
+    }
+    node->cand[i] = d;
+}
+
+struct kbest_deriv kbest_heap_pop(struct kbest_node *node) {
+    struct kbest_deriv top, last;
+    int i, child;
+    top = node->cand[0];
+    last = node->cand[--node->numcand];
+    for (i = 0; (child = 2 * i + 1) < node->numcand; i = child) {
+	if (child + 1 < node->numcand && node->cand[child+1].score > node->cand[child].score)
+	    child++;
+	if (last.score >= node->cand[child].score) { break; }
+	node->cand[i] = node->cand[child];
+    }
+    node->cand[i] = last;
+    return(top);
+}
+
+int kbest_get(struct kbest *kb, int state, int col, int rank);
+
+/* Push the successor of the last derivation of a node onto its heap */
+void kbest_next(struct kbest *kb, struct kbest_node *node, int state, int col) {
+    struct kbest_deriv last, d;
+    node->next_pushed = 1;
+    last = node->derivs[node->numderivs-1];
+    if (last.source < 0)
+	return;
+    if (kbest_get(kb, last.source, col-1, last.rank + 1)) {
+	d.source = last.source;
+	d.rank = last.rank + 1;
+	d.score = kb->nodes[(col-1) * kb->num_states + last.source].derivs[d.rank].score + kbest_arc(kb, last.source, state, col);
+	kbest_heap_push(node, d);
+    }
+}
+
+/* Make sure a node has a derivation of the given rank; 0 if it has none */
+int kbest_get(struct kbest *kb, int state, int col, int rank) {
+    struct kbest_node *node;
+    struct kbest_deriv d;
+    struct trellis *trellis;
+    int s;
+    PROB w;
+
+    trellis = kb->trellis;
+    node = &kb->nodes[col * kb->num_states + state];
+    if (!node->initialized) {
+	node->initialized = 1;
+	node->cand = malloc(sizeof(struct kbest_deriv) * kb->num_states);
+	for (s = 0; s < kb->num_states; s++) {
+	    if ((trellis + (col-1) * kb->num_states + s)->fp == LOGZERO) { continue; }
+	    if ((w = kbest_arc(kb, s, state, col)) <= SMRZERO_LOG) { continue; }
+	    d.score = (trellis + (col-1) * kb->num_states + s)->fp + w;
+	    d.source = s;
+	    d.rank = 0;
+	    kbest_heap_push(node, d);
+	}
+    }
+    while (node->numderivs <= rank) {
+	if (node->numderivs > 0 && !node->next_pushed)
+	    kbest_next(kb, node, state, col);
+	if (node->numcand == 0)
+	    break;
+	if (node->numderivs == node->maxderivs) {
+	    node->maxderivs = node->maxderivs * 2 + 1;
+	    node->derivs = realloc(node->derivs, sizeof(struct kbest_deriv) * node->maxderivs);
+	}
+	node->derivs[node->numderivs++] = kbest_heap_pop(node);
+	node->next_pushed = 0;
+    }
+    return(node->numderivs > rank);
+}
+
+/* Print up to k best paths, one per line with its probability, after */
+/* the trellis has been filled by trellis_viterbi[_hmm]()              */
+void viterbi_print_kbest(FILE *out, struct trellis *trellis, struct wfsa *fsm, struct hmm *hmm, int *obs, int obs_len, int k) {
+    struct kbest kb;
+    struct kbest_deriv d;
+    int i, j, col, state, lastcol, *path;
+
+    kb.trellis = trellis;
+    kb.fsm = fsm;
+    kb.hmm = hmm;
+    kb.obs = obs;
+    kb.length = obs_len;
+    kb.num_states = fsm != NULL ? fsm->num_states : hmm->num_states;
+    kb.nodes = calloc(kb.num_states * (obs_len + 2), sizeof(struct kbest_node));
+    /* Start node: state 0 in column 0 */
+    kb.nodes[0].initialized = 1;
+    kb.nodes[0].derivs = malloc(sizeof(struct kbest_deriv));
+    kb.nodes[0].maxderivs = kb.nodes[0].numderivs = 1;
+    kb.nodes[0].derivs[0].score = 0;
+    kb.nodes[0].derivs[0].source = -1;
+    kb.nodes[0].derivs[0].rank = 0;
+
+    state = fsm != NULL ? 0 : kb.num_states - 1;
+    lastcol = fsm != NULL ? obs_len : obs_len + 1; /* Last column printed */
+    path = malloc(sizeof(int) * (obs_len + 2));
+    for (j = 0; j < k && kbest_get(&kb, state, obs_len + 1, j); j++) {
+	d = kb.nodes[(obs_len + 1) * kb.num_states + state].derivs[j];
+	if (hmm != NULL)
+	    path[obs_len+1] = state;
+	for (col = obs_len; col >= 0; col--) {
+	    path[col] = d.source;
+	    if (col > 0) {
+		/* Rank 0 candidates are scored from the trellis directly, */
+		/* so the source may not have its derivations listed yet  */
+		kbest_get(&kb, d.source, col, d.rank);
+		d = kb.nodes[col * kb.num_states + d.source].derivs[d.rank];
+	    }
+	}
+	d = kb.nodes[(obs_len + 1) * kb.num_states + state].derivs[j];
+	fprintf(out, "%.17g\t", output_convert(d.score));
+	for (i = 0; i <= lastcol; i++) {
+	    fprintf(out, "%i", path[i]);
+	    if (i < lastcol) {
+		fprintf(out, " ");
+	    }
+	}
+	fprintf(out, "\n");
+    }
+    fprintf(out, "\n");
+    for (i = 0; i < kb.num_states * (obs_len + 2); i++) {
+	free(kb.nodes[i].derivs);
+	free(kb.nodes[i].cand);
+    }
+    free(kb.nodes);
+    free(path);
+}
+
+/* Decoding with more than one thread: the observations are taken in    */
+/* blocks of DECODE_BLOCK per thread, and each block is shared out by    */
+/* the scheduler (pool.c), heaviest observations first, as in training. */
+/* Each thread prints its observations of a block to a memory stream,    */
+/* and the output of the block is copied to stdout in input order by     */
+/* thread 0 at the start of the next block, while the other threads go   */
+/* on decoding, or at the end. So the output of at most two blocks is    */
+/* held in memory, and it reaches a pipe as decoding proceeds.           */
+
+#define DECODE_BLOCK 256
+
+/* Output of a block */
+struct decode_block {
+    int numobs;
+    int num_threads;
+    int *writer;               /* Thread, offset and length of the output of */
+    long *start;               /* each observation of the block              */
+    long *length;
+    char **bufs;               /* Memory stream of each thread */
+    size_t *sizes;
+};
+
+/* Per-thread state of decode_observations() */
+struct decode_args {
+    struct sched *sched;
+    int thread;
+    struct observations **obsarray;  /* Observations of the block */
+    struct decode_block *block;
+    struct decode_block *prev;       /* Block to be written, or NULL */
+    struct trellis *trellis;
+    struct wfsa *fsm;
+    struct hmm *hmm;
+    int algorithm;
+    decode_fn decode;
+};
+
+#ifndef _WIN32
+static void decode_block_write(struct decode_block *blk) {
+    int i;
+    for (i = 0; i < blk->numobs; i++)
+	fwrite(blk->bufs[blk->writer[i]] + blk->start[i], 1, blk->length[i], stdout);
+    fflush(stdout);
+    for (i = 0; i < blk->num_threads; i++) {
+	free(blk->bufs[i]);
+	blk->bufs[i] = NULL;
+    }
+}
+
+static void *decode_thread(void *threadargs) {
+    struct decode_args *args;
+    struct decode_block *blk;
+    FILE *out;
+    const int *idx;
+    int j, n;
+    long pos;
+    args = (struct decode_args *) threadargs;
+    blk = args->block;
+    if (args->thread == 0 && args->prev != NULL)
+	decode_block_write(args->prev);
+    if ((out = open_memstream(&blk->bufs[args->thread], &blk->sizes[args->thread])) == NULL) {
+	perror("open_memstream");
+	exit(EXIT_FAILURE);
+    }
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    pos = ftell(out);
+	    args->decode(out, args->trellis, args->obsarray[idx[j]], args->fsm, args->hmm, args->algorithm);
+	    blk->writer[idx[j]] = args->thread;
+	    blk->start[idx[j]] = pos;
+	    blk->length[idx[j]] = ftell(out) - pos;
+	}
+    }
+    fclose(out);
+    return(NULL);
+}
+#endif /* _WIN32 */
+
+/* Runs decode on every observation and prints the results in input order */
+void decode_observations(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int algorithm, decode_fn decode) {
+    struct observations *obs, **obsarray;
+    struct decode_args **args;
+    struct decode_block blocks[2];
+    struct sched *sched, *total;
     struct trellis *trellis;
+    int i, b, first, blocksize, numobs, num_states, num_threads;
+
+    num_states = fsm != NULL ? fsm->num_states : hmm->num_states;
+    for (obs = o, numobs = 0; obs != NULL; obs = obs->next)
+	numobs++;
+    num_threads = pool_threads() < numobs ? pool_threads() : numobs;
+#ifdef _WIN32
+    num_threads = 1;           /* No open_memstream() */
+#endif /* _WIN32 */
+    if (num_threads <= 1) {
+	trellis = trellis_init(o, num_states);
+	for (obs = o; obs != NULL; obs = obs->next)
+	    decode(stdout, trellis, obs, fsm, hmm, algorithm);
+	big_free(trellis);
+	return;
+    }
+#ifndef _WIN32
+    obsarray = observations_to_array(o, &numobs);
+    blocksize = DECODE_BLOCK * num_threads;
+    for (b = 0; b < 2; b++) {
+	blocks[b].num_threads = num_threads;
+	blocks[b].writer = malloc(sizeof(int) * blocksize);
+	blocks[b].start = malloc(sizeof(long) * blocksize);
+	blocks[b].length = malloc(sizeof(long) * blocksize);
+	blocks[b].bufs = calloc(num_threads, sizeof(char *));
+	blocks[b].sizes = malloc(sizeof(size_t) * num_threads);
+    }
+    total = sched_create(obsarray, 0, num_threads);
+    fflush(stdout);
+    args = malloc(sizeof(struct decode_args *) * num_threads);
+    for (i = 0; i < num_threads; i++) {
+	args[i] = calloc(1, sizeof(struct decode_args));
+	args[i]->thread = i;
+	args[i]->trellis = trellis_init(o, num_states);
+	args[i]->fsm = fsm;
+	args[i]->hmm = hmm;
+	args[i]->algorithm = algorithm;
+	args[i]->decode = decode;
+    }
+    for (first = 0, b = 0; first < numobs; first += blocksize, b++) {
+	blocks[b % 2].numobs = numobs - first < blocksize ? numobs - first : blocksize;
+	sched = sched_create(obsarray + first, blocks[b % 2].numobs, num_threads);
+	for (i = 0; i < num_threads; i++) {
+	    args[i]->sched = sched;
+	    args[i]->obsarray = obsarray + first;
+	    args[i]->block = &blocks[b % 2];
+	    args[i]->prev = b > 0 ? &blocks[(b + 1) % 2] : NULL;
+	}
+	pool_run(num_threads, &decode_thread, (void **) args);
+	sched_add(total, sched);
+	sched_destroy(sched);
+    }
+    decode_block_write(&blocks[(b + 1) % 2]);
+    if (g_verbose)
+	sched_report(total, "Decoding");
+    for (i = 0; i < num_threads; i++) {
+	big_free(args[i]->trellis);
+	free(args[i]);
+    }
+    free(args);
+    for (b = 0; b < 2; b++) {
+	free(blocks[b].writer);
+	free(blocks[b].start);
+	free(blocks[b].length);
+	free(blocks[b].bufs);
+	free(blocks[b].sizes);
+    }
+    sched_destroy(total);
+    free(obsarray);
+#endif /* _WIN32 */
+}
+
+static void viterbi_observation(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm) {
     PROB viterbi_prob;
-    trellis = trellis_init(o, fsm->num_states);
-    for (obs = o; obs != NULL; obs = obs->next) {
+    if (fsm != NULL)
 	viterbi_prob = trellis_viterbi(trellis, obs->data, obs->size, fsm);
-	if (algorithm == DECODE_VITERBI_PROB)
-	    printf("%.17g\t", output_convert(viterbi_prob));
-	if (algorithm == LIKELIHOOD_VITERBI)
-	    printf("%.17g\n", output_convert(viterbi_prob));
-	if (algorithm == DECODE_VITERBI_PROB || algorithm == DECODE_VITERBI) {
-	    if (viterbi_prob > SMRZERO_LOG) {
-		viterbi_print_path(trellis, fsm, obs->size);
-	    } else {
-		printf("\n");
-	    }
+    else
+	viterbi_prob = trellis_viterbi_hmm(trellis, obs->data, obs->size, hmm);
+    if (algorithm == DECODE_VITERBI_PROB)
+	fprintf(out, "%.17g\t", output_convert(viterbi_prob));
+    if (algorithm == LIKELIHOOD_VITERBI)
+	fprintf(out, "%.17g\n", output_convert(viterbi_prob));
+    if (algorithm == DECODE_VITERBI_PROB || algorithm == DECODE_VITERBI) {
+	if (viterbi_prob <= SMRZERO_LOG) {
+	    fprintf(out, "\n");
+	} else if (fsm != NULL) {
+	    viterbi_print_path(out, trellis, fsm, obs->size);
+	} else {
+	    viterbi_print_path_hmm(out, trellis, hmm, obs->size);
 	}
     }
-    free(trellis);
+    if (algorithm == DECODE_VITERBI_KBEST)
+	viterbi_print_kbest(out, trellis, fsm, hmm, obs->data, obs->size, g_kbest);
+}
+
+void viterbi(struct wfsa *fsm, struct observations *o, int algorithm) {
+    decode_observations(fsm, NULL, o, algorithm, &viterbi_observation);
 }
 
 void viterbi_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
+    hmm_emission_columns(hmm);
+    decode_observations(NULL, hmm, o, algorithm, &viterbi_observation);
+}
+
+/* Early abandonment (--threshold): suffix[i] bounds the log2 weight of */
+/* reading obs[i] ... from any state, using per-symbol bounds on one step */
+/* (the largest row sum for forward, the largest weight for Viterbi)     */
+void threshold_suffix(PROB *suffix, int *obs, int length, PROB *step, PROB final) {
+    int i;
+    suffix[length] = final;
+    for (i = length - 1; i >= 0; i--) {
+	if (suffix[i+1] <= SMRZERO_LOG || step[obs[i]] <= SMRZERO_LOG)
+	    suffix[i] = SMRZERO_LOG;
+	else
+	    suffix[i] = suffix[i+1] + step[obs[i]];
+    }
+}
+
+void threshold_print(PROB prob) {
+    if (prob > SMRZERO_LOG && prob >= g_threshold) {
+	if (g_threshold_mode == THRESHOLD_PRINT_PROB)
+	    printf("%.17g\n", output_convert(prob));
+	else
+	    printf("accept\n");
+    } else {
+	printf("reject\n");
+    }
+}
+
+void threshold_fsm(struct wfsa *fsm, struct observations *o, int algorithm) {
     struct observations *obs;
     struct trellis *trellis;
-    PROB viterbi_prob;
-    trellis = trellis_init(o, hmm->num_states);
+    PROB *step, *suffix, final, prob, w, rowbound;
+    int s, t, a, maxlen;
+
+    step = malloc(sizeof(PROB) * fsm->alphabet_size);
+    for (a = 0; a < fsm->alphabet_size; a++) {
+	step[a] = SMRZERO_LOG;
+	for (s = 0; s < fsm->num_states; s++) {
+	    for (t = 0, rowbound = 0; t < fsm->num_states; t++) {
+		if ((w = *TRANSITION(fsm, s, a, t)) <= SMRZERO_LOG) { continue; }
+		rowbound = algorithm == LIKELIHOOD_VITERBI ? (EXP(w) > rowbound ? EXP(w) : rowbound) : rowbound + EXP(w);
+	    }
+	    if (rowbound > 0 && LOG(rowbound) > step[a])
+		step[a] = LOG(rowbound);
+	}
+    }
+    for (s = 0, final = SMRZERO_LOG; s < fsm->num_states; s++) {
+	if (*FINALPROB(fsm, s) > final)
+	    final = *FINALPROB(fsm, s);
+    }
+    for (obs = o, maxlen = 0; obs != NULL; obs = obs->next)
+	maxlen = obs->size > maxlen ? obs->size : maxlen;
+    suffix = malloc(sizeof(PROB) * (maxlen + 1));
+    trellis = trellis_init(o, fsm->num_states);
     for (obs = o; obs != NULL; obs = obs->next) {
-	viterbi_prob = trellis_viterbi_hmm(trellis, obs->data, obs->size, hmm);
-	if (algorithm == DECODE_VITERBI_PROB)
-	    printf("%.17g\t", output_convert(viterbi_prob));
+	threshold_suffix(suffix, obs->data, obs->size, step, final);
 	if (algorithm == LIKELIHOOD_VITERBI)
-	    printf("%.17g\n", output_convert(viterbi_prob));
-	if (algorithm == DECODE_VITERBI_PROB || algorithm == DECODE_VITERBI) {
-	    if (viterbi_prob > SMRZERO_LOG) {
-		viterbi_print_path_hmm(trellis, hmm, obs->size);
-	    } else {
-		printf("\n");
+	    prob = g_kernel->bounded_fsm_max(trellis, obs->data, obs->size, fsm, suffix, g_threshold);
+	else if (algorithm == LIKELIHOOD_FORWARD_SCALED)
+	    prob = g_kernel->bounded_fsm_real(trellis, obs->data, obs->size, fsm, suffix, g_threshold);
+	else
+	    prob = g_kernel->bounded_fsm_log(trellis, obs->data, obs->size, fsm, suffix, g_threshold);
+	threshold_print(prob);
+    }
+    big_free(trellis);
+    free(suffix);
+    free(step);
+}
+
+void threshold_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
+    struct observations *obs;
+    struct trellis *trellis;
+    PROB *step, *suffix, final, prob, w, rowbound;
+    int s, t, a, maxlen, end_state;
+
+    end_state = hmm->num_states - 1;
+    step = malloc(sizeof(PROB) * hmm->alphabet_size);
+    for (a = 0; a < hmm->alphabet_size; a++) {
+	step[a] = SMRZERO_LOG;
+	for (s = 0; s < end_state; s++) {
+	    for (t = 1, rowbound = 0; t < end_state; t++) {
+		if ((w = *HMM_TRANSITION_PROB(hmm, s, t) + *HMM_EMISSION_PROB(hmm, t, a)) <= SMRZERO_LOG) { continue; }
+		rowbound = algorithm == LIKELIHOOD_VITERBI ? (EXP(w) > rowbound ? EXP(w) : rowbound) : rowbound + EXP(w);
 	    }
+	    if (rowbound > 0 && LOG(rowbound) > step[a])
+		step[a] = LOG(rowbound);
 	}
     }
-    free(trellis);
+    for (s = 0, final = SMRZERO_LOG; s < end_state; s++) {
+	if (*HMM_TRANSITION_PROB(hmm, s, end_state) > final)
+	    final = *HMM_TRANSITION_PROB(hmm, s, end_state);
+    }
+    for (obs = o, maxlen = 0; obs != NULL; obs = obs->next)
+	maxlen = obs->size > maxlen ? obs->size : maxlen;
+    suffix = malloc(sizeof(PROB) * (maxlen + 1));
+    trellis = trellis_init(o, hmm->num_states);
+    hmm_emission_columns(hmm);
+    for (obs = o; obs != NULL; obs = obs->next) {
+	threshold_suffix(suffix, obs->data, obs->size, step, final);
+	if (algorithm == LIKELIHOOD_VITERBI)
+	    prob = g_kernel->bounded_hmm_max(trellis, obs->data, obs->size, hmm, suffix, g_threshold);
+	else if (algorithm == LIKELIHOOD_FORWARD_SCALED)
+	    prob = g_kernel->bounded_hmm_real(trellis, obs->data, obs->size, hmm, suffix, g_threshold);
+	else
+	    prob = g_kernel->bounded_hmm_log(trellis, obs->data, obs->size, hmm, suffix, g_threshold);
+	threshold_print(prob);
+    }
+    big_free(trellis);
+    free(suffix);
+    free(step);
+}
+
+/* Scorer of jit_observation(), see decode_observations() */
+static struct jit_scorer *jit_decode_scorer = NULL;
+
+static void jit_observation(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm) {
+    PROB prob;
+    if (algorithm == LIKELIHOOD_VITERBI)
+	prob = jit_decode_scorer->viterbi(obs->data, obs->size);
+    else
+	prob = jit_decode_scorer->forward(obs->data, obs->size);
+    fprintf(out, "%.17g\n", output_convert(prob));
+}
+
+/* Calculate likelihoods with a scorer compiled for this model (jit.c), */
+/* on the threads of --threads. Returns 0 if no scorer could be built,  */
+/* and the caller falls back on the trellis functions                   */
+int likelihood_jit(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int algorithm) {
+    struct jit_scorer *js;
+    js = fsm != NULL ? jit_scorer_fsm(fsm, g_jit_cachedir) : jit_scorer_hmm(hmm, g_jit_cachedir);
+    if (js == NULL) {
+	fprintf(stderr, "JIT: falling back on trellis calculation\n");
+	return(0);
+    }
+    jit_decode_scorer = js;
+    decode_observations(fsm, hmm, o, algorithm, &jit_observation);
+    jit_decode_scorer = NULL;
+    jit_scorer_destroy(js);
+    return(1);
 }
 
 PROB hmm_sum_transition_prob(struct hmm *hmm, int state) {
@@ -1181,7 +1661,7 @@ PROB loglikelihood_all_observations_fsm(struct wfsa *fsm, struct observations *o
 	forward_prob = obs->occurrences * trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
 	ll = ll == LOGZERO ? forward_prob : ll + forward_prob;
     }
-    free(trellis);
+    big_free(trellis);
     return(ll);
 }
 
@@ -1191,152 +1671,433 @@ PROB loglikelihood_all_observations_hmm(struct hmm *hmm, struct observations *o)
     PROB forward_prob;
     PROB ll;
     trellis = trellis_init(o, hmm->num_states);
+    hmm_emission_columns(hmm);
     for (obs = o, ll = LOGZERO; obs != NULL; obs = obs->next) {
 	forward_prob = obs->occurrences * trellis_forward_hmm(trellis, obs->data, obs->size, hmm);
 	ll = ll == LOGZERO ? forward_prob : ll + forward_prob;
     }
-    free(trellis);
+    big_free(trellis);
     return(ll);
 }
 
-void forward_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
-    struct observations *obs;
-    struct trellis *trellis;
+static void forward_observation(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm) {
     PROB forward_prob;
-    trellis = trellis_init(o, hmm->num_states);
-    for (obs = o; obs != NULL; obs = obs->next) {
+    if (fsm != NULL && algorithm == LIKELIHOOD_FORWARD_SCALED)
+	forward_prob = g_kernel->forward_fsm_real(trellis, obs->data, obs->size, fsm);
+    else if (fsm != NULL)
+	forward_prob = trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
+    else if (algorithm == LIKELIHOOD_FORWARD_SCALED)
+	forward_prob = g_kernel->forward_hmm_real(trellis, obs->data, obs->size, hmm);
+    else
 	forward_prob = trellis_forward_hmm(trellis, obs->data, obs->size, hmm);
-	if (algorithm == DECODE_FORWARD_PROB)
-	    printf("%.17g\t", output_convert(forward_prob));
-	if (algorithm == LIKELIHOOD_FORWARD)
-	    printf("%.17g\n", output_convert(forward_prob));
-	if (algorithm == DECODE_FORWARD_PROB || algorithm == DECODE_FORWARD) {
-	    if (forward_prob > SMRZERO_LOG) {
-		forward_print_path_hmm(trellis, hmm, obs->size);
-	    } else {
-		printf("\n");
-	    }
+    if (algorithm == DECODE_FORWARD_PROB)
+	fprintf(out, "%.17g\t", output_convert(forward_prob));
+    if (algorithm == LIKELIHOOD_FORWARD || algorithm == LIKELIHOOD_FORWARD_SCALED)
+	fprintf(out, "%.17g\n", output_convert(forward_prob));
+    if (algorithm == DECODE_FORWARD_PROB || algorithm == DECODE_FORWARD) {
+	if (forward_prob <= SMRZERO_LOG) {
+	    fprintf(out, "\n");
+	} else if (fsm != NULL) {
+	    forward_print_path(out, trellis, fsm, obs->size);
+	} else {
+	    forward_print_path_hmm(out, trellis, hmm, obs->size);
 	}
     }
-    free(trellis);
+}
+
+void forward_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
+    hmm_emission_columns(hmm);
+    decode_observations(NULL, hmm, o, algorithm, &forward_observation);
 }
 
 void forward_fsm(struct wfsa *fsm, struct observations *o, int algorithm) {
-    struct observations *obs;
-    struct trellis *trellis;
-    PROB forward_prob;
-    trellis = trellis_init(o, fsm->num_states);
-    for (obs = o; obs != NULL; obs = obs->next) {
-	forward_prob = trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
-	if (algorithm == DECODE_FORWARD_PROB)
-	    printf("%.17g\t", output_convert(forward_prob));
-	if (algorithm == LIKELIHOOD_FORWARD)
-	    printf("%.17g\n", output_convert(forward_prob));
-	if (algorithm == DECODE_FORWARD_PROB || algorithm == DECODE_FORWARD) {
-	    if (forward_prob > SMRZERO_LOG) {
-		forward_print_path(trellis, fsm, obs->size);
-	    } else {
-		printf("\n");
-	    }
-	}
+    decode_observations(fsm, NULL, o, algorithm, &forward_observation);
+}
+
+/* Write the state posteriors of each observation to a binary file:    */
+/*   header:   "TREBAPOS", int32 version (1), int32 number of states,    */
+/*             int32 number of observations                              */
+/*   per observation: int32 rows, float32 log2 likelihood, then          */
+/*             rows x states float32 posteriors, row-major               */
+/* For a WFSA, row t (0 ... length) is the state after t symbols; for an */
+/* HMM, row t (0 ... length-1) is the state emitting symbol t. Numbers   */
+/* are in native byte order. Observations with probability zero get all  */
+/* zero rows and likelihood -FLT_MAX.                                    */
+static void posteriors_fwrite(const void *ptr, size_t size, size_t n, FILE *outfile) {
+    if (fwrite(ptr, size, n, outfile) != n) {
+	perror("Error writing posteriors");
+	exit(EXIT_FAILURE);
     }
-    free(trellis);
 }
 
-void backward_fsm(struct wfsa *fsm, struct observations *o, int algorithm) {
+void posteriors_write(struct wfsa *fsm, struct hmm *hmm, struct observations *o, char *filename) {
     struct observations *obs;
     struct trellis *trellis;
-    PROB backward_prob;
-    trellis = trellis_init(o, fsm->num_states);
-    for (obs = o; obs != NULL; obs = obs->next) {
-	backward_prob = trellis_backward(trellis, obs->data, obs->size, fsm);
-	if (algorithm == DECODE_BACKWARD_PROB)
-	    printf("%.17g\t", output_convert(backward_prob));
-	if (algorithm == LIKELIHOOD_BACKWARD)
-	    printf("%.17g\n", output_convert(backward_prob));
-	if (algorithm == DECODE_BACKWARD_PROB || algorithm == DECODE_BACKWARD) {
-	    if (backward_prob > SMRZERO_LOG) {
-		backward_print_path(trellis, fsm, obs->size);
-	    } else {
-		printf("\n");
+    FILE *outfile;
+    float *block, fll;
+    PROB ll;
+    int32_t header[3], rows;
+    int i, j, num_states, numobs, firstcol, maxlen;
+    char *iobuf;
+
+    num_states = fsm != NULL ? fsm->num_states : hmm->num_states;
+    if (hmm != NULL)
+	hmm_emission_columns(hmm);
+    if ((outfile = fopen(filename, "wb")) == NULL) {
+	fprintf(stderr, "Error opening '%s' for writing\n", filename);
+	exit(EXIT_FAILURE);
+    }
+    iobuf = malloc(1 << 20);
+    setvbuf(outfile, iobuf, _IOFBF, 1 << 20);
+    for (obs = o, numobs = 0, maxlen = 0; obs != NULL; obs = obs->next, numobs++)
+	maxlen = obs->size > maxlen ? obs->size : maxlen;
+    header[0] = 1;
+    header[1] = num_states;
+    header[2] = numobs;
+    posteriors_fwrite("TREBAPOS", 1, 8, outfile);
+    posteriors_fwrite(header, sizeof(int32_t), 3, outfile);
+
+    block = malloc(sizeof(float) * (maxlen + 1) * num_states);
+    trellis = trellis_init(o, num_states);
+    for (obs = o; obs != NULL; obs = obs->next) {
+	if (fsm != NULL) {
+	    ll = trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
+	    trellis_backward(trellis, obs->data, obs->size, fsm);
+	    rows = obs->size + 1;
+	    firstcol = 0;
+	} else {
+	    ll = trellis_forward_hmm(trellis, obs->data, obs->size, hmm);
+	    trellis_backward_hmm(trellis, obs->data, obs->size, hmm);
+	    rows = obs->size;
+	    firstcol = 1;
+	}
+	for (i = 0; i < rows; i++) {
+	    for (j = 0; j < num_states; j++) {
+		if (ll <= SMRZERO_LOG || (trellis + (i + firstcol) * num_states + j)->fp == LOGZERO || (trellis + (i + firstcol) * num_states + j)->bp == LOGZERO)
+		    block[i * num_states + j] = 0;
+		else
+		    block[i * num_states + j] = (float) EXP((trellis + (i + firstcol) * num_states + j)->fp + (trellis + (i + firstcol) * num_states + j)->bp - ll);
 	    }
 	}
+	fll = ll <= SMRZERO_LOG ? -FLT_MAX : (float) ll;
+	posteriors_fwrite(&rows, sizeof(int32_t), 1, outfile);
+	posteriors_fwrite(&fll, sizeof(float), 1, outfile);
+	posteriors_fwrite(block, sizeof(float), (size_t) rows * num_states, outfile);
+    }
+    if (fclose(outfile) != 0) {
+	perror("Error writing posteriors");
+	exit(EXIT_FAILURE);
     }
-    free(trellis);
+    free(iobuf);
+    free(block);
+    big_free(trellis);
 }
 
-void backward_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
-    struct observations *obs;
-    struct trellis *trellis;
+static void backward_observation(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm) {
     PROB backward_prob;
-    trellis = trellis_init(o, hmm->num_states);
-    for (obs = o; obs != NULL; obs = obs->next) {
+    if (fsm != NULL)
+	backward_prob = trellis_backward(trellis, obs->data, obs->size, fsm);
+    else
 	backward_prob = trellis_backward_hmm(trellis, obs->data, obs->size, hmm);
-	if (algorithm == DECODE_BACKWARD_PROB)
-	    printf("%.17g\t", output_convert(backward_prob));
-	if (algorithm == LIKELIHOOD_BACKWARD)
-	    printf("%.17g\n", output_convert(backward_prob));
-	if (algorithm == DECODE_BACKWARD_PROB || algorithm == DECODE_BACKWARD) {
-	    if (backward_prob > SMRZERO_LOG) {
-		backward_print_path_hmm(trellis, hmm, obs->size);
+    if (algorithm == DECODE_BACKWARD_PROB)
+	fprintf(out, "%.17g\t", output_convert(backward_prob));
+    if (algorithm == LIKELIHOOD_BACKWARD)
+	fprintf(out, "%.17g\n", output_convert(backward_prob));
+    if (algorithm == DECODE_BACKWARD_PROB || algorithm == DECODE_BACKWARD) {
+	if (backward_prob <= SMRZERO_LOG) {
+	    fprintf(out, "\n");
+	} else if (fsm != NULL) {
+	    backward_print_path(out, trellis, fsm, obs->size);
+	} else {
+	    backward_print_path_hmm(out, trellis, hmm, obs->size);
+	}
+    }
+}
+
+void backward_fsm(struct wfsa *fsm, struct observations *o, int algorithm) {
+    decode_observations(fsm, NULL, o, algorithm, &backward_observation);
+}
+
+void backward_hmm(struct hmm *hmm, struct observations *o, int algorithm) {
+    hmm_emission_columns(hmm);
+    decode_observations(NULL, hmm, o, algorithm, &backward_observation);
+}
+
+/* Adds the private counts of all threads into those of thread 0. Every */
+/* thread calls this when its own counts are complete, and sums its     */
+/* slice of the count arrays pairwise over the threads (a tree), so no  */
+/* two threads ever write to the same counts. Baum-Welch counts are in  */
+/* log2 (logspace), Viterbi training counts are plain.                  */
+static void counts_reduce(struct thread_args *args, int logspace) {
+    size_t k, lo, hi;
+    int stride, j;
+    PROB *dst, *src;
+    if (args->num_threads == 1)
+	return;
+    pool_barrier_wait();
+    lo = args->numcounts * args->thread / args->num_threads;
+    hi = args->numcounts * (args->thread + 1) / args->num_threads;
+    for (stride = 1; stride < args->num_threads; stride *= 2) {
+	for (j = 0; j + stride < args->num_threads; j += 2 * stride) {
+	    dst = args->all[j]->counts;
+	    src = args->all[j + stride]->counts;
+	    if (logspace) {
+		for (k = lo; k < hi; k++)
+		    if (src[k] != LOGZERO)
+			dst[k] = log_add(dst[k], src[k]);
 	    } else {
-		printf("\n");
+		for (k = lo; k < hi; k++)
+		    dst[k] += src[k];
 	    }
 	}
     }
-    free(trellis);
 }
 
-PROB train_viterbi(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta) {
+void bw_counts_reduce(struct thread_args *args) {
+    counts_reduce(args, 1);
+}
+
+void viterbi_counts_reduce(struct thread_args *args) {
+    counts_reduce(args, 0);
+}
+
+/* Viterbi training E-step of one thread: counts along the best path of */
+/* each observation (arcs, then state totals, then final states)        */
+void *trellis_fill_viterbi(void *threadargs) {
+    struct thread_args *args;
+    struct trellis *trellis;
     struct observations *obs;
+    struct wfsa *fsm;
+    PROB viterbi_prob, *fsm_vit_counts, *fsm_vit_totalcounts, *fsm_vit_finalcounts;
+    const int *idx;
+    int i, j, n, source, target, laststate, symbol, occurrences;
+    size_t k;
+
+    args = (struct thread_args *) threadargs;
+    trellis = args->trellis;
+    fsm = (struct wfsa *) args->fsmhmm;
+    fsm_vit_counts = args->counts;
+    fsm_vit_totalcounts = args->counts + (size_t) fsm->num_states * fsm->alphabet_size * fsm->num_states;
+    fsm_vit_finalcounts = fsm_vit_totalcounts + fsm->num_states;
+    for (k = 0; k < args->numcounts; k++) { args->counts[k] = 0; }
+    args->loglikelihood = 0;
+
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    obs = args->obsarray[idx[j]];
+	    occurrences = obs->occurrences;
+	    viterbi_prob = trellis_viterbi(trellis, obs->data, obs->size, fsm);
+	    if (viterbi_prob <= SMRZERO_LOG) {
+		continue;
+	    }
+	    args->loglikelihood += viterbi_prob * occurrences;
+	    /* Update final counts */
+	    for (i = 0, laststate = -1; i < fsm->num_states; i++) {
+		if (TRELLIS_CELL(i,(obs->size+1))->backstate != -1) {
+		    laststate = i;
+		    break;
+		}
+	    }
+	    if (laststate == -1) {
+		fprintf(stderr, "Could not find last state\n");
+		continue;
+	    }
+	    fsm_vit_finalcounts[laststate] += occurrences;
+	    fsm_vit_totalcounts[laststate] += occurrences;
+	    /* Update arc counts */
+	    for (i = obs->size; i > 0; i--) {
+		target = laststate;
+		laststate = TRELLIS_CELL(laststate,i)->backstate;
+		source = laststate;
+		symbol = *((obs->data)+i-1);
+		*FSM_COUNTS(fsm_vit_counts, source, symbol, target) += occurrences;
+		fsm_vit_totalcounts[source] += occurrences;
+	    }
+	}
+    }
+    viterbi_counts_reduce(args);
+    return(NULL);
+}
+
+/* As above for HMMs: transitions, emissions, then the state totals of */
+/* transitions and of emissions                                        */
+void *trellis_fill_viterbi_hmm(void *threadargs) {
+    struct thread_args *args;
     struct trellis *trellis;
-    int i,j,k,iter, source, target, laststate, symbol, occurrences, *fsm_vit_counts, *fsm_vit_totalcounts, *fsm_vit_finalcounts;
-    PROB viterbi_prob, loglikelihood, prevloglikelihood, newprob;
-    trellis = trellis_init(o, fsm->num_states);
-    fsm_vit_counts = malloc(sizeof(int) * fsm->num_states * fsm->num_states * fsm->alphabet_size);
-    fsm_vit_totalcounts = malloc(sizeof(int) * fsm->num_states);
-    fsm_vit_finalcounts = malloc(sizeof(int) * fsm->num_states);
-    
+    struct observations *obs;
+    struct hmm *hmm;
+    PROB viterbi_prob, *hmm_vit_counts_trans, *hmm_vit_counts_emit, *hmm_vit_totalcounts_trans, *hmm_vit_totalcounts_emit;
+    const int *idx;
+    int i, j, n, source, target, newsource, symbol, occurrences;
+    size_t k;
+
+    args = (struct thread_args *) threadargs;
+    trellis = args->trellis;
+    hmm = (struct hmm *) args->fsmhmm;
+    hmm_vit_counts_trans = args->counts;
+    hmm_vit_counts_emit = hmm_vit_counts_trans + (size_t) hmm->num_states * hmm->num_states;
+    hmm_vit_totalcounts_trans = hmm_vit_counts_emit + (size_t) hmm->num_states * hmm->alphabet_size;
+    hmm_vit_totalcounts_emit = hmm_vit_totalcounts_trans + hmm->num_states;
+    for (k = 0; k < args->numcounts; k++) { args->counts[k] = 0; }
+    args->loglikelihood = 0;
+
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    obs = args->obsarray[idx[j]];
+	    occurrences = obs->occurrences;
+	    viterbi_prob = trellis_viterbi_hmm(trellis, obs->data, obs->size, hmm);
+	    if (viterbi_prob <= SMRZERO_LOG) {
+		continue;
+	    }
+	    args->loglikelihood += viterbi_prob * occurrences;
+	    /* Update trans count to final state */
+	    target = hmm->num_states - 1;
+	    source = TRELLIS_CELL_HMM(target, obs->size + 1)->backstate;
+	    hmm_vit_totalcounts_trans[source] += occurrences;
+	    *HMM_TRANSITION_COUNTS(hmm_vit_counts_trans, source, target) += occurrences;
+	    /* Update counts following backpointers until zero */
+	    for (i = obs->size; i > 0; i--) {
+		symbol = *((obs->data)+i-1);
+		hmm_vit_totalcounts_emit[source] += occurrences;
+		*HMM_EMISSION_COUNTS(hmm_vit_counts_emit, source, symbol) += occurrences;
+		newsource = TRELLIS_CELL_HMM(source, i)->backstate;
+		target = source;
+		source = newsource;
+		hmm_vit_totalcounts_trans[source] += occurrences;
+		*HMM_TRANSITION_COUNTS(hmm_vit_counts_trans, source, target) += occurrences;
+	    }
+	}
+    }
+    viterbi_counts_reduce(args);
+    return(NULL);
+}
+
+/* Copies the tables of the model into a replica of the same size */
+static void replica_copy(void *replica, void *model, int use_hmm) {
+    struct wfsa *fsm, *rfsm;
+    struct hmm *hmm, *rhmm;
+    size_t size;
+    if (use_hmm) {
+	hmm = model;
+	rhmm = replica;
+	size = (size_t) hmm->num_states * hmm->alphabet_size * sizeof(PROB);
+	memcpy(rhmm->transition_table, hmm->transition_table, (size_t) hmm->num_states * hmm->num_states * sizeof(PROB));
+	memcpy(rhmm->emission_table, hmm->emission_table, size);
+	memcpy(rhmm->emission_columns, hmm->emission_columns, size);
+    } else {
+	fsm = model;
+	rfsm = replica;
+	memcpy(rfsm->state_table, fsm->state_table, (size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size * sizeof(PROB));
+	memcpy(rfsm->final_table, fsm->final_table, fsm->num_states * sizeof(PROB));
+    }
+}
+
+/* Allocates the trellis and counts of a thread, and its node's replica */
+/* of the model, from the thread itself: with pinned threads, the pages */
+/* are first touched, and so placed, on the thread's NUMA node          */
+static void *training_thread_alloc(void *threadargs) {
+    struct thread_args *args;
+    args = (struct thread_args *) threadargs;
+    args->trellis = big_alloc(args->trellissize);
+    args->counts = big_alloc(args->numcounts * sizeof(PROB));
+    memset(args->trellis, 0, args->trellissize);
+    memset(args->counts, 0, args->numcounts * sizeof(PROB));
+    if (args->copy_replica)
+	replica_copy(args->fsmhmm, args->model, args->use_hmm);
+    return(NULL);
+}
+
+/* Sets up num_threads threads for training fsm or hmm: each gets its own */
+/* trellis (for observations of up to olenmax symbols) and numcounts      */
+/* private counts, and takes observations from sched. If the (pinned)     */
+/* threads span more than one NUMA node, each node gets its own copy of   */
+/* the model, which training_threads_sync() updates.                      */
+static struct thread_args **training_threads(int olenmax, struct observations **obsarray, struct sched *sched, struct wfsa *fsm, struct hmm *hmm, size_t numcounts, int num_threads) {
+    struct thread_args **threadargs;
+    void **replicas;
+    int i, node, maxnode, num_states;
+    num_states = fsm != NULL ? fsm->num_states : hmm->num_states;
+    for (i = 0, maxnode = 0; i < num_threads; i++)
+	maxnode = pool_thread_node(i, num_threads) > maxnode ? pool_thread_node(i, num_threads) : maxnode;
+    replicas = calloc(maxnode + 1, sizeof(void *));
+    threadargs = malloc(sizeof(struct thread_args *) * num_threads);
+    for (i = 0; i < num_threads; i++) {
+	threadargs[i] = calloc(1, sizeof(struct thread_args));
+	threadargs[i]->trellissize = (size_t) (olenmax + 2) * num_states * sizeof(struct trellis);
+	threadargs[i]->obsarray = obsarray;
+	threadargs[i]->sched = sched;
+	threadargs[i]->model = fsm != NULL ? (void *) fsm : (void *) hmm;
+	threadargs[i]->use_hmm = hmm != NULL;
+	threadargs[i]->fsmhmm = threadargs[i]->model;
+	threadargs[i]->thread = i;
+	threadargs[i]->num_threads = num_threads;
+	threadargs[i]->all = threadargs;
+	threadargs[i]->numcounts = numcounts;
+	if (maxnode > 0) {
+	    node = pool_thread_node(i, num_threads);
+	    if (replicas[node] == NULL) {
+		/* Tables are mapped here but first written by the thread */
+		replicas[node] = fsm != NULL ? (void *) wfsa_init(fsm->num_states, fsm->alphabet_size) : (void *) hmm_init(hmm->num_states, hmm->alphabet_size);
+		threadargs[i]->copy_replica = 1;
+	    }
+	    threadargs[i]->fsmhmm = replicas[node];
+	}
+    }
+    if (g_verbose && maxnode > 0)
+	fprintf(stderr, "Threads span %i NUMA nodes, model replicated per node\n", maxnode + 1);
+    pool_run(num_threads, &training_thread_alloc, (void **) threadargs);
+    free(replicas);
+    return(threadargs);
+}
+
+/* Brings the replicas of the model up to date after it has changed */
+static void training_threads_sync(struct thread_args **threadargs, int num_threads) {
+    int i;
+    for (i = 0; i < num_threads; i++)
+	if (threadargs[i]->copy_replica)
+	    replica_copy(threadargs[i]->fsmhmm, threadargs[i]->model, threadargs[i]->use_hmm);
+}
+
+static void training_threads_destroy(struct thread_args **threadargs, int num_threads) {
+    int i;
+    for (i = 0; i < num_threads; i++) {
+	if (threadargs[i]->copy_replica && threadargs[i]->use_hmm)
+	    hmm_destroy(threadargs[i]->fsmhmm);
+	else if (threadargs[i]->copy_replica)
+	    wfsa_destroy(threadargs[i]->fsmhmm);
+	big_free(threadargs[i]->trellis);
+	big_free(threadargs[i]->counts);
+	free(threadargs[i]);
+    }
+    free(threadargs);
+}
+
+PROB train_viterbi(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta) {
+    struct observations **obsarray;
+    struct thread_args **threadargs;
+    struct sched *sched;
+    int i,j,k,iter, numobs, num_threads;
+    PROB loglikelihood, prevloglikelihood, newprob, *fsm_vit_counts, *fsm_vit_totalcounts, *fsm_vit_finalcounts;
+
+    /* Each thread counts into its own arcs, state totals and final states, */
+    /* which are summed into those of thread 0 after each pass              */
+    num_threads = pool_threads();
+    obsarray = observations_to_array(o, &numobs);
+    sched = sched_create(obsarray, numobs, num_threads);
+    threadargs = training_threads(observations_max_length(o), obsarray, sched, fsm, NULL, (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 2), num_threads);
+    fsm_vit_counts = threadargs[0]->counts;
+    fsm_vit_totalcounts = fsm_vit_counts + (size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size;
+    fsm_vit_finalcounts = fsm_vit_totalcounts + fsm->num_states;
+
+
     prevloglikelihood = 0;
     for (iter = 0 ; iter < maxiterations; iter++) {
-        /* Clear counts */
-        for (i = 0; i < fsm->num_states; i++) {
-            fsm_vit_totalcounts[i] = fsm_vit_finalcounts[i] = 0;
-        }
-        for (i = 0; i < fsm->num_states * fsm->num_states * fsm->alphabet_size; i++) {
-            fsm_vit_counts[i] = 0;
-        }
+        training_threads_sync(threadargs, num_threads);
+        sched_reset(sched);
+        pool_run(num_threads, &trellis_fill_viterbi, (void **) threadargs);
         loglikelihood = 0;
-        for (obs = o; obs != NULL; obs = obs->next) {
-	    occurrences = obs->occurrences;
-            viterbi_prob = trellis_viterbi(trellis, obs->data, obs->size, fsm);
-            if (viterbi_prob <= SMRZERO_LOG) {
-                continue;
-            } else {
-                loglikelihood += viterbi_prob * occurrences;
-                /* Update final counts */
-                for (i = 0, laststate = -1; i < fsm->num_states; i++) {
-                    if (TRELLIS_CELL(i,(obs->size+1))->backstate != -1) {
-                        laststate = i;
-                        break;
-                    }
-                }
-                if (laststate == -1) {
-                    printf("Could not find last state\n");
-                    continue;
-                }
-                fsm_vit_finalcounts[laststate] += occurrences;
-                fsm_vit_totalcounts[laststate] += occurrences;
-                /* Update arc counts */
-                for (i = obs->size; i > 0; i--) {
-                    target = laststate;
-                    laststate = TRELLIS_CELL(laststate,i)->backstate;
-                    source = laststate;
-                    symbol = *((obs->data)+i-1);
-                    *FSM_COUNTS(fsm_vit_counts, source, symbol, target) += occurrences;
-                    fsm_vit_totalcounts[source]+= occurrences;
-                }
-            }
+        for (i = 0; i < num_threads; i++) {
+            loglikelihood += threadargs[i]->loglikelihood;
         }
 	fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
 	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)  {
@@ -1365,61 +2126,41 @@ PROB train_viterbi(struct wfsa *fsm, struct observations *o, int maxiterations,
         }
         prevloglikelihood = loglikelihood;
     }
-    free(fsm_vit_counts);
-    free(fsm_vit_totalcounts);
-    free(fsm_vit_finalcounts);
+    if (g_verbose)
+	sched_report(sched, "Viterbi training");
+    training_threads_destroy(threadargs, num_threads);
+    sched_destroy(sched);
+    free(obsarray);
     return(loglikelihood);
 }
 
 PROB train_viterbi_hmm(struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta) {
-    struct observations *obs;
-    struct trellis *trellis;
-    int i, j, iter, source, target, newsource, symbol, occurrences, *hmm_vit_counts_trans, *hmm_vit_counts_emit, *hmm_vit_totalcounts_trans, *hmm_vit_totalcounts_emit;
-    PROB viterbi_prob, loglikelihood, prevloglikelihood, newprob;
+    struct observations **obsarray;
+    struct thread_args **threadargs;
+    struct sched *sched;
+    int i, j, iter, numobs, num_threads;
+    PROB loglikelihood, prevloglikelihood, newprob, *hmm_vit_counts_trans, *hmm_vit_counts_emit, *hmm_vit_totalcounts_trans, *hmm_vit_totalcounts_emit;
 
-    trellis = trellis_init(o, hmm->num_states);    
+    /* Each thread counts into its own transitions, emissions and state */
+    /* totals, which are summed into those of thread 0 after each pass  */
+    num_threads = pool_threads();
+    obsarray = observations_to_array(o, &numobs);
+    sched = sched_create(obsarray, numobs, num_threads);
+    threadargs = training_threads(observations_max_length(o), obsarray, sched, NULL, hmm, (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size + 2), num_threads);
+    hmm_vit_counts_trans = threadargs[0]->counts;
+    hmm_vit_counts_emit = hmm_vit_counts_trans + (size_t) hmm->num_states * hmm->num_states;
+    hmm_vit_totalcounts_trans = hmm_vit_counts_emit + (size_t) hmm->num_states * hmm->alphabet_size;
+    hmm_vit_totalcounts_emit = hmm_vit_totalcounts_trans + hmm->num_states;
 
-    hmm_vit_counts_trans = malloc(sizeof(int) * hmm->num_states * hmm->num_states);
-    hmm_vit_counts_emit = malloc(sizeof(int) * hmm->num_states * hmm->alphabet_size);
-    hmm_vit_totalcounts_trans = malloc(sizeof(int) * hmm->num_states);
-    hmm_vit_totalcounts_emit = malloc(sizeof(int) * hmm->num_states);
-    
     prevloglikelihood = 0;
     for (iter = 0 ; iter < maxiterations; iter++) {
-        /* Clear counts */
-        for (i = 0; i < hmm->num_states; i++) {
-            hmm_vit_totalcounts_trans[i] = hmm_vit_totalcounts_emit[i] = 0;
-        }
-        for (i = 0; i < hmm->num_states * hmm->num_states; i++)
-	    hmm_vit_counts_trans[i] = 0;
-        for (i = 0; i < hmm->num_states * hmm->alphabet_size; i++)
-	    hmm_vit_counts_emit[i] = 0;
-       
+	hmm_emission_columns(hmm);
+        training_threads_sync(threadargs, num_threads);
+        sched_reset(sched);
+        pool_run(num_threads, &trellis_fill_viterbi_hmm, (void **) threadargs);
         loglikelihood = 0;
-        for (obs = o; obs != NULL; obs = obs->next) {
-	    occurrences = obs->occurrences;
-            viterbi_prob = trellis_viterbi_hmm(trellis, obs->data, obs->size, hmm);
-            if (viterbi_prob <= SMRZERO_LOG) {
-                continue;
-            } else {
-                loglikelihood += viterbi_prob * occurrences;
-                /* Update trans count to final state */
-		target = hmm->num_states - 1;
-		source = TRELLIS_CELL_HMM(target, obs->size + 1)->backstate;		
-		hmm_vit_totalcounts_trans[source] += occurrences;
-		*HMM_TRANSITION_COUNTS(hmm_vit_counts_trans, source, target) += occurrences;
-                /* Update counts following backpointers until zero */
-                for (i = obs->size; i > 0; i--) {
-		    symbol = *((obs->data)+i-1);
-		    hmm_vit_totalcounts_emit[source] += occurrences;
-		    *HMM_EMISSION_COUNTS(hmm_vit_counts_emit, source, symbol) += occurrences;
-		    newsource = TRELLIS_CELL_HMM(source, i)->backstate;
-		    target = source;
-		    source = newsource;
-		    hmm_vit_totalcounts_trans[source] += occurrences;
-		    *HMM_TRANSITION_COUNTS(hmm_vit_counts_trans, source, target) += occurrences;
-                }
-            }
+        for (i = 0; i < num_threads; i++) {
+            loglikelihood += threadargs[i]->loglikelihood;
         }
 	fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
 	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)  {
@@ -1456,214 +2197,906 @@ PROB train_viterbi_hmm(struct hmm *hmm, struct observations *o, int maxiteration
 	}
         prevloglikelihood = loglikelihood;
     }
-    free(hmm_vit_counts_trans);
-    free(hmm_vit_counts_emit);
-    free(hmm_vit_totalcounts_trans);
-    free(hmm_vit_totalcounts_emit);
+    if (g_verbose)
+	sched_report(sched, "Viterbi training");
+    training_threads_destroy(threadargs, num_threads);
+    sched_destroy(sched);
+    free(obsarray);
     return(loglikelihood);
 }
 
-inline void spinlock_lock(_Bool *ptr) {
-    if (g_num_threads > 1)
-    	while (__sync_lock_test_and_set(ptr, 1)) { }
-}
-
-inline void spinlock_unlock(_Bool *ptr) {
-    if (g_num_threads > 1)
-     	__sync_lock_release(ptr);
+/* Scores held-out observations (--heldout) with the thread's model, once   */
+/* the thread has run out of E-step observations: threads that finish their */
+/* share of the E-step first score the held-out set while the others are    */
+/* still busy, and steal its chunks from each other as in the E-step        */
+static void heldout_score(struct thread_args *args) {
+    struct observations *obs;
+    const int *idx;
+    int j, n;
+    args->heldout_loglikelihood = 0;
+    if (args->heldout_sched == NULL)
+	return;
+    while (sched_next(args->heldout_sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    obs = args->heldout[idx[j]];
+	    if (args->use_hmm)
+		args->heldout_loglikelihood += obs->occurrences * trellis_forward_hmm(args->trellis, obs->data, obs->size, args->fsmhmm);
+	    else
+		args->heldout_loglikelihood += obs->occurrences * trellis_forward_fsm(args->trellis, obs->data, obs->size, args->fsmhmm);
+	}
+    }
 }
 
+/* E-step of one thread. After the backward pass, the forward pass and  */
+/* the accumulation of the expected counts are done in a single sweep:  */
+/* column t+1 of the forward trellis is computed from column t along    */
+/* the same arcs whose counts are added for column t, so each column is */
+/* read while still in cache rather than once by the forward pass and   */
+/* again by the counts. The forward values and counts are summed in the */
+/* same order as by trellis_forward_fsm() and a separate count pass.    */
 void *trellis_fill_bw(void *threadargs) {
-    pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_args *args;
     struct trellis *trellis;
     struct observations **obsarray, *obs;
     struct wfsa *fsm;
-    PROB backward_prob, forward_prob, thisxi, beta;
-    int i, t, symbol, source, target, minobs, maxobs, occurrences;
+    PROB backward_prob, source_prob, target_prob, thisxi, beta, *fsm_counts, *fsm_finalcounts;
+    const int *idx;
+    int j, n, t, symbol, source, target, occurrences;
+    size_t k;
 
     trellis = ((struct thread_args *)threadargs)->trellis;
     obsarray = ((struct thread_args *)threadargs)->obsarray;
-    minobs = ((struct thread_args *)threadargs)->minobs;
-    maxobs = ((struct thread_args *)threadargs)->maxobs;
     fsm = (struct wfsa *)((struct thread_args *)threadargs)->fsmhmm;
     beta = ((struct thread_args *)threadargs)->beta;
-    
-    for (i = minobs; i <= maxobs; i++) {
-	obs = *(obsarray+i);
-	occurrences = obs->occurrences;
-	/* E-step */
-	backward_prob = trellis_backward(trellis, obs->data, obs->size, fsm);
-	forward_prob = trellis_forward_fsm(trellis, obs->data, obs->size, fsm);
-	pthread_mutex_lock(&mutex1);
-	g_loglikelihood += backward_prob * occurrences;
-	pthread_mutex_unlock(&mutex1);
-	/* Traverse trellis and add */
-	for (t = 0; t < obs->size; t++) {
-	    symbol = obs->data[t];
+    args = (struct thread_args *) threadargs;
+    fsm_counts = args->counts;
+    fsm_finalcounts = args->counts + (size_t) fsm->num_states * fsm->alphabet_size * fsm->num_states;
+    for (k = 0; k < args->numcounts; k++) { args->counts[k] = LOGZERO; }
+    args->loglikelihood = 0;
+
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    obs = *(obsarray+idx[j]);
+	    occurrences = obs->occurrences;
+	    /* E-step */
+	    backward_prob = trellis_backward(trellis, obs->data, obs->size, fsm);
+	    args->loglikelihood += backward_prob * occurrences;
 	    for (source = 0; source < fsm->num_states; source++) {
-		if (TRELLIS_CELL(source,t)->fp == LOGZERO) { continue; }
+		TRELLIS_CELL(source,0)->fp = LOGZERO;
+	    }
+	    TRELLIS_CELL(0,0)->fp = 0;
+	    /* Forward column t+1 and counts of column t */
+	    for (t = 0; t < obs->size; t++) {
+		symbol = obs->data[t];
 		for (target = 0; target < fsm->num_states; target++) {
-		    if (TRELLIS_CELL(target,t+1)->bp == LOGZERO) { continue; }
-		    if (*TRANSITION(fsm,source,symbol,target) <= SMRZERO_LOG) { continue; }
-		    thisxi = TRELLIS_CELL(source,t)->fp + *TRANSITION(fsm,source,symbol,target) + TRELLIS_CELL(target,t+1)->bp;
-		    thisxi = thisxi - backward_prob;
-		    thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
-		    thisxi += LOG(occurrences);
-		    spinlock_lock(&fsm_counts_spin[source]);
-		    *FSM_COUNTS(fsm_counts,source,symbol,target) = log_add(*FSM_COUNTS(fsm_counts,source,symbol,target), thisxi);
-		    spinlock_unlock(&fsm_counts_spin[source]);
+		    TRELLIS_CELL(target,t+1)->fp = LOGZERO;
+		}
+		for (source = 0; source < fsm->num_states; source++) {
+		    source_prob = TRELLIS_CELL(source,t)->fp;
+		    if (source_prob == LOGZERO) { continue; }
+		    for (target = 0; target < fsm->num_states; target++) {
+			target_prob = *TRANSITION(fsm,source,symbol,target);
+			if (target_prob <= SMRZERO_LOG) { continue; }
+			TRELLIS_CELL(target,t+1)->fp = log_add(source_prob + target_prob, TRELLIS_CELL(target,t+1)->fp);
+			if (TRELLIS_CELL(target,t+1)->bp == LOGZERO) { continue; }
+			thisxi = source_prob + target_prob + TRELLIS_CELL(target,t+1)->bp;
+			thisxi = thisxi - backward_prob;
+			thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
+			thisxi += LOG(occurrences);
+			*FSM_COUNTS(fsm_counts,source,symbol,target) = log_add(*FSM_COUNTS(fsm_counts,source,symbol,target), thisxi);
+		    }
 		}
 	    }
-	}
-	/* Final states */
-	for (source = 0; source < fsm->num_states; source++) {
-	    target = source;
-	    if (TRELLIS_CELL(source,t)->fp == LOGZERO)   { continue; }
-	    if (TRELLIS_CELL(target,t+1)->bp == LOGZERO) { continue; }
-	    thisxi = TRELLIS_CELL(source,t)->fp + *FINALPROB(fsm, source);
-	    thisxi = thisxi - backward_prob ;
-	    thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
-	    thisxi += LOG(occurrences);
-
-	    spinlock_lock(&fsm_counts_spin[source]);
-	    fsm_finalcounts[source] = log_add(fsm_finalcounts[source], thisxi);
-	    spinlock_unlock(&fsm_counts_spin[source]);
+	    /* Final states */
+	    for (source = 0; source < fsm->num_states; source++) {
+		target = source;
+		if (TRELLIS_CELL(source,t)->fp == LOGZERO)   { continue; }
+		if (TRELLIS_CELL(target,t+1)->bp == LOGZERO) { continue; }
+		thisxi = TRELLIS_CELL(source,t)->fp + *FINALPROB(fsm, source);
+		thisxi = thisxi - backward_prob ;
+		thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
+		thisxi += LOG(occurrences);
+		fsm_finalcounts[source] = log_add(fsm_finalcounts[source], thisxi);
+	    }
 	}
     }
+    heldout_score(args);
+    bw_counts_reduce(args);
     return(NULL);
 }
 
+/* E-step of one thread for HMMs, with the forward pass and the counts */
+/* in one sweep as in trellis_fill_bw()                                */
 void *trellis_fill_bw_hmm(void *threadargs) {
-    pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_args *args;
     struct trellis *trellis;
     struct observations **obsarray, *obs;
     struct hmm *hmm;
-    PROB backward_prob, forward_prob, thisxi, beta;
-    int i, t, symbol, source, target, minobs, maxobs, occurrences;
+    PROB backward_prob, source_prob, target_prob, thisxi, beta, *emission, *hmm_counts_trans, *hmm_counts_emit;
+    const int *idx;
+    int j, n, t, symbol, source, target, occurrences, end_state;
+    size_t k;
 
     trellis = ((struct thread_args *)threadargs)->trellis;
     obsarray = ((struct thread_args *)threadargs)->obsarray;
-    minobs = ((struct thread_args *)threadargs)->minobs;
-    maxobs = ((struct thread_args *)threadargs)->maxobs;
     hmm = (struct hmm *)((struct thread_args *)threadargs)->fsmhmm;
     beta = ((struct thread_args *)threadargs)->beta;
-    
-    for (i = minobs; i <= maxobs; i++) {
-	obs = *(obsarray+i);
-	occurrences = obs->occurrences;
-	/* E-step */
-	backward_prob = trellis_backward_hmm(trellis, obs->data, obs->size, hmm);
-	forward_prob = trellis_forward_hmm(trellis, obs->data, obs->size, hmm);
-	pthread_mutex_lock(&mutex1);
-	g_loglikelihood += backward_prob * occurrences;
-	pthread_mutex_unlock(&mutex1);
-	/* Traverse trellis and add */
-	for (t = 0; t <= obs->size; t++) {
-	    for (source = 0; source < hmm->num_states - 1; source++) {
-		if (TRELLIS_CELL_HMM(source,t)->fp == LOGZERO) { continue; }
-		/* Emission */
-		if (source > 0 && t > 0) {
-		    symbol = obs->data[t-1];
-		    thisxi = TRELLIS_CELL_HMM(source, t)->fp + TRELLIS_CELL_HMM(source, t)->bp;
-		    thisxi -= backward_prob;
-		    thisxi += LOG(occurrences);
-		    spinlock_lock(&hmm_counts_spin[source]);
-		    *HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol) = log_add(*HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol), thisxi);
-		    spinlock_unlock(&hmm_counts_spin[source]);
+    args = (struct thread_args *) threadargs;
+    hmm_counts_trans = args->counts;
+    hmm_counts_emit = args->counts + (size_t) hmm->num_states * hmm->num_states;
+    for (k = 0; k < args->numcounts; k++) { args->counts[k] = LOGZERO; }
+    args->loglikelihood = 0;
+    end_state = hmm->num_states - 1;
+
+    while (sched_next(args->sched, args->thread, &idx, &n)) {
+	for (j = 0; j < n; j++) {
+	    obs = *(obsarray+idx[j]);
+	    occurrences = obs->occurrences;
+	    /* E-step */
+	    backward_prob = trellis_backward_hmm(trellis, obs->data, obs->size, hmm);
+	    args->loglikelihood += backward_prob * occurrences;
+	    for (source = 0; source < hmm->num_states; source++) {
+		TRELLIS_CELL_HMM(source,0)->fp = LOGZERO;
+	    }
+	    TRELLIS_CELL_HMM(0,0)->fp = 0;
+	    /* Forward column t+1 (but not the end state's column) and */
+	    /* counts of column t                                      */
+	    for (t = 0; t <= obs->size; t++) {
+		emission = t < obs->size ? HMM_EMISSION_COLUMN(hmm, obs->data[t]) : NULL;
+		if (t < obs->size) {
+		    for (target = 0; target < hmm->num_states; target++) {
+			TRELLIS_CELL_HMM(target,t+1)->fp = LOGZERO;
+		    }
 		}
-		for (target = 1; target < hmm->num_states; target++) {
-		    if (TRELLIS_CELL_HMM(target, t+1)->bp == LOGZERO) { continue; }
-		    if (*HMM_TRANSITION_PROB(hmm, source, target) <= SMRZERO_LOG) { continue; }
-		    if (t == obs->size) {
-			thisxi = TRELLIS_CELL_HMM(source, t)->fp + *HMM_TRANSITION_PROB(hmm, source, target) + TRELLIS_CELL_HMM(target, t+1)->bp;
-		    } else {
-			thisxi = TRELLIS_CELL_HMM(source, t)->fp + *HMM_TRANSITION_PROB(hmm, source, target) + *HMM_EMISSION_PROB(hmm, target, obs->data[t]) + TRELLIS_CELL_HMM(target, t+1)->bp;
+		for (source = 0; source < end_state; source++) {
+		    source_prob = TRELLIS_CELL_HMM(source,t)->fp;
+		    if (source_prob == LOGZERO) { continue; }
+		    /* Emission */
+		    if (source > 0 && t > 0) {
+			symbol = obs->data[t-1];
+			thisxi = source_prob + TRELLIS_CELL_HMM(source, t)->bp;
+			thisxi -= backward_prob;
+			thisxi += LOG(occurrences);
+			*HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol) = log_add(*HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol), thisxi);
+		    }
+		    for (target = 1; target < hmm->num_states; target++) {
+			if (*HMM_TRANSITION_PROB(hmm, source, target) <= SMRZERO_LOG) { continue; }
+			if (t < obs->size && target < end_state) {
+			    target_prob = *HMM_TRANSITION_PROB(hmm, source, target) + emission[target];
+			    if (target_prob > SMRZERO_LOG)
+				TRELLIS_CELL_HMM(target,t+1)->fp = log_add(source_prob + target_prob, TRELLIS_CELL_HMM(target,t+1)->fp);
+			}
+			if (TRELLIS_CELL_HMM(target, t+1)->bp == LOGZERO) { continue; }
+			if (t == obs->size) {
+			    thisxi = source_prob + *HMM_TRANSITION_PROB(hmm, source, target) + TRELLIS_CELL_HMM(target, t+1)->bp;
+			} else {
+			    thisxi = source_prob + *HMM_TRANSITION_PROB(hmm, source, target) + emission[target] + TRELLIS_CELL_HMM(target, t+1)->bp;
+			}
+			thisxi -= backward_prob;
+			thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
+			thisxi += LOG(occurrences);
+			*HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target) = log_add(*HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target), thisxi);
 		    }
-		    thisxi -= backward_prob;
-		    thisxi = g_train_da_bw == 0 ? thisxi : thisxi * beta;
-		    thisxi += LOG(occurrences);
-		    spinlock_lock(&hmm_counts_spin[source]);
-		    *HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target) = log_add(*HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target), thisxi);
-		    spinlock_unlock(&hmm_counts_spin[source]);
 		}
 	    }
 	}
     }
+    heldout_score(args);
+    bw_counts_reduce(args);
     return(NULL);
 }
 
+/* M-step of Baum-Welch for HMMs: the (log2) expected counts are those of */
+/* the transitions, followed by those of the emissions                     */
+static void bw_update_hmm(struct hmm *hmm, PROB *hmm_counts_trans, PROB *hmm_totalcounts_trans, PROB *hmm_totalcounts_emit, int vb) {
+    int i, source, target, symbol;
+    PROB newprob, *hmm_counts_emit;
+    hmm_counts_emit = hmm_counts_trans + (size_t) hmm->num_states * hmm->num_states;
+    /* Clear and sum counts */
+    for (i = 0; i < hmm->num_states ; i++) { 
+	hmm_totalcounts_trans[i] =  hmm_totalcounts_emit[i] = LOGZERO;
+    }
+    /* Is totalcounts for emit always the same as totalcounts for transition (except at state 0)? */
+    for (source = 0; source < hmm->num_states - 1; source++) {
+	for (symbol = 0; symbol < hmm->alphabet_size; symbol++) {		
+	    hmm_totalcounts_emit[source] = log_add(*HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol), hmm_totalcounts_emit[source]);
+	}
+	for (target = 1; target < hmm->num_states; target++) {
+	    hmm_totalcounts_trans[source] = log_add(*HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target), hmm_totalcounts_trans[source]);
+	}
+    }
+
+    /* Re-estimate emissions */
+    for (source = 0; source < hmm->num_states; source++) {
+	for (symbol = 0; symbol < hmm->alphabet_size; symbol++) {
+	    newprob = *HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol);
+	    if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
+	    if (vb)
+		*HMM_EMISSION_PROB(hmm, source, symbol) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(hmm_totalcounts_emit[source]) + hmm->alphabet_size * g_gibbs_beta_emission))/M_LN2;
+	    else
+		*HMM_EMISSION_PROB(hmm, source, symbol) = newprob - hmm_totalcounts_emit[source];
+	}
+    }
+    /* Transitions */
+    for (source = 0; source < hmm->num_states; source++) {
+	for (target = 0; target < hmm->num_states; target++) {
+	    newprob = *HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target);
+	    if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
+	    if (vb)
+		*HMM_TRANSITION_PROB(hmm, source, target) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(hmm_totalcounts_trans[source]) + (hmm->num_states) * g_gibbs_beta_emission))/M_LN2;
+	    else
+		*HMM_TRANSITION_PROB(hmm, source, target) = newprob - hmm_totalcounts_trans[source];
+	}
+    }
+}
+
+/* M-step of Baum-Welch: sets the weights of fsm from the (log2) expected */
+/* counts of the transitions, followed by those of the final states        */
+static void bw_update_fsm(struct wfsa *fsm, PROB *fsm_counts, PROB *fsm_totalcounts, int vb) {
+    int i, source, target, symbol;
+    PROB newprob, numstatetrans, *fsm_finalcounts;
+    fsm_finalcounts = fsm_counts + (size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size;
+    numstatetrans = fsm->num_states * fsm->alphabet_size + 1;
+    /* Sum counts */
+    for (i = 0; i < fsm->num_states ; i++) { fsm_totalcounts[i] = LOGZERO; }
+    for (source = 0; source < fsm->num_states; source++) {
+	for (symbol = 0; symbol < fsm->alphabet_size; symbol++) {
+	    for (target = 0; target < fsm->num_states; target++) {
+		fsm_totalcounts[source] = log_add(*FSM_COUNTS(fsm_counts,source,symbol,target), fsm_totalcounts[source]);
+	    }
+	}
+    }
+    for (source = 0; source < fsm->num_states; source++) {
+	fsm_totalcounts[source] = log_add(fsm_finalcounts[source], fsm_totalcounts[source]);
+    }
+
+    for (source = 0; source < fsm->num_states; source++) {
+	for (symbol = 0; symbol < fsm->alphabet_size; symbol++) {
+	    for (target = 0; target < fsm->num_states; target++) {
+		newprob = *FSM_COUNTS(fsm_counts,source,symbol,target);
+		if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
+		/* Variational Bayes: apply digamma function to count */
+		if (vb) {
+		    *TRANSITION(fsm,source,symbol,target) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(fsm_totalcounts[source]) + numstatetrans * g_gibbs_beta))/M_LN2;
+		} else {
+		    *TRANSITION(fsm,source,symbol,target) = newprob - fsm_totalcounts[source];
+		}
+	    }
+	}
+    }
+    for (source = 0; source < fsm->num_states; source++) {
+	newprob = fsm_finalcounts[source];
+	if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
+	/* Variational Bayes */
+	if (vb) {
+	    *FINALPROB(fsm,source) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(fsm_totalcounts[source]) + numstatetrans * g_gibbs_beta))/M_LN2;
+	} else {
+	    *FINALPROB(fsm,source) = newprob - fsm_totalcounts[source];
+	}
+    }
+}
+
+/* Incremental EM (Neal and Hinton), --incremental=SHARDS. The           */
+/* observations are cut into shards of about equal work and the expected */
+/* counts of each shard are kept. After a first pass over all shards,    */
+/* each E-step recomputes the counts of one shard only and swaps them    */
+/* into the totals, and the model is re-estimated from these after every */
+/* shard. An iteration is one pass over the shards; its loglikelihood is */
+/* the sum of the shards' last ones. Counts are cached as reals, the     */
+/* totals are recomputed exactly at the end of every pass.               */
+
+static PROB train_incremental_bw(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta, int vb) {
+    struct thread_args **threadargs;
+    struct observations **obsarray;
+    struct sched **scheds;
+    int i, s, iter, numobs, num_threads, num_shards, *shardstart;
+    PROB *cache, *shardcache, *totals, *counts, *logcounts, *totalcounts, *totalcounts_emit = NULL;
+    PROB *shardll, weight, shardweight, newcount, loglikelihood = 0, prevloglikelihood = 0;
+    size_t numcounts, k;
+
+    num_threads = pool_threads();
+    obsarray = observations_to_array(o, &numobs);
+    num_shards = g_incremental_shards < numobs ? g_incremental_shards : numobs;
+
+    /* Shards of consecutive observations, of about equal length x occurrences */
+    shardstart = malloc(sizeof(int) * (num_shards + 1));
+    for (i = 0, weight = 0; i < numobs; i++)
+	weight += (PROB) (obsarray[i]->size + 1) * obsarray[i]->occurrences;
+    shardstart[0] = 0;
+    for (i = 0, s = 1, shardweight = 0; i < numobs && s < num_shards; i++) {
+	shardweight += (PROB) (obsarray[i]->size + 1) * obsarray[i]->occurrences;
+	if (shardweight >= weight * s / num_shards || numobs - i - 1 == num_shards - s)
+	    shardstart[s++] = i + 1;
+    }
+    num_shards = s;
+    shardstart[num_shards] = numobs;
+    scheds = malloc(sizeof(struct sched *) * num_shards);
+    for (s = 0; s < num_shards; s++)
+	scheds[s] = sched_create(obsarray + shardstart[s], shardstart[s+1] - shardstart[s], num_threads);
+
+    if (fsm != NULL) {
+	numcounts = (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 1);
+	totalcounts = malloc(fsm->num_states * sizeof(PROB));
+    } else {
+	numcounts = (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size);
+	totalcounts = malloc(hmm->num_states * sizeof(PROB));
+	totalcounts_emit = malloc(hmm->num_states * sizeof(PROB));
+    }
+    if (g_verbose)
+	fprintf(stderr, "Incremental EM over %i shards, %.2f MB of cached counts\n", num_shards, (double) num_shards * numcounts * sizeof(PROB) / 1048576.0);
+    cache = big_alloc(sizeof(PROB) * numcounts * num_shards);
+    totals = big_alloc(sizeof(PROB) * numcounts);
+    logcounts = big_alloc(sizeof(PROB) * numcounts);
+    shardll = calloc(num_shards, sizeof(PROB));
+    threadargs = training_threads(observations_max_length(o), obsarray, NULL, fsm, hmm, numcounts, num_threads);
+    counts = threadargs[0]->counts;
+
+    for (iter = 0; iter < maxiterations; iter++) {
+	for (s = 0; s < num_shards; s++) {
+	    /* E-step over the shard */
+	    if (hmm != NULL)
+		hmm_emission_columns(hmm);
+	    for (i = 0; i < num_threads; i++) {
+		threadargs[i]->obsarray = obsarray + shardstart[s];
+		threadargs[i]->sched = scheds[s];
+		threadargs[i]->beta = 1.0;
+	    }
+	    training_threads_sync(threadargs, num_threads);
+	    sched_reset(scheds[s]);
+	    pool_run(num_threads, fsm != NULL ? &trellis_fill_bw : &trellis_fill_bw_hmm, (void **) threadargs);
+	    for (i = 0, shardll[s] = 0; i < num_threads; i++)
+		shardll[s] += threadargs[i]->loglikelihood;
+
+	    /* Swap the shard's counts into the totals */
+	    shardcache = cache + numcounts * s;
+	    for (k = 0; k < numcounts; k++) {
+		newcount = counts[k] == LOGZERO ? 0 : EXP(counts[k]);
+		totals[k] += newcount - shardcache[k];
+		shardcache[k] = newcount;
+	    }
+	    /* No M-step until all shards have been seen once */
+	    if (iter == 0 && s < num_shards - 1)
+		continue;
+	    if (s == num_shards - 1) {
+		for (k = 0; k < numcounts; k++)
+		    for (i = 0, totals[k] = 0; i < num_shards; i++)
+			totals[k] += cache[numcounts * i + k];
+	    }
+	    for (k = 0; k < numcounts; k++) {
+		/* A total that cancels out to nothing is summed again */
+		if (totals[k] <= 0)
+		    for (i = 0, totals[k] = 0; i < num_shards; i++)
+			totals[k] += cache[numcounts * i + k];
+		logcounts[k] = totals[k] > 0 ? LOG(totals[k]) : LOGZERO;
+	    }
+
+	    /* M-step */
+	    signal(SIGINT, SIG_IGN);
+	    if (fsm != NULL) {
+		bw_update_fsm(fsm, logcounts, totalcounts, vb);
+		if (!g_lastmodel_hold)
+		    g_lastwfsa = fsm;
+		signal(SIGINT, (void *)interrupt_sigproc);
+	    } else {
+		bw_update_hmm(hmm, logcounts, totalcounts, totalcounts_emit, vb);
+		if (!g_lastmodel_hold)
+		    g_lasthmm = hmm;
+		signal(SIGINT, (void *)interrupt_sigproc_hmm);
+	    }
+	}
+	for (s = 0, loglikelihood = 0; s < num_shards; s++)
+	    loglikelihood += shardll[s];
+	fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)
+	    break;
+	prevloglikelihood = loglikelihood;
+    }
+
+    if (hmm != NULL)
+	hmm_emission_columns(hmm);
+    training_threads_destroy(threadargs, num_threads);
+    for (s = 0; s < num_shards; s++)
+	sched_destroy(scheds[s]);
+    free(scheds);
+    free(shardstart);
+    free(shardll);
+    big_free(cache);
+    big_free(totals);
+    big_free(logcounts);
+    free(totalcounts);
+    free(totalcounts_emit);
+    free(obsarray);
+    return(loglikelihood);
+}
+
+/* Baum-Welch reading the observations from filename in chunks on every  */
+/* iteration (--stream), so that memory use is bounded by the chunks and */
+/* the model. Each chunk's E-step runs on the pool while the reader      */
+/* thread parses the next chunk; the counts of the chunks are summed     */
+/* before the M-step. Observations are not merged into one with several  */
+/* occurrences, as they are when the file is read into memory.           */
+
+PROB train_stream_bw(struct wfsa *fsm, struct hmm *hmm, char *filename, int maxlen, int maxiterations, PROB maxdelta, int vb) {
+    struct thread_args **threadargs;
+    struct obs_stream *stream;
+    struct obs_chunk *chunk;
+    struct sched *sched;
+    int i, iter, num_threads, num_chunks;
+    PROB *acc, *counts, *totalcounts, *totalcounts_emit = NULL, loglikelihood = 0, prevloglikelihood = 0;
+    size_t numcounts, k;
+
+    num_threads = pool_threads();
+    if (fsm != NULL) {
+	numcounts = (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 1);
+	totalcounts = malloc(fsm->num_states * sizeof(PROB));
+    } else {
+	numcounts = (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size);
+	totalcounts = malloc(hmm->num_states * sizeof(PROB));
+	totalcounts_emit = malloc(hmm->num_states * sizeof(PROB));
+    }
+    acc = big_alloc(numcounts * sizeof(PROB));
+    threadargs = training_threads(maxlen, NULL, NULL, fsm, hmm, numcounts, num_threads);
+    counts = threadargs[0]->counts;
+
+    for (iter = 0; iter < maxiterations; iter++) {
+	if (hmm != NULL)
+	    hmm_emission_columns(hmm);
+	training_threads_sync(threadargs, num_threads);
+	for (k = 0; k < numcounts; k++) { acc[k] = LOGZERO; }
+	loglikelihood = 0;
+	if ((stream = obs_stream_open(filename, g_stream_chunk)) == NULL)
+	    exit(1);
+	/* E-step, one chunk at a time */
+	for (num_chunks = 0; (chunk = obs_stream_next(stream)) != NULL; num_chunks++) {
+	    sched = sched_create(chunk->obsarray, chunk->num_obs, num_threads);
+	    for (i = 0; i < num_threads; i++) {
+		threadargs[i]->obsarray = chunk->obsarray;
+		threadargs[i]->sched = sched;
+		threadargs[i]->beta = 1.0;
+	    }
+	    pool_run(num_threads, fsm != NULL ? &trellis_fill_bw : &trellis_fill_bw_hmm, (void **) threadargs);
+	    sched_destroy(sched);
+	    obs_stream_release(stream, chunk);
+	    for (i = 0; i < num_threads; i++)
+		loglikelihood += threadargs[i]->loglikelihood;
+	    for (k = 0; k < numcounts; k++)
+		acc[k] = log_add(acc[k], counts[k]);
+	}
+	obs_stream_close(stream);
+	if (g_verbose)
+	    fprintf(stderr, "Read %i chunks\n", num_chunks);
+	fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)
+	    break;
+
+	/* M-step */
+	signal(SIGINT, SIG_IGN);
+	if (fsm != NULL) {
+	    bw_update_fsm(fsm, acc, totalcounts, vb);
+	    g_lastwfsa = fsm;
+	    signal(SIGINT, (void *)interrupt_sigproc);
+	} else {
+	    bw_update_hmm(hmm, acc, totalcounts, totalcounts_emit, vb);
+	    g_lasthmm = hmm;
+	    signal(SIGINT, (void *)interrupt_sigproc_hmm);
+	}
+	prevloglikelihood = loglikelihood;
+    }
+
+    training_threads_destroy(threadargs, num_threads);
+    big_free(acc);
+    free(totalcounts);
+    free(totalcounts_emit);
+    return(loglikelihood);
+}
+
+/* SQUAREM acceleration of Baum-Welch (--squarem), scheme S3 of Varadhan  */
+/* and Roland. Every cycle takes two EM steps, w0 -> w1 -> w2, from which */
+/* the weights are extrapolated to w0 - 2a r + a^2 v, where r = w1 - w0,  */
+/* v = w2 - 2 w1 + w0 and a = -|r|/|v| (at most -1, where the result is   */
+/* w2, and at least -stepmax). The extrapolated weights are projected     */
+/* back onto each state's simplex: weights that are zero in w2 stay zero, */
+/* others are kept above a small fraction of their value in w2, and each  */
+/* state's weights are scaled to the sum they have in w2 (1, except with  */
+/* Variational Bayes). If the loglikelihood of the extrapolated model is  */
+/* below that of w1, the model falls back to w2. The accepted model is    */
+/* the w0 of the next cycle, so that a cycle takes two E-steps. Weights   */
+/* are in the real domain.                                                */
+
+#define SQUAREM_FLOOR 0.001   /* Least fraction of its EM value an extrapolated weight keeps */
+
+struct squarem {
+    size_t numweights;
+    PROB *w0, *w1, *w2;
+    int phase;                /* EM steps taken in this cycle, 2 if the model is extrapolated */
+    PROB ll1;                 /* Loglikelihood of w1 */
+    PROB step;                /* Length of the last extrapolation */
+    PROB stepmax;             /* Grows when a step this long is accepted, shrinks on rejection */
+};
+
+static struct squarem *squarem_init(struct wfsa *fsm, struct hmm *hmm) {
+    struct squarem *sq;
+    sq = calloc(1, sizeof(struct squarem));
+    if (fsm != NULL)
+	sq->numweights = (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 1);
+    else
+	sq->numweights = (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size);
+    sq->w0 = big_alloc(sq->numweights * sizeof(PROB));
+    sq->w1 = big_alloc(sq->numweights * sizeof(PROB));
+    sq->w2 = big_alloc(sq->numweights * sizeof(PROB));
+    sq->stepmax = 4;
+    return(sq);
+}
+
+static void squarem_destroy(struct squarem *sq) {
+    if (sq == NULL)
+	return;
+    big_free(sq->w0);
+    big_free(sq->w1);
+    big_free(sq->w2);
+    free(sq);
+}
+
+/* Copies the model's weights, as reals, into w: WFSA transitions then */
+/* final states, HMM transitions then emissions                        */
+static void squarem_get(struct wfsa *fsm, struct hmm *hmm, PROB *w, size_t n) {
+    PROB *table, *table2;
+    size_t k, n1;
+    table = fsm != NULL ? fsm->state_table : hmm->transition_table;
+    table2 = fsm != NULL ? fsm->final_table : hmm->emission_table;
+    n1 = fsm != NULL ? n - fsm->num_states : (size_t) hmm->num_states * hmm->num_states;
+    for (k = 0; k < n; k++)
+	w[k] = k < n1 ? table[k] : table2[k - n1];
+    for (k = 0; k < n; k++)
+	w[k] = w[k] <= SMRZERO_LOG ? 0 : EXP(w[k]);
+}
+
+static void squarem_put(struct wfsa *fsm, struct hmm *hmm, PROB *w, size_t n) {
+    PROB *table, *table2, x;
+    size_t k, n1;
+    table = fsm != NULL ? fsm->state_table : hmm->transition_table;
+    table2 = fsm != NULL ? fsm->final_table : hmm->emission_table;
+    n1 = fsm != NULL ? n - fsm->num_states : (size_t) hmm->num_states * hmm->num_states;
+    for (k = 0; k < n; k++) {
+	x = w[k] > 0 ? LOG(w[k]) : SMRZERO_LOG;
+	if (k < n1)
+	    table[k] = x;
+	else
+	    table2[k - n1] = x;
+    }
+}
+
+/* Projects x[start ... start+len-1] and x[extra] (if extra >= 0), one */
+/* state's weights, as described above                                  */
+static void squarem_project(PROB *x, PROB *ref, size_t start, size_t len, long extra) {
+    PROB sum = 0, refsum = 0;
+    size_t k, i;
+    for (i = 0; i <= len; i++) {
+	if (i == len && extra < 0)
+	    break;
+	k = i < len ? start + i : (size_t) extra;
+	if (ref[k] <= 0)
+	    x[k] = 0;
+	else if (x[k] < ref[k] * SQUAREM_FLOOR)
+	    x[k] = ref[k] * SQUAREM_FLOOR;
+	sum += x[k];
+	refsum += ref[k];
+    }
+    for (i = 0; i <= len && sum > 0; i++) {
+	if (i == len && extra < 0)
+	    break;
+	k = i < len ? start + i : (size_t) extra;
+	x[k] *= refsum / sum;
+    }
+}
+
+/* Before an M-step: the cycle's first model is kept */
+static void squarem_begin(struct squarem *sq, struct wfsa *fsm, struct hmm *hmm) {
+    if (sq != NULL && sq->phase == 0)
+	squarem_get(fsm, hmm, sq->w0, sq->numweights);
+}
+
+/* After an M-step whose E-step had loglikelihood ll: after the second */
+/* EM step of a cycle the model is replaced by the extrapolated one    */
+/* (squarem_begin() and squarem_end() are not called in phase 2)      */
+static void squarem_end(struct squarem *sq, struct wfsa *fsm, struct hmm *hmm, PROB ll) {
+    PROB rr = 0, vv = 0, r, v, a, *x;
+    size_t k;
+    int s;
+    if (sq == NULL)
+	return;
+    if (sq->phase == 0) {
+	squarem_get(fsm, hmm, sq->w1, sq->numweights);
+	sq->phase = 1;
+	return;
+    }
+    squarem_get(fsm, hmm, sq->w2, sq->numweights);
+    sq->ll1 = ll;
+    for (k = 0; k < sq->numweights; k++) {
+	r = sq->w1[k] - sq->w0[k];
+	v = sq->w2[k] - 2 * sq->w1[k] + sq->w0[k];
+	rr += r * r;
+	vv += v * v;
+    }
+    a = vv > 0 ? -sqrt(rr / vv) : -1;
+    a = a > -1 ? -1 : a < -sq->stepmax ? -sq->stepmax : a;
+    /* The extrapolated weights go into w0, which is not needed anymore */
+    x = sq->w0;
+    for (k = 0; k < sq->numweights; k++) {
+	r = sq->w1[k] - sq->w0[k];
+	v = sq->w2[k] - 2 * sq->w1[k] + sq->w0[k];
+	x[k] = sq->w0[k] - 2 * a * r + a * a * v;
+    }
+    if (fsm != NULL) {
+	for (s = 0; s < fsm->num_states; s++)
+	    squarem_project(x, sq->w2, (size_t) s * fsm->num_states * fsm->alphabet_size, (size_t) fsm->num_states * fsm->alphabet_size, (long) (sq->numweights - fsm->num_states + s));
+    } else {
+	for (s = 0; s < hmm->num_states; s++) {
+	    squarem_project(x, sq->w2, (size_t) s * hmm->num_states, hmm->num_states, -1);
+	    squarem_project(x, sq->w2, (size_t) hmm->num_states * hmm->num_states + (size_t) s * hmm->alphabet_size, hmm->alphabet_size, -1);
+	}
+    }
+    sq->step = -a;
+    if (g_verbose)
+	fprintf(stderr, "SQUAREM: step length %.4g\n", -a);
+    squarem_put(fsm, hmm, x, sq->numweights);
+    sq->phase = 2;
+}
+
+/* After the E-step of an extrapolated model with loglikelihood ll: if  */
+/* that is below the loglikelihood of w1, puts back w2 and returns 0, so */
+/* that the M-step is skipped                                           */
+static int squarem_accept(struct squarem *sq, struct wfsa *fsm, struct hmm *hmm, PROB ll) {
+    if (sq == NULL || sq->phase != 2)
+	return(1);
+    if (ll >= sq->ll1) {
+	if (sq->step == sq->stepmax)
+	    sq->stepmax *= 4;
+	sq->phase = 0;
+	return(1);
+    }
+    if (g_verbose)
+	fprintf(stderr, "SQUAREM: extrapolation lowers the loglikelihood, using the EM step\n");
+    squarem_put(fsm, hmm, sq->w2, sq->numweights);
+    sq->stepmax = sq->step / 4 > 1 ? sq->step / 4 : 1;
+    sq->phase = 0;
+    return(0);
+}
+
+/* Starts a new cycle, e.g. when annealing changes the objective */
+static void squarem_reset(struct squarem *sq) {
+    if (sq != NULL)
+	sq->phase = 0;
+}
+
+/* When training stops: an extrapolated model that no E-step has */
+/* scored yet is replaced by the EM step it was made from         */
+static void squarem_finish(struct squarem *sq, struct wfsa *fsm, struct hmm *hmm) {
+    if (sq != NULL && sq->phase == 2) {
+	squarem_put(fsm, hmm, sq->w2, sq->numweights);
+	sq->phase = 0;
+    }
+}
+
+/* Early stopping on held-out observations (--heldout). The model of each */
+/* iteration is scored on the held-out set in the same pool job as its    */
+/* E-step, see heldout_score(). The best model so far is kept, and        */
+/* training stops after g_heldout_patience iterations without a better    */
+/* held-out loglikelihood, leaving the best model as the one trained.     */
+/* Models of deterministic annealing count only once beta is at betamax.  */
+
+struct heldout {
+    struct observations **obsarray;
+    struct sched *sched;
+    void *best;                /* Copy of the best model, NULL until there is one */
+    PROB bestll;               /* Its held-out loglikelihood */
+    PROB trainll;              /* and its training loglikelihood */
+    int bestiter;
+    int waiting;               /* Iterations since the best */
+};
+
+/* Returns NULL without --heldout; raises *olenmax to the longest */
+/* held-out observation, which the trellises must hold            */
+static struct heldout *heldout_init(int num_threads, int *olenmax) {
+    struct heldout *h;
+    int numobs;
+    if (g_heldout == NULL)
+	return(NULL);
+    h = calloc(1, sizeof(struct heldout));
+    h->obsarray = observations_to_array(g_heldout, &numobs);
+    h->sched = sched_create(h->obsarray, numobs, num_threads);
+    if (observations_max_length(g_heldout) > *olenmax)
+	*olenmax = observations_max_length(g_heldout);
+    return(h);
+}
+
+/* Hands the held-out set to the threads of the next E-step */
+static void heldout_reset(struct heldout *h, struct thread_args **threadargs, int num_threads) {
+    int i;
+    if (h == NULL)
+	return;
+    sched_reset(h->sched);
+    for (i = 0; i < num_threads; i++) {
+	threadargs[i]->heldout = h->obsarray;
+	threadargs[i]->heldout_sched = h->sched;
+    }
+}
+
+/* Called after the E-step of iteration iter, with the model it was run */
+/* on: returns 1 if training should stop                                */
+static int heldout_stop(struct heldout *h, struct thread_args **threadargs, int num_threads, struct wfsa *fsm, struct hmm *hmm, int iter, PROB loglikelihood, PROB da_beta) {
+    PROB ll;
+    int i;
+    if (h == NULL)
+	return(0);
+    for (i = 0, ll = 0; i < num_threads; i++)
+	ll += threadargs[i]->heldout_loglikelihood;
+    if (g_train_da_bw && da_beta < g_betamax) {
+	fprintf(stderr, "heldout loglikelihood=%.17g\n", ll);
+	return(0);
+    }
+    if (h->best == NULL || ll > h->bestll) {
+	if (h->best == NULL)
+	    h->best = fsm != NULL ? (void *) wfsa_copy(fsm) : (void *) hmm_copy(hmm);
+	else
+	    replica_copy(h->best, fsm != NULL ? (void *) fsm : (void *) hmm, hmm != NULL);
+	h->bestll = ll;
+	h->trainll = loglikelihood;
+	h->bestiter = iter;
+	h->waiting = 0;
+    } else {
+	h->waiting++;
+    }
+    fprintf(stderr, "heldout loglikelihood=%.17g best: %.17g (iteration %i)\n", ll, h->bestll, h->bestiter);
+    if (h->waiting < g_heldout_patience)
+	return(0);
+    fprintf(stderr, "No held-out improvement in %i iterations, stopping\n", h->waiting);
+    return(1);
+}
+
+/* Puts the best model back, and returns its training loglikelihood */
+static PROB heldout_finish(struct heldout *h, struct wfsa *fsm, struct hmm *hmm, PROB loglikelihood) {
+    if (h == NULL)
+	return(loglikelihood);
+    if (h->best != NULL) {
+	replica_copy(fsm != NULL ? (void *) fsm : (void *) hmm, h->best, hmm != NULL);
+	loglikelihood = h->trainll;
+	if (fsm != NULL)
+	    wfsa_destroy(h->best);
+	else
+	    hmm_destroy(h->best);
+	if (g_verbose)
+	    fprintf(stderr, "Model of iteration %i has the best held-out loglikelihood, %.17g\n", h->bestiter, h->bestll);
+    }
+    sched_destroy(h->sched);
+    free(h->obsarray);
+    free(h);
+    return(loglikelihood);
+}
+
+/* Continues tracking the best model from the checkpoint c (--resume) */
+static void heldout_resume(struct heldout *h, struct checkpoint *c, struct wfsa *fsm, struct hmm *hmm) {
+    if (h == NULL || c->heldout_iter == 0)
+	return;
+    if (fsm != NULL) {
+	h->best = wfsa_copy(fsm);
+	checkpoint_restore_heldout(c, h->best, NULL);
+    } else {
+	h->best = hmm_copy(hmm);
+	checkpoint_restore_heldout(c, NULL, h->best);
+	hmm_emission_columns(h->best);
+    }
+    h->bestiter = c->heldout_iter;
+    h->waiting = c->heldout_waiting;
+    h->bestll = c->heldout_bestll;
+    h->trainll = c->heldout_trainll;
+}
+
+/* Checkpoint of Baum-Welch after iteration iterations (--checkpoint).  */
+/* An extrapolated model is not saved, as it has not been scored: the   */
+/* checkpoint holds the EM step instead, and the interrupted SQUAREM    */
+/* cycle starts over from it on --resume. With --heldout the best model */
+/* so far and the iterations since it are saved too.                    */
+static void bw_checkpoint(struct squarem *sq, struct heldout *h, struct wfsa *fsm, struct hmm *hmm, int iteration, PROB beta, PROB loglikelihood) {
+    struct checkpoint c;
+    memset(&c, 0, sizeof(struct checkpoint));
+    c.iteration = iteration;
+    c.beta = beta;
+    c.loglikelihood = loglikelihood;
+    if (h != NULL && h->best != NULL) {
+	c.heldout_best = h->best;
+	c.heldout_iter = h->bestiter;
+	c.heldout_waiting = h->waiting;
+	c.heldout_bestll = h->bestll;
+	c.heldout_trainll = h->trainll;
+    }
+    if (sq != NULL && sq->phase == 2) {
+	/* The extrapolated weights are in w0 */
+	squarem_put(fsm, hmm, sq->w2, sq->numweights);
+	checkpoint_save(&c, fsm, hmm);
+	squarem_put(fsm, hmm, sq->w0, sq->numweights);
+    } else {
+	checkpoint_save(&c, fsm, hmm);
+    }
+}
+
 PROB train_baum_welch_hmm(struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta, int vb) {
-    struct trellis *trellis, *trellisarray[32];
-    struct thread_args *threadargs[32];
+    struct thread_args **threadargs;
     struct observations **obsarray;
-    int i, source, target, symbol, iter, numobs, obsperthread;
-    PROB newprob, prevloglikelihood, da_beta = 1.0;
-    pthread_t threadids[32];
+    struct sched *sched;
+    int i, iter, numobs, num_threads, olenmax;
+    PROB prevloglikelihood, da_beta = 1.0, loglikelihood = 0;
+    PROB *hmm_counts_trans, *hmm_totalcounts_trans, *hmm_totalcounts_emit;
+    struct squarem *sq = NULL;
+    struct heldout *ho;
+    size_t numcounts;
     
+    if (g_incremental_shards > 1 && !g_train_da_bw)
+	return(train_incremental_bw(NULL, hmm, o, maxiterations, maxdelta, vb));
     if (g_train_da_bw) { da_beta = g_betamin; }
+    num_threads = pool_threads();
     obsarray = observations_to_array(o, &numobs);
+    sched = sched_create(obsarray, numobs, num_threads);
     
-    /* Each thread gets its own trellis */
-    for (i = 0; i < g_num_threads; i++) {
-	trellis = trellis_init(o, hmm->num_states);
-	trellisarray[i] = trellis;
-	threadargs[i] = malloc(sizeof(struct thread_args));
-    }
-
-    /* These are accessed by all threads through a spinlock */
-    hmm_counts_trans = malloc(hmm->num_states * hmm->num_states * sizeof(PROB));
-    hmm_counts_emit = malloc(hmm->num_states * hmm->alphabet_size * sizeof(PROB));
+    /* Each thread gets its own trellis and counts (transitions, then emissions), */
+    /* which are summed into those of thread 0 at the end of each E-step          */
+    numcounts = (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size);
+    olenmax = observations_max_length(o);
+    ho = heldout_init(num_threads, &olenmax);
+    threadargs = training_threads(olenmax, obsarray, sched, NULL, hmm, numcounts, num_threads);
+    hmm_counts_trans = threadargs[0]->counts;
     hmm_totalcounts_trans = malloc(hmm->num_states * sizeof(PROB));
     hmm_totalcounts_emit = malloc(hmm->num_states * sizeof(PROB));
-    hmm_counts_spin = calloc(hmm->num_states, sizeof(_Bool));
+    if (g_squarem)
+	sq = squarem_init(NULL, hmm);
     
     prevloglikelihood = 0;
+    iter = 0;
+    if (g_resume != NULL) {
+	/* Continues the run of the checkpoint, whose model this is */
+	iter = g_resume->iteration;
+	da_beta = g_resume->beta;
+	prevloglikelihood = g_resume->loglikelihood;
+	checkpoint_restore_rng(g_resume);
+	heldout_resume(ho, g_resume, NULL, hmm);
+	g_resume = NULL;
+    }
 
-    obsperthread = (int) ((double) numobs/(double) g_num_threads);
-    /* Helper thread parameters (divide observations equally among all) */
-    for (i = 1; i < g_num_threads; i++) {
-	threadargs[i]->minobs = (i-1) * obsperthread;
-	threadargs[i]->maxobs = i * obsperthread - 1;
-	threadargs[i]->trellis = trellisarray[i];
-	threadargs[i]->obsarray = obsarray;
-	threadargs[i]->fsmhmm = hmm;
-    }
-    /* Main thread parameters */
-    threadargs[0]->minobs = (i-1) * obsperthread;
-    threadargs[0]->maxobs = numobs - 1;
-    threadargs[0]->trellis = trellisarray[0];
-    threadargs[0]->obsarray = obsarray;
-    threadargs[0]->fsmhmm = hmm;
-   
-    for (iter = 0 ; iter < maxiterations ; iter++) {
-	g_loglikelihood = 0;
-	for (i = 0; i < hmm->num_states * hmm->num_states; i++) { hmm_counts_trans[i] = LOGZERO; }
-	for (i = 0; i < hmm->num_states * hmm->alphabet_size ; i++) { hmm_counts_emit[i] = LOGZERO; }
-	for (i = 1; i < g_num_threads; i++) {
-	    /* Launch threads */
+    for ( ; iter < maxiterations ; iter++) {
+	hmm_emission_columns(hmm);
+	/* E-step on all threads of the pool, the main thread included */
+	for (i = 0; i < num_threads; i++) {
 	    threadargs[i]->beta = da_beta;
-	    pthread_create(&threadids[i], NULL, &trellis_fill_bw_hmm, threadargs[i]);
 	}
-
-	/* Run main thread Baum-Welch */
-	threadargs[0]->beta = da_beta;
-	trellis_fill_bw_hmm(threadargs[0]);
-	/* Wait for all to finish */
-	for (i = 1; i < g_num_threads; i++) {
-	    pthread_join(threadids[i],NULL);
+	training_threads_sync(threadargs, num_threads);
+	sched_reset(sched);
+	heldout_reset(ho, threadargs, num_threads);
+	pool_run(num_threads, &trellis_fill_bw_hmm, (void **) threadargs);
+	loglikelihood = 0;
+	for (i = 0; i < num_threads; i++) {
+	    loglikelihood += threadargs[i]->loglikelihood;
 	}
 
 	if (!g_train_da_bw)
-	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, g_loglikelihood, ABS(prevloglikelihood - g_loglikelihood));
+	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
 	else 
-	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g beta: %.17g\n", iter+1, g_loglikelihood, ABS(prevloglikelihood - g_loglikelihood), da_beta);
+	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g beta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood), da_beta);
+
+	/* A rejected extrapolation is replaced by its EM step, whose E-step is next */
+	if (!squarem_accept(sq, NULL, hmm, loglikelihood)) {
+	    loglikelihood = prevloglikelihood;
+	    continue;
+	}
+	if (heldout_stop(ho, threadargs, num_threads, NULL, hmm, iter + 1, loglikelihood, da_beta))
+	    break;
 	    
-	if (ABS(prevloglikelihood - g_loglikelihood) < maxdelta)  {
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)  {
 	    if (g_train_da_bw == 1 && da_beta < g_betamax) {
 		da_beta *= g_alpha;
 		if (da_beta > g_betamax) {
 		    da_beta = g_betamax;
 		}
+		squarem_reset(sq);
 	    } else {
 		break;
 	    }
@@ -1672,132 +3105,106 @@ PROB train_baum_welch_hmm(struct hmm *hmm, struct observations *o, int maxiterat
 	/* Modify HMM (M-step) */
 	signal(SIGINT, SIG_IGN); /* Disable interrupts to prevent corrupted HMM in case of SIGINT while updating */
 
-	/* Clear and sum counts */
-	for (i = 0; i < hmm->num_states ; i++) { 
-	    hmm_totalcounts_trans[i] =  hmm_totalcounts_emit[i] = LOGZERO;
-	}
-	/* Is totalcounts for emit always the same as totalcounts for transition (except at state 0)? */
-	for (source = 0; source < hmm->num_states - 1; source++) {
-	    for (symbol = 0; symbol < hmm->alphabet_size; symbol++) {		
-		hmm_totalcounts_emit[source] = log_add(*HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol), hmm_totalcounts_emit[source]);
-	    }
-	    for (target = 1; target < hmm->num_states; target++) {
-		hmm_totalcounts_trans[source] = log_add(*HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target), hmm_totalcounts_trans[source]);
-	    }
-	}
-
-	/* Re-estimate emissions */
-	for (source = 0; source < hmm->num_states; source++) {
-	    for (symbol = 0; symbol < hmm->alphabet_size; symbol++) {
-		newprob = *HMM_EMISSION_COUNTS(hmm_counts_emit, source, symbol);
-		if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
-		if (vb)
-		    *HMM_EMISSION_PROB(hmm, source, symbol) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(hmm_totalcounts_emit[source]) + hmm->alphabet_size * g_gibbs_beta_emission))/M_LN2;
-		else
-		    *HMM_EMISSION_PROB(hmm, source, symbol) = newprob - hmm_totalcounts_emit[source];
-	    }
-	}
-	/* Transitions */
-	for (source = 0; source < hmm->num_states; source++) {
-	    for (target = 0; target < hmm->num_states; target++) {
-		newprob = *HMM_TRANSITION_COUNTS(hmm_counts_trans, source, target);
-		if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
-		if (vb)
-		    *HMM_TRANSITION_PROB(hmm, source, target) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(hmm_totalcounts_trans[source]) + (hmm->num_states) * g_gibbs_beta_emission))/M_LN2;
-		else
-		    *HMM_TRANSITION_PROB(hmm, source, target) = newprob - hmm_totalcounts_trans[source];
-	    }
-	}
-	g_lasthmm = hmm;                               /* Put fsm into global var to recover in case of SIGINT */
+	squarem_begin(sq, NULL, hmm);
+	bw_update_hmm(hmm, hmm_counts_trans, hmm_totalcounts_trans, hmm_totalcounts_emit, vb);
+	squarem_end(sq, NULL, hmm, loglikelihood);
+	if (!g_lastmodel_hold)
+	    g_lasthmm = hmm;                           /* Put fsm into global var to recover in case of SIGINT */
 	signal(SIGINT, (void *)interrupt_sigproc_hmm); /* Re-enable interrupt */
-	prevloglikelihood = g_loglikelihood;
-    }
-    for (i = 0; i < g_num_threads; i++) {
-	free(trellisarray[i]);
-	free(threadargs[i]);
+	prevloglikelihood = loglikelihood;
+	if (!g_lastmodel_hold && checkpoint_due(iter + 1))
+	    bw_checkpoint(sq, ho, NULL, hmm, iter + 1, da_beta, loglikelihood);
     }
-    free(hmm_counts_trans);
-    free(hmm_counts_emit);
+    squarem_finish(sq, NULL, hmm);
+    checkpoint_finish();
+    loglikelihood = heldout_finish(ho, NULL, hmm, loglikelihood);
+    if (g_verbose)
+	sched_report(sched, "Baum-Welch");
+    training_threads_destroy(threadargs, num_threads);
+    sched_destroy(sched);
     free(hmm_totalcounts_trans);
     free(hmm_totalcounts_emit);
-    free(hmm_counts_spin);
     free(obsarray);
-    return(g_loglikelihood);
+    squarem_destroy(sq);
+    return(loglikelihood);
 }
 
 
 PROB train_baum_welch(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta, int vb) {
-    struct trellis *trellis, *trellisarray[32];
-    struct thread_args *threadargs[32];
+    struct thread_args **threadargs;
     struct observations **obsarray;
-    int i, source, target, symbol, iter, numobs, obsperthread;
-    PROB newprob, prevloglikelihood, da_beta = 1.0, numstatetrans;
-    pthread_t threadids[32];
+    struct sched *sched;
+    int i, iter, numobs, num_threads, olenmax;
+    PROB prevloglikelihood, da_beta = 1.0, loglikelihood = 0;
+    PROB *fsm_counts, *fsm_totalcounts;
+    struct squarem *sq = NULL;
+    struct heldout *ho;
+    size_t numcounts;
     
+    if (g_incremental_shards > 1 && !g_train_da_bw)
+	return(train_incremental_bw(fsm, NULL, o, maxiterations, maxdelta, vb));
     if (g_train_da_bw) { da_beta = g_betamin; }
+    num_threads = pool_threads();
     obsarray = observations_to_array(o, &numobs);
+    sched = sched_create(obsarray, numobs, num_threads);
     
-    /* Each thread gets its own trellis */
-    for (i = 0; i < g_num_threads; i++) {
-	trellis = trellis_init(o, fsm->num_states);
-	trellisarray[i] = trellis;
-	threadargs[i] = malloc(sizeof(struct thread_args));
-    }
-
-    /* These are accessed by all threads through a spinlock */
-    fsm_counts = malloc(fsm->num_states * fsm->num_states * fsm->alphabet_size * sizeof(PROB));
+    /* Each thread gets its own trellis and counts (transitions, then final */
+    /* states), which are summed into those of thread 0 after each E-step   */
+    numcounts = (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 1);
+    olenmax = observations_max_length(o);
+    ho = heldout_init(num_threads, &olenmax);
+    threadargs = training_threads(olenmax, obsarray, sched, fsm, NULL, numcounts, num_threads);
+    fsm_counts = threadargs[0]->counts;
     fsm_totalcounts = malloc(fsm->num_states * sizeof(PROB));
-    fsm_finalcounts = malloc(fsm->num_states * sizeof(PROB));
-    fsm_counts_spin = calloc(fsm->num_states, sizeof(_Bool));
+    if (g_squarem)
+	sq = squarem_init(fsm, NULL);
     
     prevloglikelihood = 0;
+    iter = 0;
+    if (g_resume != NULL) {
+	/* Continues the run of the checkpoint, whose model this is */
+	iter = g_resume->iteration;
+	da_beta = g_resume->beta;
+	prevloglikelihood = g_resume->loglikelihood;
+	checkpoint_restore_rng(g_resume);
+	heldout_resume(ho, g_resume, fsm, NULL);
+	g_resume = NULL;
+    }
 
-    obsperthread = (int) ((double) numobs/(double) g_num_threads);
-    /* Helper thread parameters (divide observations equally among all) */
-    for (i = 1; i < g_num_threads; i++) {
-	threadargs[i]->minobs = (i-1) * obsperthread;
-	threadargs[i]->maxobs = i * obsperthread - 1;
-	threadargs[i]->trellis = trellisarray[i];
-	threadargs[i]->obsarray = obsarray;
-	threadargs[i]->fsmhmm = fsm;
-    }
-    /* Main thread parameters */
-    threadargs[0]->minobs = (i-1) * obsperthread;
-    threadargs[0]->maxobs = numobs - 1;
-    threadargs[0]->trellis = trellisarray[0];
-    threadargs[0]->obsarray = obsarray;
-    threadargs[0]->fsmhmm = fsm;
-
-   
-    for (iter = 0 ; iter < maxiterations ; iter++) {
-	g_loglikelihood = 0;
-	for (i = 0; i < fsm->num_states * fsm->num_states * fsm->alphabet_size ; i++) { fsm_counts[i] = LOGZERO; }
-	for (i = 0; i < fsm->num_states ; i++) { fsm_finalcounts[i] = LOGZERO; }
-	for (i = 1; i < g_num_threads; i++) {
-	    /* Launch threads */
+    for ( ; iter < maxiterations ; iter++) {
+	/* E-step on all threads of the pool, the main thread included */
+	for (i = 0; i < num_threads; i++) {
 	    threadargs[i]->beta = da_beta;
-	    pthread_create(&threadids[i], NULL, &trellis_fill_bw, threadargs[i]);
 	}
-
-	/* Run main thread Baum-Welch */
-	threadargs[0]->beta = da_beta;
-	trellis_fill_bw(threadargs[0]);
-	/* Wait for all to finish */
-	for (i = 1; i < g_num_threads; i++) {
-	    pthread_join(threadids[i],NULL);
+	training_threads_sync(threadargs, num_threads);
+	sched_reset(sched);
+	heldout_reset(ho, threadargs, num_threads);
+	pool_run(num_threads, &trellis_fill_bw, (void **) threadargs);
+	loglikelihood = 0;
+	for (i = 0; i < num_threads; i++) {
+	    loglikelihood += threadargs[i]->loglikelihood;
 	}
 
 	if (!g_train_da_bw)
-	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, g_loglikelihood, ABS(prevloglikelihood - g_loglikelihood));
+	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
 	else 
-	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g beta: %.17g\n", iter+1, g_loglikelihood, ABS(prevloglikelihood - g_loglikelihood), da_beta);
+	    fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g beta: %.17g\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood), da_beta);
+
+	/* A rejected extrapolation is replaced by its EM step, whose E-step is next */
+	if (!squarem_accept(sq, fsm, NULL, loglikelihood)) {
+	    loglikelihood = prevloglikelihood;
+	    continue;
+	}
+	if (heldout_stop(ho, threadargs, num_threads, fsm, NULL, iter + 1, loglikelihood, da_beta))
+	    break;
 	    
-	if (ABS(prevloglikelihood - g_loglikelihood) < maxdelta)  {
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)  {
 	    if (g_train_da_bw == 1 && da_beta < g_betamax) {
 		da_beta *= g_alpha;
 		if (da_beta > g_betamax) {
 		    da_beta = g_betamax;
 		}
+		squarem_reset(sq);
 	    } else {
 		break;
 	    }
@@ -1806,125 +3213,562 @@ PROB train_baum_welch(struct wfsa *fsm, struct observations *o, int maxiteration
 	/* Modify WFSA (M-step) */
 	signal(SIGINT, SIG_IGN); /* Disable interrupts to prevent corrupted WFSA in case of SIGINT while updating */	    
         
-	numstatetrans = fsm->num_states * fsm->alphabet_size + 1;
-	/* Sum counts */
-	for (i = 0; i < fsm->num_states ; i++) { fsm_totalcounts[i] = LOGZERO; }
-	for (source = 0; source < fsm->num_states; source++) {
-	    for (symbol = 0; symbol < fsm->alphabet_size; symbol++) {
-		for (target = 0; target < fsm->num_states; target++) {
-		    fsm_totalcounts[source] = log_add(*FSM_COUNTS(fsm_counts,source,symbol,target), fsm_totalcounts[source]);
-		}
-	    }
-	}
-	for (source = 0; source < fsm->num_states; source++) {
-	    fsm_totalcounts[source] = log_add(fsm_finalcounts[source], fsm_totalcounts[source]);
+	squarem_begin(sq, fsm, NULL);
+	bw_update_fsm(fsm, fsm_counts, fsm_totalcounts, vb);
+	squarem_end(sq, fsm, NULL, loglikelihood);
+	if (!g_lastmodel_hold)
+	    g_lastwfsa = fsm;                      /* Put fsm into global var to recover in case of SIGINT */
+	signal(SIGINT, (void *)interrupt_sigproc); /* Re-enable interrupt */
+	prevloglikelihood = loglikelihood;
+	if (!g_lastmodel_hold && checkpoint_due(iter + 1))
+	    bw_checkpoint(sq, ho, fsm, NULL, iter + 1, da_beta, loglikelihood);
+    }
+    squarem_finish(sq, fsm, NULL);
+    checkpoint_finish();
+    loglikelihood = heldout_finish(ho, fsm, NULL, loglikelihood);
+
+    if (g_verbose)
+	sched_report(sched, "Baum-Welch");
+    training_threads_destroy(threadargs, num_threads);
+    sched_destroy(sched);
+    free(fsm_totalcounts);
+    free(obsarray);
+    squarem_destroy(sq);
+    return(loglikelihood);
+}
+
+/* Random restarts (--restarts=N,iterations[,parallel]). Restart 1 trains */
+/* the given model, the others random ones, each for the given number of  */
+/* iterations; the best (the first, on ties) is copied into the given     */
+/* model for the final run. Up to parallel restarts run at once, on the   */
+/* threads of a pool job, each starting its own team of the remaining     */
+/* threads (pool_set_threads()). Restart models are made under the lock   */
+/* in restart order, so the same models are tried however many run at     */
+/* once.                                                                  */
+/*                                                                        */
+/* With --halving=ETA the restarts are run in rounds (successive          */
+/* halving): after each round only the best 1/ETA of the models are kept, */
+/* and these continue training for ETA times as many iterations as in the */
+/* round before, until one model is left.                                 */
+
+struct restart {
+    void *model;
+    PROB ll;
+    int index;
+};
+
+struct restarts {
+    struct wfsa *fsm;          /* Model given; restart 1 */
+    struct hmm *hmm;
+    struct observations *o;
+    PROB maxdelta;
+    int team;                  /* Threads per restart */
+    int parallel;              /* Restarts at once */
+    int iterations;            /* Iterations per model this round */
+    int round;
+    int num_models;            /* Models trained this round */
+    struct restart *models;    /* Models of this round; NULL in the first, where they are made */
+    pthread_mutex_t lock;
+    int next;                  /* Next model to train */
+    int keep;                  /* Models kept for the next round */
+    int num_kept;
+    struct restart *kept;      /* Best models of this round so far, best first */
+};
+
+static struct wfsa *wfsa_random(void) {
+    struct wfsa *fsm;
+    fsm = wfsa_init(g_num_states, g_alphabet_size);
+    if (g_generate_type == GENERATE_NONDETERMINISTIC)
+	wfsa_randomize_nondeterministic(fsm,0,0);
+    if (g_generate_type == GENERATE_DETERMINISTIC)
+	wfsa_randomize_deterministic(fsm,0);
+    if (g_generate_type == GENERATE_BAKIS)
+	wfsa_randomize_nondeterministic(fsm,1,0);
+    wfsa_to_log2(fsm);
+    return(fsm);
+}
+
+static struct hmm *hmm_random(void) {
+    struct hmm *hmm;
+    hmm = hmm_init(g_num_states, g_alphabet_size);
+    if (g_generate_type == GENERATE_BAKIS)
+	hmm_randomize(hmm,1,0);
+    else
+	hmm_randomize(hmm,0,0);
+    hmm_to_log2(hmm);
+    return(hmm);
+}
+
+/* Frees a restart model, unless it is the one given */
+static void restart_discard(struct restarts *r, void *model) {
+    if (model == NULL || model == r->fsm || model == r->hmm)
+	return;
+    if (r->fsm != NULL)
+	wfsa_destroy(model);
+    else
+	hmm_destroy(model);
+}
+
+/* Adds a trained model to the kept ones if it is among the best so far */
+/* (higher loglikelihood, or equal and lower restart number), otherwise */
+/* discards it. Called with the lock held.                              */
+static void restart_keep(struct restarts *r, struct restart *m) {
+    int pos;
+    for (pos = r->num_kept; pos > 0; pos--) {
+	if (m->ll < r->kept[pos-1].ll || (m->ll == r->kept[pos-1].ll && m->index > r->kept[pos-1].index))
+	    break;
+    }
+    if (pos >= r->keep) {
+	restart_discard(r, m->model);
+	return;
+    }
+    if (r->num_kept == r->keep)
+	restart_discard(r, r->kept[--r->num_kept].model);
+    memmove(r->kept + pos + 1, r->kept + pos, sizeof(struct restart) * (r->num_kept - pos));
+    r->kept[pos] = *m;
+    r->num_kept++;
+}
+
+static void *restart_thread(void *restartargs) {
+    struct restarts *r;
+    struct restart m;
+    int i;
+    r = (struct restarts *) restartargs;
+    pool_set_threads(r->team);
+    for (;;) {
+	pthread_mutex_lock(&r->lock);
+	i = r->next++;
+	m.model = NULL;
+	if (i < r->num_models && r->models != NULL) {
+	    m = r->models[i];
+	} else if (i < r->num_models) {
+	    m.index = i;
+	    if (r->fsm != NULL)
+		m.model = i == 0 ? (void *) r->fsm : (void *) wfsa_random();
+	    else
+		m.model = i == 0 ? (void *) r->hmm : (void *) hmm_random();
 	}
+	pthread_mutex_unlock(&r->lock);
+	if (m.model == NULL)
+	    break;
+	if (r->round == 0)
+	    fprintf(stderr, "===Running BW restart #%i===\n", m.index+1);
+	else
+	    fprintf(stderr, "===Continuing BW restart #%i===\n", m.index+1);
+	if (r->fsm != NULL)
+	    m.ll = train_baum_welch(m.model, r->o, r->iterations, r->maxdelta, g_bw_vb);
+	else
+	    m.ll = train_baum_welch_hmm(m.model, r->o, r->iterations, r->maxdelta, g_bw_vb);
+	if (r->parallel > 1 || g_restart_halving > 1)
+	    fprintf(stderr, "===BW restart #%i done: loglikelihood=%.17g===\n", m.index+1, m.ll);
+	pthread_mutex_lock(&r->lock);
+	restart_keep(r, &m);
+	pthread_mutex_unlock(&r->lock);
+    }
+    pool_set_threads(0);
+    pool_shutdown();
+    return(NULL);
+}
 
-	for (source = 0; source < fsm->num_states; source++) {
-	    for (symbol = 0; symbol < fsm->alphabet_size; symbol++) {
-		for (target = 0; target < fsm->num_states; target++) {
-		    newprob = *FSM_COUNTS(fsm_counts,source,symbol,target);
-		    if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
-		    /* Variational Bayes: apply digamma function to count */
-		    if (vb) {
-			*TRANSITION(fsm,source,symbol,target) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(fsm_totalcounts[source]) + numstatetrans * g_gibbs_beta))/M_LN2;
-		    } else {
-			*TRANSITION(fsm,source,symbol,target) = newprob - fsm_totalcounts[source];
-		    }
-		}
-	    }
+/* Runs the restarts and leaves the best model in fsm or hmm */
+static void restarts_run(struct wfsa *fsm, struct hmm *hmm, struct observations *o, PROB maxdelta) {
+    struct restarts r;
+    void **args;
+    int i, parallel;
+    memset(&r, 0, sizeof(r));
+    r.fsm = fsm;
+    r.hmm = hmm;
+    r.o = o;
+    r.maxdelta = maxdelta;
+    r.num_models = g_random_restarts;
+    r.iterations = g_random_restart_iterations;
+    parallel = g_random_restarts_parallel > g_num_threads ? g_num_threads : g_random_restarts_parallel;
+    parallel = parallel < 1 ? 1 : parallel;
+    pthread_mutex_init(&r.lock, NULL);
+    g_lastwfsa = fsm;
+    g_lasthmm = hmm;
+    g_lastmodel_hold = 1;
+    args = malloc(sizeof(void *) * parallel);
+    for (i = 0; i < parallel; i++)
+	args[i] = &r;
+    for (r.round = 0; ; r.round++) {
+	r.keep = g_restart_halving > 1 ? (r.num_models + g_restart_halving - 1) / g_restart_halving : 1;
+	r.kept = malloc(sizeof(struct restart) * r.keep);
+	r.num_kept = 0;
+	r.next = 0;
+	/* Fewer models in later rounds get bigger teams */
+	r.parallel = parallel > r.num_models ? r.num_models : parallel;
+	r.team = g_num_threads / r.parallel;
+	if (g_restart_halving > 1)
+	    fprintf(stderr, "===Successive halving round %i: %i model%s, %i iteration%s each===\n", r.round+1, r.num_models, r.num_models > 1 ? "s" : "", r.iterations, r.iterations > 1 ? "s" : "");
+	if (r.parallel > 1)
+	    fprintf(stderr, "===Running %i BW restarts at a time with %i thread%s each===\n", r.parallel, r.team, r.team > 1 ? "s" : "");
+	pool_run(r.parallel, &restart_thread, args);
+	free(r.models);
+	r.models = r.kept;
+	r.num_models = r.num_kept;
+	if (r.num_models <= 1)
+	    break;
+	r.iterations *= g_restart_halving;
+    }
+    free(args);
+    g_lastmodel_hold = 0;
+    pthread_mutex_destroy(&r.lock);
+    if (r.models[0].model != fsm && r.models[0].model != hmm) {
+	if (hmm != NULL)
+	    hmm_emission_columns(r.models[0].model);
+	replica_copy(fsm != NULL ? (void *) fsm : (void *) hmm, r.models[0].model, hmm != NULL);
+	restart_discard(&r, r.models[0].model);
+    }
+    free(r.models);
+}
+
+/* Online (stepwise) EM, -T obw. The observations are visited in random  */
+/* order, --online=BATCH at a time. After each mini-batch the running    */
+/* expected counts mu move towards those of the batch (per observation)  */
+/* by a step eta_k = (k+2)^-alpha, k being the number of updates so far, */
+/* and the model is re-estimated from mu. mu starts out as the model's   */
+/* own weights, so arcs not seen in the first batches keep some weight.  */
+/* maxiterations and maxdelta apply to passes over the data (epochs);    */
+/* the loglikelihood of an epoch is summed over its batches, each under  */
+/* the model as it was when the batch was read.                          */
+
+PROB train_online_bw(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int maxepochs, PROB maxdelta) {
+    struct thread_args **threadargs;
+    struct observations **obsarray, *swap;
+    struct sched *sched;
+    int i, j, epoch, numobs, num_threads, batch, n, updates = 0;
+    PROB *mu, *counts, *totals, *totals_emit = NULL, *weights;
+    PROB eta, keep, step, occurrences, loglikelihood = 0, prevloglikelihood = 0, batchloglikelihood;
+    size_t numcounts, numweights, k;
+
+    if (g_random_restarts > 0) {
+	restarts_run(fsm, hmm, o, maxdelta);
+	fprintf(stderr, "===Running final online BW===\n");
+    }
+    num_threads = pool_threads();
+    obsarray = observations_to_array(o, &numobs);
+    batch = g_online_batch < numobs ? g_online_batch : numobs;
+
+    /* Counts have the layout of the model's weights (see bw_update_fsm/hmm) */
+    if (fsm != NULL) {
+	numweights = (size_t) fsm->num_states * fsm->num_states * fsm->alphabet_size;
+	numcounts = numweights + fsm->num_states;
+	weights = fsm->state_table;
+	totals = malloc(fsm->num_states * sizeof(PROB));
+    } else {
+	numweights = (size_t) hmm->num_states * hmm->num_states;
+	numcounts = numweights + (size_t) hmm->num_states * hmm->alphabet_size;
+	weights = hmm->transition_table;
+	totals = malloc(hmm->num_states * sizeof(PROB));
+	totals_emit = malloc(hmm->num_states * sizeof(PROB));
+    }
+    mu = malloc(numcounts * sizeof(PROB));
+    for (k = 0; k < numcounts; k++) {
+	mu[k] = k < numweights ? weights[k] : fsm != NULL ? fsm->final_table[k - numweights] : hmm->emission_table[k - numweights];
+	mu[k] = mu[k] <= SMRZERO_LOG ? LOGZERO : mu[k];
+    }
+    threadargs = training_threads(observations_max_length(o), obsarray, NULL, fsm, hmm, numcounts, num_threads);
+    counts = threadargs[0]->counts;
+
+    for (epoch = 0; epoch < maxepochs; epoch++) {
+	for (i = numobs - 1; i > 0; i--) {
+	    j = rand_int_range(0, i + 1);
+	    swap = obsarray[i];
+	    obsarray[i] = obsarray[j];
+	    obsarray[j] = swap;
 	}
-	for (source = 0; source < fsm->num_states; source++) {
-	    newprob = fsm_finalcounts[source];
-	    if (newprob == LOGZERO) { newprob = SMRZERO_LOG; }
-	    /* Variational Bayes */
-	    if (vb) {
-		*FINALPROB(fsm,source) = (digamma(EXP(newprob) + g_gibbs_beta) - digamma(EXP(fsm_totalcounts[source]) + numstatetrans * g_gibbs_beta))/M_LN2;
+	loglikelihood = 0;
+	for (j = 0; j < numobs; j += batch) {
+	    n = numobs - j < batch ? numobs - j : batch;
+	    /* E-step over the batch */
+	    if (hmm != NULL)
+		hmm_emission_columns(hmm);
+	    sched = sched_create(obsarray + j, n, num_threads);
+	    for (i = 0; i < num_threads; i++) {
+		threadargs[i]->obsarray = obsarray + j;
+		threadargs[i]->sched = sched;
+		threadargs[i]->beta = 1.0;
+	    }
+	    training_threads_sync(threadargs, num_threads);
+	    pool_run(num_threads, fsm != NULL ? &trellis_fill_bw : &trellis_fill_bw_hmm, (void **) threadargs);
+	    sched_destroy(sched);
+	    batchloglikelihood = 0;
+	    for (i = 0; i < num_threads; i++)
+		batchloglikelihood += threadargs[i]->loglikelihood;
+	    loglikelihood += batchloglikelihood;
+
+	    /* mu = (1-eta) mu + eta counts/occurrences */
+	    for (i = j, occurrences = 0; i < j + n; i++)
+		occurrences += obsarray[i]->occurrences;
+	    eta = pow(updates + 2, -g_online_alpha);
+	    keep = LOG(1 - eta);
+	    step = LOG(eta) - LOG(occurrences);
+	    for (k = 0; k < numcounts; k++)
+		mu[k] = log_add(mu[k] == LOGZERO ? LOGZERO : mu[k] + keep, counts[k] == LOGZERO ? LOGZERO : counts[k] + step);
+	    updates++;
+	    if (g_verbose)
+		fprintf(stderr, "epoch %i batch %i loglikelihood=%.17g eta: %.17g\n", epoch+1, j / batch + 1, batchloglikelihood, eta);
+
+	    /* M-step */
+	    signal(SIGINT, SIG_IGN);
+	    if (fsm != NULL) {
+		bw_update_fsm(fsm, mu, totals, 0);
+		if (!g_lastmodel_hold)
+		    g_lastwfsa = fsm;
+		signal(SIGINT, (void *)interrupt_sigproc);
 	    } else {
-		*FINALPROB(fsm,source) = newprob - fsm_totalcounts[source];
+		bw_update_hmm(hmm, mu, totals, totals_emit, 0);
+		if (!g_lastmodel_hold)
+		    g_lasthmm = hmm;
+		signal(SIGINT, (void *)interrupt_sigproc_hmm);
 	    }
 	}
-	g_lastwfsa = fsm;                          /* Put fsm into global var to recover in case of SIGINT */
-	signal(SIGINT, (void *)interrupt_sigproc); /* Re-enable interrupt */
-	prevloglikelihood = g_loglikelihood;
+	fprintf(stderr, "epoch %i loglikelihood=%.17g delta: %.17g\n", epoch+1, loglikelihood, ABS(prevloglikelihood - loglikelihood));
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)
+	    break;
+	prevloglikelihood = loglikelihood;
     }
+    if (hmm != NULL)
+	hmm_emission_columns(hmm);
+    training_threads_destroy(threadargs, num_threads);
+    free(mu);
+    free(totals);
+    free(totals_emit);
+    free(obsarray);
+    return(loglikelihood);
+}
 
-    for (i = 0; i < g_num_threads; i++) {
-	free(trellisarray[i]);
-	free(threadargs[i]);
+/* Gradient-based maximum likelihood training, -T lbfgs. The weights out  */
+/* of each state (WFSA: arcs and final weight; HMM: transitions, and      */
+/* emissions) are the softmax of free parameters, in log2 units, which    */
+/* are optimized with GSL's vector_bfgs2 minimizer. It stores no Hessian, */
+/* only the last step and gradient change (limited-memory BFGS with one   */
+/* pair), so memory grows with the size of the model. The loglikelihood  */
+/* and its gradient come from one multithreaded pass of trellis_fill_bw  */
+/* over the data: for a parameter x with weight p and expected count c,   */
+/* from a state with total expected count C, dLL/dx = c - C p. Weights    */
+/* that are zero at the start stay zero.                                  */
+
+struct lbfgs_data {
+    struct wfsa *fsm;
+    struct hmm *hmm;
+    struct thread_args **threadargs;
+    struct sched *sched;
+    int num_threads;
+    size_t numweights;        /* Parameters, in the layout of the counts */
+    char *fixed;              /* Parameters of zero weights */
+    PROB *cache_x;            /* Parameters of the last evaluation */
+    PROB *cache_g;
+    PROB cache_f;
+    int cached;
+    int passes;               /* Passes over the data so far */
+};
+
+/* Weight k of the model, in the layout of the counts */
+static PROB *lbfgs_weight(struct lbfgs_data *d, size_t k) {
+    size_t n1;
+    if (d->fsm != NULL) {
+	n1 = d->numweights - d->fsm->num_states;
+	return(k < n1 ? d->fsm->state_table + k : d->fsm->final_table + (k - n1));
     }
-    free(fsm_counts);
-    free(fsm_totalcounts);
-    free(fsm_finalcounts);
-    free(fsm_counts_spin);
-    free(obsarray);
-    return(g_loglikelihood);
+    n1 = (size_t) d->hmm->num_states * d->hmm->num_states;
+    return(k < n1 ? d->hmm->transition_table + k : d->hmm->emission_table + (k - n1));
 }
 
-PROB train_bw_hmm(struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta) {
-    struct hmm *besthmm;
-    int i;
-    PROB thisll, minll;
-    if (g_random_restarts == 0)
-	return(train_baum_welch_hmm(hmm, o, maxiterations, maxdelta, g_bw_vb));
-
-    /* Random restarts */
-    minll = -DBL_MAX;
-    besthmm = NULL;
-    for (i = 0; i < g_random_restarts; i++) {
-	fprintf(stderr, "===Running BW restart #%i===\n", i+1);
-	thisll = train_baum_welch_hmm(hmm, o, g_random_restart_iterations, maxdelta, g_bw_vb);
-	if (thisll > minll) {
-	    minll = thisll;
-	    if (besthmm != NULL)
-		hmm_destroy(besthmm);
-	    besthmm = hmm_copy(hmm);
-	}
-	if (i < g_random_restarts + 1) {
-	    hmm = hmm_init(g_num_states, g_alphabet_size);
-	    if (g_generate_type == GENERATE_BAKIS)
-		hmm_randomize(hmm,1,0);
-	    else
-		hmm_randomize(hmm,0,0);
-	    hmm_to_log2(hmm);
+/* The weights of one state, x[start ... start+len-1] and x[extra] (if */
+/* extra >= 0), from their parameters; with g != NULL the gradient of */
+/* -loglikelihood for them from the counts of the last E-step          */
+static void lbfgs_row(struct lbfgs_data *d, const PROB *x, PROB *g, size_t start, size_t len, long extra) {
+    PROB max = -DBL_MAX, sum = 0, total = 0, *counts;
+    size_t k, i;
+    counts = d->threadargs[0]->counts;
+    for (i = 0; i <= len; i++) {
+	if (i == len && extra < 0)
+	    break;
+	k = i < len ? start + i : (size_t) extra;
+	if (d->fixed[k]) { continue; }
+	max = x[k] > max ? x[k] : max;
+	if (g != NULL)
+	    total += counts[k] == LOGZERO ? 0 : EXP(counts[k]);
+    }
+    for (i = 0; i <= len && g == NULL; i++) {
+	if (i == len && extra < 0)
+	    break;
+	k = i < len ? start + i : (size_t) extra;
+	if (!d->fixed[k])
+	    sum += EXP(x[k] - max);
+    }
+    for (i = 0; i <= len; i++) {
+	if (i == len && extra < 0)
+	    break;
+	k = i < len ? start + i : (size_t) extra;
+	if (g != NULL)
+	    g[k] = d->fixed[k] ? 0 : total * EXP(*lbfgs_weight(d, k)) - (counts[k] == LOGZERO ? 0 : EXP(counts[k]));
+	else
+	    *lbfgs_weight(d, k) = d->fixed[k] ? SMRZERO_LOG : x[k] - max - LOG(sum);
+    }
+}
+
+static void lbfgs_rows(struct lbfgs_data *d, const PROB *x, PROB *g) {
+    int s, n, a;
+    if (d->fsm != NULL) {
+	n = d->fsm->num_states;
+	a = d->fsm->alphabet_size;
+	for (s = 0; s < n; s++)
+	    lbfgs_row(d, x, g, (size_t) s * n * a, (size_t) n * a, (long) (d->numweights - n + s));
+    } else {
+	n = d->hmm->num_states;
+	a = d->hmm->alphabet_size;
+	for (s = 0; s < n; s++) {
+	    lbfgs_row(d, x, g, (size_t) s * n, n, -1);
+	    lbfgs_row(d, x, g, (size_t) n * n + (size_t) s * a, a, -1);
 	}
     }
-    fprintf(stderr, "===Running final BW===\n");
-    return(train_baum_welch_hmm(besthmm, o, maxiterations, maxdelta, g_bw_vb));
 }
 
-PROB train_bw(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta) {
-    struct wfsa *bestfsm;
+/* Sets the model from x and returns -loglikelihood and its gradient */
+static void lbfgs_fdf(const gsl_vector *x, void *params, double *f, gsl_vector *g) {
+    struct lbfgs_data *d = params;
+    const PROB *xp;
     int i;
-    PROB thisll, minll;
-    if (g_random_restarts == 0)
-	return(train_baum_welch(fsm,o,maxiterations,maxdelta,g_bw_vb));
-
-    /* Random restarts */
-    minll = -DBL_MAX;
-    bestfsm = NULL;
-    for (i = 0; i < g_random_restarts; i++) {
-	fprintf(stderr, "===Running BW restart #%i===\n", i+1);
-	thisll = train_baum_welch(fsm, o, g_random_restart_iterations, maxdelta,g_bw_vb);
-	if (thisll > minll) {
-	    minll = thisll;
-	    if (bestfsm != NULL)
-		wfsa_destroy(bestfsm);
-	    bestfsm = wfsa_copy(fsm);
-	}
-	if (i < g_random_restarts + 1) {
-	    fsm = wfsa_init(g_num_states, g_alphabet_size);
-	    if (g_generate_type == GENERATE_NONDETERMINISTIC)
-		wfsa_randomize_nondeterministic(fsm,0,0);
-	    if (g_generate_type == GENERATE_DETERMINISTIC)
-		wfsa_randomize_deterministic(fsm,0);
-	    if (g_generate_type == GENERATE_BAKIS)
-		wfsa_randomize_nondeterministic(fsm,1,0);
-	    wfsa_to_log2(fsm);
+    xp = gsl_vector_const_ptr(x, 0);
+    if (!d->cached || memcmp(xp, d->cache_x, d->numweights * sizeof(PROB)) != 0) {
+	signal(SIGINT, SIG_IGN);
+	lbfgs_rows(d, xp, NULL);
+	signal(SIGINT, d->fsm != NULL ? (void *)interrupt_sigproc : (void *)interrupt_sigproc_hmm);
+	if (d->hmm != NULL)
+	    hmm_emission_columns(d->hmm);
+	for (i = 0; i < d->num_threads; i++)
+	    d->threadargs[i]->beta = 1.0;
+	training_threads_sync(d->threadargs, d->num_threads);
+	sched_reset(d->sched);
+	pool_run(d->num_threads, d->fsm != NULL ? &trellis_fill_bw : &trellis_fill_bw_hmm, (void **) d->threadargs);
+	for (i = 0, d->cache_f = 0; i < d->num_threads; i++)
+	    d->cache_f -= d->threadargs[i]->loglikelihood;
+	lbfgs_rows(d, xp, d->cache_g);
+	memcpy(d->cache_x, xp, d->numweights * sizeof(PROB));
+	d->cached = 1;
+	d->passes++;
+    }
+    *f = d->cache_f;
+    memcpy(gsl_vector_ptr(g, 0), d->cache_g, d->numweights * sizeof(PROB));
+}
+
+static double lbfgs_f(const gsl_vector *x, void *params) {
+    struct lbfgs_data *d = params;
+    double f;
+    gsl_vector *g;
+    g = gsl_vector_alloc(d->numweights);
+    lbfgs_fdf(x, params, &f, g);
+    gsl_vector_free(g);
+    return(f);
+}
+
+static void lbfgs_df(const gsl_vector *x, void *params, gsl_vector *g) {
+    double f;
+    lbfgs_fdf(x, params, &f, g);
+}
+
+PROB train_lbfgs(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta) {
+    struct lbfgs_data d;
+    struct observations **obsarray;
+    gsl_multimin_fdfminimizer *s;
+    gsl_multimin_function_fdf func;
+    gsl_vector *x;
+    int iter, numobs, status;
+    PROB loglikelihood = 0, prevloglikelihood = 0;
+    size_t k;
+
+    if (g_random_restarts > 0) {
+	restarts_run(fsm, hmm, o, maxdelta);
+	fprintf(stderr, "===Running final L-BFGS===\n");
+    }
+    memset(&d, 0, sizeof(struct lbfgs_data));
+    d.fsm = fsm;
+    d.hmm = hmm;
+    d.num_threads = pool_threads();
+    obsarray = observations_to_array(o, &numobs);
+    d.sched = sched_create(obsarray, numobs, d.num_threads);
+    if (fsm != NULL)
+	d.numweights = (size_t) fsm->num_states * (fsm->num_states * fsm->alphabet_size + 1);
+    else
+	d.numweights = (size_t) hmm->num_states * (hmm->num_states + hmm->alphabet_size);
+    d.threadargs = training_threads(observations_max_length(o), obsarray, d.sched, fsm, hmm, d.numweights, d.num_threads);
+    d.fixed = malloc(d.numweights);
+    d.cache_x = big_alloc(d.numweights * sizeof(PROB));
+    d.cache_g = big_alloc(d.numweights * sizeof(PROB));
+
+    /* The weights are their own parameters to start with */
+    x = gsl_vector_alloc(d.numweights);
+    for (k = 0; k < d.numweights; k++) {
+	d.fixed[k] = *lbfgs_weight(&d, k) <= SMRZERO_LOG;
+	gsl_vector_set(x, k, d.fixed[k] ? 0 : *lbfgs_weight(&d, k));
+    }
+    func.n = d.numweights;
+    func.f = &lbfgs_f;
+    func.df = &lbfgs_df;
+    func.fdf = &lbfgs_fdf;
+    func.params = &d;
+    s = gsl_multimin_fdfminimizer_alloc(gsl_multimin_fdfminimizer_vector_bfgs2, d.numweights);
+    gsl_multimin_fdfminimizer_set(s, &func, x, 1.0, 0.1);
+    prevloglikelihood = -gsl_multimin_fdfminimizer_minimum(s);
+    fprintf(stderr, "iteration 0 loglikelihood=%.17g passes: %i\n", prevloglikelihood, d.passes);
+
+    for (iter = 0; iter < maxiterations; iter++) {
+	status = gsl_multimin_fdfminimizer_iterate(s);
+	loglikelihood = -gsl_multimin_fdfminimizer_minimum(s);
+	fprintf(stderr, "iteration %i loglikelihood=%.17g delta: %.17g passes: %i\n", iter+1, loglikelihood, ABS(prevloglikelihood - loglikelihood), d.passes);
+	if (status != GSL_SUCCESS) {
+	    if (g_verbose)
+		fprintf(stderr, "L-BFGS stopped: line search made no progress\n");
+	    break;
 	}
+	if (ABS(prevloglikelihood - loglikelihood) < maxdelta)
+	    break;
+	prevloglikelihood = loglikelihood;
+    }
+
+    /* The line search leaves the model at its last trial point */
+    signal(SIGINT, SIG_IGN);
+    lbfgs_rows(&d, gsl_vector_const_ptr(gsl_multimin_fdfminimizer_x(s), 0), NULL);
+    if (fsm != NULL) {
+	if (!g_lastmodel_hold)
+	    g_lastwfsa = fsm;
+	signal(SIGINT, (void *)interrupt_sigproc);
+    } else {
+	hmm_emission_columns(hmm);
+	if (!g_lastmodel_hold)
+	    g_lasthmm = hmm;
+	signal(SIGINT, (void *)interrupt_sigproc_hmm);
+    }
+    if (g_verbose)
+	sched_report(d.sched, "L-BFGS");
+    gsl_multimin_fdfminimizer_free(s);
+    gsl_vector_free(x);
+    training_threads_destroy(d.threadargs, d.num_threads);
+    sched_destroy(d.sched);
+    big_free(d.cache_x);
+    big_free(d.cache_g);
+    free(d.fixed);
+    free(obsarray);
+    return(loglikelihood);
+}
+
+PROB train_bw_hmm(struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta) {
+    if (g_random_restarts > 0 && g_resume == NULL) {
+	restarts_run(NULL, hmm, o, maxdelta);
+	fprintf(stderr, "===Running final BW===\n");
+    }
+    return(train_baum_welch_hmm(hmm, o, maxiterations, maxdelta, g_bw_vb));
+}
+
+PROB train_bw(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta) {
+    if (g_random_restarts > 0 && g_resume == NULL) {
+	restarts_run(fsm, NULL, o, maxdelta);
+	fprintf(stderr, "===Running final BW===\n");
     }
-    fprintf(stderr, "===Running final BW===\n");
-    return(train_baum_welch(bestfsm, o, maxiterations, maxdelta, g_bw_vb));
+    return(train_baum_welch(fsm, o, maxiterations, maxdelta, g_bw_vb));
 }
 
 PROB train_viterbi_bw(struct wfsa *fsm, struct observations *o) {
@@ -1942,16 +3786,24 @@ PROB train_viterbi_bw_hmm(struct hmm *hmm, struct observations *o) {
 }
 
 int main(int argc, char **argv) {
-    int opt, option_index = 0, algorithm = 0, numelem, obs_alphabet_size, use_cuda = 0, use_hmm = 0, statemergetest = MERGE_TEST_ALERGIA, recursive_merge_test = 0;
-    char *fsmfile = NULL, optionchar;
+    int opt, option_index = 0, algorithm = 0, numelem, obs_alphabet_size = 0, use_cuda = 0, use_hmm = 0, statemergetest = MERGE_TEST_ALERGIA, recursive_merge_test = 0;
+    char *fsmfile = NULL, **fsmfiles = NULL, *posteriorfile = NULL, *resumefile = NULL, *heldoutfile = NULL, *p, optionchar;
+    int num_fsmfiles = 0, multi_output = MULTI_ALL, multi_batch = 0;
     PROB ll;
     struct wfsa *fsm = NULL;
     struct hmm *hmm = NULL;
     struct observations *o = NULL;
+    long stream_numobs = 0, num;
+    int stream_maxlen = 0;
+    struct multi_models *mm;
+    int i;
     srandom((unsigned int)time((time_t *)NULL));
     srand48((unsigned int)time((time_t *)NULL));
     statemergetest = MERGE_TEST_ALERGIA;
 
+    g_cpu = cpu_detect();
+    g_kernel = &trellis_kernel_table[g_cpu];
+
     log1plus_taylor_init();
 #ifdef _WIN32
     SYSTEM_INFO sysinfo;
@@ -1964,6 +3816,13 @@ int main(int argc, char **argv) {
 static struct option long_options[] =
 	{
 	    {"annealing-params",required_argument, 0, 'a'},
+	    {"online",          required_argument, 0, 'O'},
+	    {"incremental",     required_argument, 0, 'I'},
+	    {"stream",          required_argument, 0, 's'},
+	    {"squarem",               no_argument, 0, 'E'},
+	    {"checkpoint",      required_argument, 0, 'W'},
+	    {"resume",          required_argument, 0, 'U'},
+	    {"heldout",         required_argument, 0, 'Q'},
 	    {"burnin",          required_argument, 0, 'b'},
 	    {"max-delta",       required_argument, 0, 'd'},
 	    {"file",            required_argument, 0, 'f'},
@@ -1973,17 +3832,28 @@ static struct option long_options[] =
 	    {"input-format",    required_argument, 0, 'i'},
 	    {"output-format",   required_argument, 0, 'o'},
 	    {"prior",           required_argument, 0, 'p'},
+	    {"posteriors",      required_argument, 0, 'P'},
+	    {"logadd",          required_argument, 0, 'e'},
+	    {"hugepages",       required_argument, 0, 'Z'},
+	    {"verbose",               no_argument, 0, 'V'},
+	    {"quantize",        required_argument, 0, 'q'},
 	    {"restarts",        required_argument, 0, 'r'},
+	    {"halving",         optional_argument, 0, 'S'},
 	    {"threads",         required_argument, 0, 't'},
+	    {"pin-threads",           no_argument, 0, 'N'},
 	    {"uniform-probs",         no_argument, 0, 'u'},
 	    {"version",               no_argument, 0, 'v'},
 	    {"max-iterations",  required_argument, 0, 'x'},
 	    {"t0",              required_argument, 0, 'y'},
 	    {"alpha",           required_argument, 0, 'A'},
+	    {"threshold",       required_argument, 0, 'c'},
+	    {"argmax",                no_argument, 0, 'm'},
+	    {"batch",                 no_argument, 0, 'B'},
 	    {"cuda",                  no_argument, 0, 'C'},
 	    {"decode",          required_argument, 0, 'D'},
 	    {"generate",        required_argument, 0, 'G'},
 	    {"hmm",                   no_argument, 0, 'H'},
+	    {"jit",             optional_argument, 0, 'J'},
 	    {"likelihood",      required_argument, 0, 'L'},
 	    {"merge-test",      required_argument, 0, 'M'},
 	    {"recursive-merge",       no_argument, 0, 'R'},
@@ -1991,10 +3861,11 @@ static struct option long_options[] =
 	    {0, 0, 0, 0}
 	};
 
- while ((opt = getopt_long(argc, argv, "a:b:d:f:g:hl:i:o:p:r:t:uvx:y:A:CD:G:HL:M:RT:", long_options, &option_index)) != -1) {
+ while ((opt = getopt_long(argc, argv, "a:b:c:d:e:f:g:hl:i:mo:p:q:r:s:t:uvx:y:A:BCD:EG:HI:J::L:M:NO:P:Q:RS::T:U:VW:Z:", long_options, &option_index)) != -1) {
 	switch(opt) {
 	case 'v':
 	    printf("This is %s\n", versionstring);
+	    printf("Using %s kernels\n", cpu_name(g_cpu));
 	    exit(0);
 	case 'h':
 	    printf("%s", helpstring);
@@ -2010,9 +3881,65 @@ static struct option long_options[] =
 	    }
 	    break;
 	case 'r':
-	    numelem = sscanf(optarg,"%i,%i", &g_random_restarts, &g_random_restart_iterations);
+	    numelem = sscanf(optarg,"%i,%i,%i", &g_random_restarts, &g_random_restart_iterations, &g_random_restarts_parallel);
 	    if (numelem < 1) {
-		fprintf(stderr, "-r option requires #num restarts[,#num iterations per restart]\n"); 
+		fprintf(stderr, "-r option requires #num restarts[,#num iterations per restart[,#num restarts at a time]]\n"); 
+		exit(1);
+	    }
+	    break;
+	case 'I':
+	    num = strtol(optarg, &p, 10);
+	    if (p == optarg || *p != '\0' || num < 1 || num > INT_MAX) {
+		fprintf(stderr, "--incremental requires a number of shards >= 1\n");
+		exit(1);
+	    }
+	    g_incremental_shards = (int) num;
+	    break;
+	case 'E':
+	    g_squarem = 1;
+	    break;
+	case 'W':
+	    g_checkpoint_file = strdup(optarg);
+	    if ((p = strchr(g_checkpoint_file, ',')) != NULL) {
+		*p = '\0';
+		numelem = sscanf(p + 1, "%i,%lg", &g_checkpoint_every, &g_checkpoint_minutes);
+		if (numelem < 1 || g_checkpoint_every < 0 || g_checkpoint_minutes < 0) {
+		    fprintf(stderr, "--checkpoint requires FILE[,iterations[,minutes]]\n");
+		    exit(1);
+		}
+	    }
+	    break;
+	case 'U':
+	    resumefile = optarg;
+	    break;
+	case 'Q':
+	    heldoutfile = strdup(optarg);
+	    if ((p = strchr(heldoutfile, ',')) != NULL) {
+		*p = '\0';
+		if (sscanf(p + 1, "%i", &g_heldout_patience) < 1 || g_heldout_patience < 1) {
+		    fprintf(stderr, "--heldout requires FILE[,patience]\n");
+		    exit(1);
+		}
+	    }
+	    break;
+	case 's':
+	    g_stream_chunk = (size_t) (atof(optarg) * 1048576);
+	    if (g_stream_chunk == 0) {
+		fprintf(stderr, "--stream requires a chunk size in MB\n");
+		exit(1);
+	    }
+	    break;
+	case 'O':
+	    numelem = sscanf(optarg,"%i,%lg", &g_online_batch, &g_online_alpha);
+	    if (numelem < 1 || g_online_batch < 1 || g_online_alpha <= 0.5 || g_online_alpha > 1) {
+		fprintf(stderr, "-O option requires batch size[,step size exponent in (0.5,1]]\n");
+		exit(1);
+	    }
+	    break;
+	case 'S':
+	    g_restart_halving = optarg != NULL ? atoi(optarg) : 2;
+	    if (g_restart_halving < 2) {
+		fprintf(stderr, "--halving requires ETA >= 2\n");
 		exit(1);
 	    }
 	    break;
@@ -2079,7 +4006,18 @@ static struct option long_options[] =
 	    if (strcmp(optarg,"nlog2") == 0)  {  g_output_format = FORMAT_NLOG2;  }
 	    break;
 	case 'f':
-	    fsmfile = strdup(optarg);
+	    fsmfiles = multi_files_add(fsmfiles, &num_fsmfiles, optarg);
+	    fsmfile = num_fsmfiles > 0 ? fsmfiles[0] : NULL;
+	    break;
+	case 'P':
+	    algorithm = POSTERIORS_WRITE;
+	    posteriorfile = optarg;
+	    break;
+	case 'm':
+	    multi_output = MULTI_ARGMAX;
+	    break;
+	case 'B':
+	    multi_batch = 1;
 	    break;
 	case 'A':
 	    g_merge_alpha = strtod(optarg, NULL);
@@ -2127,19 +4065,82 @@ static struct option long_options[] =
 		g_bw_vb = 1;
 	    }
 	    if (strcmp(optarg,"vitbw") == 0)  { algorithm = TRAIN_VITERBI_BW;    }
+	    if (strcmp(optarg,"obw") == 0)    { algorithm = TRAIN_ONLINE_BAUM_WELCH; }
+	    if (strcmp(optarg,"lbfgs") == 0)  { algorithm = TRAIN_LBFGS; }
 	    if (strcmp(optarg,"dabw") == 0) {
 	        algorithm = TRAIN_DA_BAUM_WELCH;
 		g_train_da_bw = 1;
 	    }
 	    break;
+	case 'c':
+	    g_threshold = atof(optarg);
+	    g_threshold_mode = strstr(optarg, ",p") != NULL ? THRESHOLD_PRINT_PROB : THRESHOLD_ACCEPT;
+	    break;
+	case 'Z':
+	    /* Mode, up to the first comma, then the threshold in MB */
+	    numelem = (p = strchr(optarg, ',')) != NULL ? (int) (p - optarg) : (int) strlen(optarg);
+	    if (numelem == 3 && strncmp(optarg,"off",3) == 0)          { g_hugepages = HUGEPAGES_OFF; }
+	    else if (numelem == 3 && strncmp(optarg,"thp",3) == 0)     { g_hugepages = HUGEPAGES_THP; }
+	    else if (numelem == 7 && strncmp(optarg,"hugetlb",7) == 0) { g_hugepages = HUGEPAGES_HUGETLB; }
+	    else {
+		fprintf(stderr, "Error: --hugepages must be one of off, thp, hugetlb\n");
+		exit(EXIT_FAILURE);
+	    }
+	    if (p != NULL)
+		g_hugepage_threshold = (size_t) (atof(p + 1) * (1 << 20));
+	    break;
+	case 'V':
+	    g_verbose = 1;
+	    break;
+	case 'N':
+	    g_pin_threads = 1;
+	    break;
+	case 'q':
+	    numelem = sscanf(optarg, "%i,%i", &g_quantize, &g_quantize_check);
+	    if (g_quantize != 8 && g_quantize != 16) {
+		fprintf(stderr, "Error: --quantize must be 8 or 16\n");
+		exit(EXIT_FAILURE);
+	    }
+	    if ((strchr(optarg, ',') != NULL && numelem < 2) || g_quantize_check < 0) {
+		fprintf(stderr, "Error: --quantize=BITS,N requires a number of observations N >= 0\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'e':
+	    if (strcmp(optarg,"minimax") == 0)    { g_logadd = LOGADD_MINIMAX; }
+	    else if (strcmp(optarg,"table") == 0) { g_logadd = LOGADD_TABLE; }
+	    else if (strcmp(optarg,"lib") == 0)   { g_logadd = LOGADD_LIB; }
+	    else if (strcmp(optarg,"bench") == 0) {
+		log1plus_init();
+		logadd_bench();
+		exit(0);
+	    } else {
+		fprintf(stderr, "Error: --logadd must be one of minimax, table, lib, bench\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'J':
+	    if (optarg != NULL)
+		g_jit_cachedir = optarg;
+	    else if ((g_jit_cachedir = jit_default_cachedir()) == NULL)
+		exit(EXIT_FAILURE);
+	    break;
 	case 'L':
 	    if (strcmp(optarg,"vit") == 0) { algorithm = LIKELIHOOD_VITERBI;  }
 	    if (strcmp(optarg,"f") == 0)   { algorithm = LIKELIHOOD_FORWARD;  }
+	    if (strcmp(optarg,"fs") == 0)  { algorithm = LIKELIHOOD_FORWARD_SCALED; }
 	    if (strcmp(optarg,"b") == 0)   { algorithm = LIKELIHOOD_BACKWARD; }
 	    break;
 	case 'D':
 	    if (strcmp(optarg,"vit") == 0)   { algorithm = DECODE_VITERBI;       }
 	    if (strcmp(optarg,"vit,p") == 0) { algorithm = DECODE_VITERBI_PROB;  }
+	    if (strncmp(optarg,"vit,k=",6) == 0) {
+		algorithm = DECODE_VITERBI_KBEST;
+		if ((g_kbest = atoi(optarg+6)) < 1) {
+		    fprintf(stderr, "Error: k must be at least 1 in vit,k=N\n");
+		    exit(EXIT_FAILURE);
+		}
+	    }
 	    if (strcmp(optarg,"f") == 0)     { algorithm = DECODE_FORWARD;       }
 	    if (strcmp(optarg,"f,p") == 0)   { algorithm = DECODE_FORWARD_PROB;  }
 	    if (strcmp(optarg,"b") == 0)     { algorithm = DECODE_BACKWARD;      }
@@ -2159,18 +4160,87 @@ static struct option long_options[] =
 	fprintf(stderr, "Usage: %s",usagestring);
 	exit(EXIT_FAILURE);
     }
-    if (argc > 0) {
+    if (g_verbose) {
+#ifndef _WIN32
+	fprintf(stderr, "Page size %li kB, huge page size %zu kB\n", sysconf(_SC_PAGESIZE) >> 10, big_alloc_hugepage_size() >> 10);
+#endif /* _WIN32 */
+	if (g_hugepages == HUGEPAGES_OFF)
+	    fprintf(stderr, "Huge pages off\n");
+	else
+	    fprintf(stderr, "Buffers of %zu bytes or more use %s\n", g_hugepage_threshold, g_hugepages == HUGEPAGES_HUGETLB ? "hugetlbfs huge pages" : "transparent huge pages");
+    }
+    if (g_stream_chunk > 0 && algorithm != TRAIN_BAUM_WELCH && algorithm != TRAIN_VARIATIONAL_BAYES) {
+	fprintf(stderr, "Error: --stream only applies to -T bw and vb\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_stream_chunk > 0 && (g_random_restarts > 0 || g_incremental_shards > 1)) {
+	fprintf(stderr, "Error: --stream cannot be combined with --restarts or --incremental\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_restart_halving > 1 && g_random_restarts <= 0) {
+	fprintf(stderr, "Error: --halving requires --restarts (-r)\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_incremental_shards > 1 && algorithm != TRAIN_BAUM_WELCH && algorithm != TRAIN_VARIATIONAL_BAYES && algorithm != TRAIN_VITERBI_BW) {
+	fprintf(stderr, "Error: --incremental only applies to -T bw, vb and vitbw\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_squarem && algorithm != TRAIN_BAUM_WELCH && algorithm != TRAIN_VARIATIONAL_BAYES && algorithm != TRAIN_DA_BAUM_WELCH) {
+	fprintf(stderr, "Error: --squarem only applies to -T bw, vb and dabw\n");
+	exit(EXIT_FAILURE);
+    }
+    if (g_squarem && (g_stream_chunk > 0 || g_incremental_shards > 1)) {
+	fprintf(stderr, "Error: --squarem cannot be combined with --stream or --incremental\n");
+	exit(EXIT_FAILURE);
+    }
+    if ((g_checkpoint_file != NULL || resumefile != NULL) && algorithm != TRAIN_BAUM_WELCH && algorithm != TRAIN_VARIATIONAL_BAYES && algorithm != TRAIN_DA_BAUM_WELCH && algorithm != TRAIN_GIBBS_SAMPLING) {
+	fprintf(stderr, "Error: --checkpoint and --resume only apply to -T bw, vb, dabw and gs\n");
+	exit(EXIT_FAILURE);
+    }
+    if ((g_checkpoint_file != NULL || resumefile != NULL) && (g_stream_chunk > 0 || g_incremental_shards > 1 || use_cuda)) {
+	fprintf(stderr, "Error: --checkpoint and --resume cannot be combined with --stream, --incremental or --cuda\n");
+	exit(EXIT_FAILURE);
+    }
+    if (heldoutfile != NULL && algorithm != TRAIN_BAUM_WELCH && algorithm != TRAIN_VARIATIONAL_BAYES && algorithm != TRAIN_DA_BAUM_WELCH) {
+	fprintf(stderr, "Error: --heldout only applies to -T bw, vb and dabw\n");
+	exit(EXIT_FAILURE);
+    }
+    if (heldoutfile != NULL && (g_stream_chunk > 0 || g_incremental_shards > 1)) {
+	fprintf(stderr, "Error: --heldout cannot be combined with --stream or --incremental\n");
+	exit(EXIT_FAILURE);
+    }
+    if (heldoutfile != NULL && (g_heldout = observations_read(heldoutfile)) == NULL) {
+	perror("Error reading held-out observations file");
+	exit(EXIT_FAILURE);
+    }
+    if (resumefile != NULL) {
+	if ((g_resume = checkpoint_read(resumefile)) == NULL)
+	    exit(EXIT_FAILURE);
+	if (g_resume->algorithm != algorithm || g_resume->use_hmm != use_hmm) {
+	    fprintf(stderr, "Error: the checkpoint is of another training algorithm or model type\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (argc > 0 && g_stream_chunk > 0) {
+	/* Observations are read on every iteration, see train_stream_bw() */
+	if (obs_stream_scan(argv[0], g_stream_chunk, &obs_alphabet_size, &stream_maxlen, &stream_numobs) < 0) {
+	    perror("Error reading observations file");
+	    exit(EXIT_FAILURE);
+	}
+	if (g_verbose)
+	    fprintf(stderr, "Streaming %li observations in chunks of %zu bytes, longest %i symbols\n", stream_numobs, g_stream_chunk, stream_maxlen);
+    } else if (argc > 0) {
 	if ((o = observations_read(argv[0])) == NULL) {
 	    perror("Error reading observations file");	    
 	    exit(EXIT_FAILURE);
 	}
 	obs_alphabet_size = observations_alphabet_size(o);
     }
-    if (fsmfile == NULL && g_generate_type == 0 && (algorithm != TRAIN_MERGE && algorithm != TRAIN_MDI)) {
+    if (fsmfile == NULL && g_generate_type == 0 && g_resume == NULL && (algorithm != TRAIN_MERGE && algorithm != TRAIN_MDI)) {
 	perror("You must either specify a FSM file with -f, or initialize a random FSM with -g");
 	exit(EXIT_FAILURE);
     }
-    if (g_alphabet_size < 0 && o != NULL) {
+    if (g_alphabet_size < 0 && (o != NULL || g_stream_chunk > 0)) {
 	g_alphabet_size = obs_alphabet_size;
     }
     if (g_generate_type > 0) {
@@ -2201,7 +4271,42 @@ static struct option long_options[] =
 	}
     }
 
-    if (fsmfile != NULL) {
+    if (num_fsmfiles > 1) {
+	if (algorithm != LIKELIHOOD_FORWARD && algorithm != LIKELIHOOD_FORWARD_SCALED && algorithm != LIKELIHOOD_VITERBI && algorithm != LIKELIHOOD_BACKWARD) {
+	    fprintf(stderr, "Error: several models (-f) can only be used with --likelihood\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (g_threshold_mode || g_jit_cachedir != NULL || g_quantize) {
+	    fprintf(stderr, "Error: several models (-f) cannot be combined with --threshold, --jit or --quantize\n");
+	    exit(EXIT_FAILURE);
+	}
+	mm = multi_models_read(fsmfiles, num_fsmfiles, use_hmm);
+	for (i = 0; i < mm->num_models; i++) {
+	    if ((use_hmm ? mm->hmms[i]->alphabet_size : mm->fsms[i]->alphabet_size) < obs_alphabet_size) {
+		fprintf(stderr, "Error: the observations file has symbols outside the alphabet of '%s'.\n", fsmfiles[i]);
+		exit(1);
+	    }
+	}
+	log1plus_init();
+	multi_likelihood(mm, o, algorithm, multi_output, multi_batch);
+	exit(0);
+    }
+    if (g_quantize) {
+	if (algorithm != LIKELIHOOD_FORWARD && algorithm != LIKELIHOOD_FORWARD_SCALED && algorithm != LIKELIHOOD_VITERBI && algorithm != DECODE_VITERBI && algorithm != DECODE_VITERBI_PROB) {
+	    fprintf(stderr, "Error: --quantize requires --likelihood=f, fs, or vit, or --decode=vit[,p]\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (g_threshold_mode) {
+	    fprintf(stderr, "Error: --quantize cannot be combined with --threshold\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (fsmfile == NULL) {
+	    fprintf(stderr, "Error: --quantize requires a model file (-f)\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    /* With --quantize, quant_likelihood() reads the model file itself */
+    if (fsmfile != NULL && !g_quantize) {
 	if (!use_hmm)
 	    fsm = wfsa_read_file(fsmfile);
 	else
@@ -2213,14 +4318,37 @@ static struct option long_options[] =
 		hmm_to_log2(hmm);
 	}
     }
-    if (o != NULL && ((fsm != NULL && fsm->alphabet_size < obs_alphabet_size) | (hmm != NULL && hmm->alphabet_size < obs_alphabet_size))) {
+    if (g_resume != NULL) {
+	/* The model and its size are those of the checkpoint */
+	fsm = NULL;
+	hmm = NULL;
+	checkpoint_restore_model(g_resume, &fsm, &hmm);
+	g_num_states = g_resume->num_states;
+	g_alphabet_size = g_resume->alphabet_size;
+	fprintf(stderr, "Resuming from '%s' after iteration %i\n", resumefile, g_resume->iteration);
+    }
+    if (g_checkpoint_file != NULL)
+	checkpoint_start(algorithm);
+    if ((o != NULL || g_stream_chunk > 0) && ((fsm != NULL && fsm->alphabet_size < obs_alphabet_size) | (hmm != NULL && hmm->alphabet_size < obs_alphabet_size))) {
 	fprintf(stderr, "Error: the observations file has symbols outside the FSA alphabet.\n");
 	fprintf(stderr, "FSA alphabet size: %i  Observations alphabet size %i.\n", fsm->alphabet_size, obs_alphabet_size);
 	exit(1);
     }
+    if (g_heldout != NULL && observations_alphabet_size(g_heldout) > (fsm != NULL ? fsm->alphabet_size : hmm->alphabet_size)) {
+	fprintf(stderr, "Error: the held-out observations have symbols outside the model's alphabet.\n");
+	exit(1);
+    }
 
     log1plus_init();
-	
+
+    if (g_threshold_mode) {
+	if (algorithm != LIKELIHOOD_FORWARD && algorithm != LIKELIHOOD_FORWARD_SCALED && algorithm != LIKELIHOOD_VITERBI) {
+	    fprintf(stderr, "Error: --threshold requires --likelihood=f, fs, or vit\n");
+	    exit(EXIT_FAILURE);
+	}
+	g_threshold = format_to_log2(g_threshold, g_output_format);
+    }
+
     switch (algorithm) {
     case GENERATE_WORDS:
 	if (!use_hmm)
@@ -2230,7 +4358,21 @@ static struct option long_options[] =
 	break;
     case DECODE_VITERBI:
     case DECODE_VITERBI_PROB:
+    case DECODE_VITERBI_KBEST:
     case LIKELIHOOD_VITERBI:
+	if (g_quantize) {
+	    quant_likelihood(fsmfile, use_hmm, o, algorithm, g_quantize, g_quantize_check);
+	    break;
+	}
+	if (g_threshold_mode) {
+	    if (!use_hmm)
+		threshold_fsm(fsm, o, algorithm);
+	    else
+		threshold_hmm(hmm, o, algorithm);
+	    break;
+	}
+	if (algorithm == LIKELIHOOD_VITERBI && g_jit_cachedir != NULL && likelihood_jit(fsm, hmm, o, algorithm))
+	    break;
 	if (!use_hmm)
 	    viterbi(fsm, o, algorithm);
 	else
@@ -2239,11 +4381,28 @@ static struct option long_options[] =
     case DECODE_FORWARD:
     case DECODE_FORWARD_PROB:
     case LIKELIHOOD_FORWARD:
+    case LIKELIHOOD_FORWARD_SCALED:
+	if (g_quantize) {
+	    quant_likelihood(fsmfile, use_hmm, o, algorithm, g_quantize, g_quantize_check);
+	    break;
+	}
+	if (g_threshold_mode) {
+	    if (!use_hmm)
+		threshold_fsm(fsm, o, algorithm);
+	    else
+		threshold_hmm(hmm, o, algorithm);
+	    break;
+	}
+	if (algorithm != DECODE_FORWARD && algorithm != DECODE_FORWARD_PROB && g_jit_cachedir != NULL && likelihood_jit(fsm, hmm, o, algorithm))
+	    break;
 	if (!use_hmm)
 	    forward_fsm(fsm, o, algorithm);
 	else
 	    forward_hmm(hmm, o, algorithm);
 	break;
+    case POSTERIORS_WRITE:
+	posteriors_write(fsm, hmm, o, posteriorfile);
+	break;
     case DECODE_BACKWARD:
     case DECODE_BACKWARD_PROB:
     case LIKELIHOOD_BACKWARD:
@@ -2255,6 +4414,16 @@ static struct option long_options[] =
     case TRAIN_VARIATIONAL_BAYES:
     case TRAIN_BAUM_WELCH:
     case TRAIN_DA_BAUM_WELCH:
+	if (g_stream_chunk > 0) {
+	    if (!use_hmm) {
+		train_stream_bw(fsm, NULL, argv[0], stream_maxlen, g_maxiterations, g_maxdelta, g_bw_vb);
+		wfsa_print(fsm);
+	    } else {
+		train_stream_bw(NULL, hmm, argv[0], stream_maxlen, g_maxiterations, g_maxdelta, g_bw_vb);
+		hmm_print(hmm);
+	    }
+	    break;
+	}
 	o = observations_sort(o);
 	o = observations_uniq(o);
 	if (!use_hmm) {
@@ -2265,6 +4434,28 @@ static struct option long_options[] =
 	    hmm_print(hmm);
 	}
 	break;
+    case TRAIN_ONLINE_BAUM_WELCH:
+	o = observations_sort(o);
+	o = observations_uniq(o);
+	if (!use_hmm) {
+	    train_online_bw(fsm, NULL, o, g_maxiterations, g_maxdelta);
+	    wfsa_print(fsm);
+	} else {
+	    train_online_bw(NULL, hmm, o, g_maxiterations, g_maxdelta);
+	    hmm_print(hmm);
+	}
+	break;
+    case TRAIN_LBFGS:
+	o = observations_sort(o);
+	o = observations_uniq(o);
+	if (!use_hmm) {
+	    train_lbfgs(fsm, NULL, o, g_maxiterations, g_maxdelta);
+	    wfsa_print(fsm);
+	} else {
+	    train_lbfgs(NULL, hmm, o, g_maxiterations, g_maxdelta);
+	    hmm_print(hmm);
+	}
+	break;
     case TRAIN_VITERBI:
 	o = observations_sort(o);
 	o = observations_uniq(o);
@@ -2336,6 +4527,7 @@ static struct option long_options[] =
 	    wfsa_print(fsm);
     }
     log1plus_free();
+    pool_shutdown();
     if (fsm != NULL)
 	wfsa_destroy(fsm);
     if (hmm != NULL)
@@ -35,6 +35,15 @@
 #define TRAIN_MERGE             16
 #define TRAIN_MDI               17
 #define GENERATE_WORDS          18
+#define LIKELIHOOD_FORWARD_SCALED 19
+#define DECODE_VITERBI_KBEST    20
+#define POSTERIORS_WRITE        21
+#define TRAIN_ONLINE_BAUM_WELCH 22
+#define TRAIN_LBFGS             23
+
+/* Output of likelihood calculations with --threshold */
+#define THRESHOLD_ACCEPT        1 /* Print accept/reject                        */
+#define THRESHOLD_PRINT_PROB    2 /* Print probability if accepted, else reject */
 
 /* State merging tests */
 #define MERGE_TEST_ALERGIA      1 /* Alergia (Hoeffding bound test)                           */
@@ -59,6 +68,25 @@
 #define FORMAT_NLOG2    5
 #define FORMAT_NLN      6
 
+/* Instruction sets for runtime dispatch of the hot kernels. The trellis */
+/* and Gibbs kernels are compiled once per instruction set, and the best */
+/* variant the CPU supports is chosen at startup by cpu_detect().        */
+#define CPU_GENERIC   0
+#define CPU_AVX2      1
+#define CPU_AVX512    2
+
+/* Approximations of log2(1+2^x) used by log_add(), chosen with --logadd */
+#define LOGADD_MINIMAX  0
+#define LOGADD_TABLE    1
+#define LOGADD_LIB      2
+#define LOGADD_NUM      3
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_CPU_DISPATCH)
+ #define CPU_DISPATCH
+ #define CPU_ATTR_AVX2   __attribute__((target("avx2,fma")))
+ #define CPU_ATTR_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+#endif
+
 #define LOG(X)        (log2((X)))
 #define EXP(X)        (exp2((X)))
 #define SMRZERO_LOG  -DBL_MAX
@@ -78,25 +106,30 @@ typedef double PROB;
 
 #define HMM_TRANSITION_PROB(HMM, SOURCE_STATE, TARGET_STATE) ((HMM)->transition_table + (HMM)->num_states * (SOURCE_STATE) + (TARGET_STATE))
 #define HMM_EMISSION_PROB(HMM, STATE, SYMBOL) ((HMM)->emission_table + (HMM)->alphabet_size * (STATE) + (SYMBOL))
+#define HMM_EMISSION_COLUMN(HMM, SYMBOL) ((HMM)->emission_columns + (HMM)->num_states * (SYMBOL))
 
 //PROB smrzero = SMRZERO_LOG;
 //PROB smrone  = 0;
 
-PROB *fsm_counts, *fsm_totalcounts, *fsm_finalcounts;
-_Bool *fsm_counts_spin;
-PROB *hmm_counts_trans, *hmm_counts_emit, *hmm_totalcounts_trans, *hmm_totalcounts_emit;
-_Bool *hmm_counts_spin;
-
-//pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
-
-
 struct thread_args {
     struct trellis *trellis;
     struct observations **obsarray;
-    int minobs;
-    int maxobs;
+    struct sched *sched;       /* Hands out the observations, see pool.c */
+    size_t trellissize;        /* Trellis and counts are allocated by the thread */
     void *fsmhmm;
     PROB beta;
+    int thread;                /* 0 is the main thread */
+    int num_threads;
+    struct thread_args **all;  /* Arguments of all threads, for bw_counts_reduce() */
+    PROB *counts;              /* Private Baum-Welch counts (log2) of this thread */
+    size_t numcounts;
+    PROB loglikelihood;        /* Of the observations of this thread */
+    void *model;               /* Model being trained; fsmhmm may be a copy of it */
+    int use_hmm;               /* on this thread's NUMA node, owned by the thread */
+    int copy_replica;          /* of the node that has copy_replica set           */
+    struct observations **heldout;  /* Scored after the thread's share of an E-step, */
+    struct sched *heldout_sched;    /* NULL without --heldout                        */
+    PROB heldout_loglikelihood;
 };
 
 struct observations *g_obsarray;
@@ -113,6 +146,7 @@ struct hmm {
     int alphabet_size;
     PROB *transition_table;
     PROB *emission_table;
+    PROB *emission_columns;  /* Symbol-major copy of emission_table, see hmm_emission_columns() */
 };
 
 struct observations {
@@ -134,11 +168,13 @@ struct trellis {
 /* Input and output conversion */
 PROB output_convert(PROB x);
 PROB input_convert(PROB x);
+PROB format_to_log2(PROB x, int format);
 
 /* Functions to handle file and text input */
 char *file_to_mem(char *name);
 int char_in_array(char c, char *array);
 int line_count_elements(char **ptr);
+int line_sscanf(char *line, char *next, const char *format, ...);
 char *line_to_int_array(char *ptr, int **line, int *size);
 
 void hmm_print(struct hmm *hmm);
@@ -162,8 +198,13 @@ PROB gibbs_sampler_hmm(struct hmm *hmm, struct observations *o, double beta_e, d
 
 void interrupt_sigproc(void);
 
-inline void spinlock_lock(_Bool *ptr);
-inline void spinlock_unlock(_Bool *ptr);
+void bw_counts_reduce(struct thread_args *args);
+void viterbi_counts_reduce(struct thread_args *args);
+
+int cpu_detect(void);
+char *cpu_name(int cpu);
+char *logadd_name(int logadd);
+void logadd_bench(void);
 
 PROB rand_double();
 int rand_int_range(int from, int to);
@@ -180,12 +221,20 @@ void wfsa_to_log2(struct wfsa *fsm);
 PROB wfsa_sum_prob(struct wfsa *fsm, int state);
 int wfsa_random_transition(struct wfsa *fsm, int state, int *symbol, PROB *prob);
 
+/* HMM functions */
+struct hmm *hmm_read_file(char *filename);
+struct hmm *hmm_init(int num_states, int alphabet_size);
+void hmm_destroy(struct hmm *hmm);
+void hmm_to_log2(struct hmm *hmm);
+void hmm_emission_columns(struct hmm *hmm);
+
 /* Generation functions */
 void generate_words(struct wfsa *fsm, int numwords);
 
 /* Observation file/array functions */
 int obssortcmp(struct observations **a, struct observations **b);
 int observations_alphabet_size(struct observations *ohead);
+int observations_max_length(struct observations *ohead);
 struct observations **observations_to_array(struct observations *ohead, int *numobs);
 struct observations *observations_uniq(struct observations *ohead);
 struct observations *observations_sort(struct observations *ohead);
@@ -201,28 +250,81 @@ PROB trellis_backward(struct trellis *trellis, int *obs, int length, struct wfsa
 PROB trellis_viterbi(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
 PROB trellis_forward_fsm(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
 PROB trellis_forward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_backward_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_viterbi_hmm(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+
+/* Semiring instantiations of the trellis engine (trellis_kernel.h), */
+/* generic versions; see g_kernel for the runtime-selected ones       */
+PROB trellis_forward_fsm_log(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+PROB trellis_forward_hmm_log(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_backward_fsm_log(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+PROB trellis_backward_hmm_log(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_forward_fsm_max(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+PROB trellis_forward_hmm_max(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_forward_fsm_real(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+PROB trellis_forward_hmm_real(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+PROB trellis_bounded_fsm_log(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+PROB trellis_bounded_hmm_log(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+PROB trellis_bounded_fsm_max(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+PROB trellis_bounded_hmm_max(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+PROB trellis_bounded_fsm_real(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+PROB trellis_bounded_hmm_real(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+struct trellis_kernels {
+    PROB (*forward_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+    PROB (*forward_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+    PROB (*backward_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+    PROB (*backward_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+    PROB (*viterbi_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+    PROB (*viterbi_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+    PROB (*forward_fsm_real)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm);
+    PROB (*forward_hmm_real)(struct trellis *trellis, int *obs, int length, struct hmm *hmm);
+    PROB (*bounded_fsm_log)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+    PROB (*bounded_hmm_log)(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+    PROB (*bounded_fsm_max)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+    PROB (*bounded_hmm_max)(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+    PROB (*bounded_fsm_real)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold);
+    PROB (*bounded_hmm_real)(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold);
+};
 struct trellis *trellis_init(struct observations *o, int num_states);
 void trellis_print(struct trellis *trellis, struct wfsa *fsm, int obs_len);
 
 /* Trellis path printing functions */
-void forward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len);
-void backward_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len);
-void viterbi_print_path(struct trellis *trellis, struct wfsa *fsm, int obs_len);
+void forward_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len);
+void forward_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len);
+void backward_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len);
+void backward_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len);
+void viterbi_print_path(FILE *out, struct trellis *trellis, struct wfsa *fsm, int obs_len);
+void viterbi_print_path_hmm(FILE *out, struct trellis *trellis, struct hmm *hmm, int obs_len);
+void viterbi_print_kbest(FILE *out, struct trellis *trellis, struct wfsa *fsm, struct hmm *hmm, int *obs, int obs_len, int k);
 
 /* Main decoding and likelihood calculations */
+/* Decodes (or scores) one observation with fsm or hmm and prints the result to out */
+typedef void (*decode_fn)(FILE *out, struct trellis *trellis, struct observations *obs, struct wfsa *fsm, struct hmm *hmm, int algorithm);
+void decode_observations(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int algorithm, decode_fn decode);
 void viterbi(struct wfsa *fsm, struct observations *o, int algorithm);
 void forward_fsm(struct wfsa *fsm, struct observations *o, int algorithm);
 void forward_hmm(struct hmm *hmm, struct observations *o, int algorithm);
 void backward_fsm(struct wfsa *fsm, struct observations *o, int algorithm);
+void posteriors_write(struct wfsa *fsm, struct hmm *hmm, struct observations *o, char *filename);
 void backward_hmm(struct hmm *hmm, struct observations *o, int algorithm);
+void threshold_suffix(PROB *suffix, int *obs, int length, PROB *step, PROB final);
+void threshold_print(PROB prob);
+void threshold_fsm(struct wfsa *fsm, struct observations *o, int algorithm);
+void threshold_hmm(struct hmm *hmm, struct observations *o, int algorithm);
+int likelihood_jit(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int algorithm);
 
 /* Main training functions */
 PROB train_viterbi(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta);
 PROB train_viterbi_hmm(struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta);
 PROB train_baum_welch(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta, int vb);
 PROB train_bw(struct wfsa *fsm, struct observations *o, int maxiterations, PROB maxdelta);
+PROB train_online_bw(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int maxepochs, PROB maxdelta);
+PROB train_lbfgs(struct wfsa *fsm, struct hmm *hmm, struct observations *o, int maxiterations, PROB maxdelta);
+PROB train_stream_bw(struct wfsa *fsm, struct hmm *hmm, char *filename, int maxlen, int maxiterations, PROB maxdelta, int vb);
 PROB train_viterbi_bw(struct wfsa *fsm, struct observations *o);
 void *trellis_fill_bw(void *threadargs);
+void *trellis_fill_viterbi(void *threadargs);
+void *trellis_fill_viterbi_hmm(void *threadargs);
 
 int main(int argc, char **argv);
 
@@ -243,3 +345,144 @@ struct dffa *dffa_mdi(struct observations *o, PROB alpha);
 struct dffa *observations_to_dffa(struct observations *o);
 struct dffa *dffa_init(int num_states, int alphabet_size);
 int dffa_chi2_test(struct dffa *dffa, int qu, int qv, double alpha);
+
+/* alloc.c */
+
+#define HUGEPAGES_OFF     0 /* Aligned malloc only                        */
+#define HUGEPAGES_THP     1 /* Large buffers mmapped, madvise(MADV_HUGEPAGE) */
+#define HUGEPAGES_HUGETLB 2 /* Large buffers from the hugetlbfs pool        */
+#define ALLOC_ALIGN      64
+
+void *big_alloc(size_t size);
+void big_free(void *ptr);
+size_t big_alloc_hugepage_size(void);
+
+/* pool.c */
+
+void pool_run(int num_threads, void *(*fn)(void *), void **args);
+void pool_barrier_wait(void);
+void pool_shutdown(void);
+int pool_thread_node(int thread, int num_threads);
+int pool_threads(void);
+void pool_set_threads(int num_threads);
+struct sched *sched_create(struct observations **obsarray, int numobs, int num_threads);
+void sched_reset(struct sched *s);
+int sched_next(struct sched *s, int thread, const int **idx, int *n);
+void sched_report(struct sched *s, char *what);
+void sched_add(struct sched *total, struct sched *s);
+void sched_destroy(struct sched *s);
+
+/* stream.c */
+
+struct obs_chunk {
+    int num_obs;
+    struct observations *obs;        /* Linked in file order */
+    struct observations **obsarray;
+    int *symbols;
+    int max_obs;
+    size_t max_symbols;
+};
+
+struct obs_stream *obs_stream_open(char *filename, size_t chunkbytes);
+struct obs_chunk *obs_stream_next(struct obs_stream *s);
+void obs_stream_release(struct obs_stream *s, struct obs_chunk *c);
+void obs_stream_close(struct obs_stream *s);
+int obs_stream_scan(char *filename, size_t chunkbytes, int *alphabet_size, int *maxlen, long *numobs);
+
+/* checkpoint.c */
+
+#define CHECKPOINT_RANDSTATE  128  /* Bytes of random() state, that of srandom() */
+#define CHECKPOINT_MAX_TABLES 8
+
+struct checkpoint {
+    int algorithm;             /* -T of the run */
+    int use_hmm;
+    int num_states;
+    int alphabet_size;
+    int iteration;             /* Iterations completed */
+    PROB beta;                 /* Of deterministic annealing */
+    PROB loglikelihood;        /* Of the last iteration */
+    unsigned short rand48[3];  /* drand48() state */
+    char randstate[CHECKPOINT_RANDSTATE];     /* random() state */
+    PROB *weights, *weights2;  /* As read: WFSA transitions and final weights, */
+    size_t num_weights;        /* HMM transitions and emissions               */
+    size_t num_weights2;
+    int burnin, lag, samplecount;              /* Gibbs sampler */
+    int *chain;                                /* States of the Gibbs chain */
+    int chain_length;
+    int num_count_tables;
+    unsigned int *count_tables[CHECKPOINT_MAX_TABLES];
+    size_t count_sizes[CHECKPOINT_MAX_TABLES];
+    int heldout_iter;          /* --heldout: iteration of the best model, 0 if none */
+    int heldout_waiting;       /* Iterations since the best */
+    PROB heldout_bestll, heldout_trainll;
+    void *heldout_best;        /* Best model (a struct wfsa or hmm), when saving */
+    PROB *heldout_weights, *heldout_weights2;  /* and its weights, as read */
+    size_t num_heldout_weights;
+    size_t num_heldout_weights2;
+};
+
+void checkpoint_start(int algorithm);
+int checkpoint_due(int iteration);
+void checkpoint_save(struct checkpoint *c, struct wfsa *fsm, struct hmm *hmm);
+void checkpoint_finish(void);
+struct checkpoint *checkpoint_read(char *filename);
+void checkpoint_restore_model(struct checkpoint *c, struct wfsa **fsm, struct hmm **hmm);
+void checkpoint_restore_rng(struct checkpoint *c);
+void checkpoint_restore_heldout(struct checkpoint *c, struct wfsa *fsm, struct hmm *hmm);
+void checkpoint_destroy(struct checkpoint *c);
+
+/* quant.c */
+
+struct qtable {
+    int bits;          /* 8 or 16 */
+    int num_rows;
+    int row_len;
+    void *codes;       /* num_rows x row_len codes, 0 = zero weight */
+    float *scale;      /* Per row: weight of code c > 0 is offset + (c-1) * scale */
+    float *offset;
+};
+
+struct qmodel {
+    int num_states;
+    int alphabet_size;
+    int use_hmm;
+    struct qtable arcs;  /* WFSA: rows (source, symbol); HMM: transitions by source */
+    struct qtable emit;  /* HMM only: emissions by symbol */
+    PROB *final;         /* WFSA final weights, not quantized */
+};
+
+struct qmodel *quant_read_file(char *filename, int use_hmm, int bits, PROB *maxerr, size_t *bytes);
+void quant_destroy(struct qmodel *qm);
+PROB quant_score(struct qmodel *qm, struct trellis *trellis, int *obs, int length, int viterbi);
+void quant_likelihood(char *filename, int use_hmm, struct observations *o, int algorithm, int bits, int check);
+
+/* jit.c */
+
+struct jit_scorer {
+    void *handle;
+    PROB (*forward)(int *obs, int length);
+    PROB (*viterbi)(int *obs, int length);
+};
+
+char *jit_default_cachedir(void);
+struct jit_scorer *jit_scorer_fsm(struct wfsa *fsm, char *cachedir);
+struct jit_scorer *jit_scorer_hmm(struct hmm *hmm, char *cachedir);
+void jit_scorer_destroy(struct jit_scorer *js);
+
+/* multi.c */
+
+#define MULTI_ALL               1 /* Print likelihoods under all models   */
+#define MULTI_ARGMAX            2 /* Print best model and its likelihood  */
+
+struct multi_models {
+    int num_models;
+    int use_hmm;
+    struct wfsa **fsms;
+    struct hmm **hmms;
+    struct observations *o;
+};
+
+char **multi_files_add(char **files, int *num_files, char *arg);
+struct multi_models *multi_models_read(char **files, int num_files, int use_hmm);
+void multi_likelihood(struct multi_models *mm, struct observations *o, int algorithm, int output, int batch);
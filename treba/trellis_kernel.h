@@ -0,0 +1,265 @@
+/**************************************************************************/
+/*   treba - probabilistic FSM and HMM training and decoding              */
+/*   Copyright © 2013 Mans Hulden                                         */
+
+/*   This file is part of treba.                                          */
+
+/*   Treba is free software: you can redistribute it and/or modify        */
+/*   it under the terms of the GNU General Public License version 2 as    */
+/*   published by the Free Software Foundation.                           */
+
+/*   Treba is distributed in the hope that it will be useful,             */
+/*   but WITHOUT ANY WARRANTY; without even the implied warranty of       */
+/*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        */
+/*   GNU General Public License for more details.                         */
+
+/*   You should have received a copy of the GNU General Public License    */
+/*   along with treba.  If not, see <http://www.gnu.org/licenses/>.       */
+/**************************************************************************/
+
+/* Semiring-generic trellis engine.                                         */
+/*                                                                          */
+/* This file is a template: it is included from treba.c once per semiring   */
+/* with one of SEMIRING_LOG, SEMIRING_MAX, SEMIRING_REAL defined (see       */
+/* semiring.h), and produces                                                */
+/*                                                                          */
+/*   trellis_forward_fsm_<suffix>()   trellis_forward_hmm_<suffix>()        */
+/*   trellis_backward_fsm_<suffix>()  trellis_backward_hmm_<suffix>()       */
+/*                                                                          */
+/* The backward kernels are only generated if TRELLIS_KERNEL_BACKWARD is    */
+/* defined. If TARGET_AVX2 or TARGET_AVX512 is defined, the functions are   */
+/* compiled for that instruction set and get an additional _avx2/_avx512    */
+/* suffix; the variant to use is picked at startup (see cpu_detect()).      */
+/*                                                                          */
+/* Forward kernels fill ->fp (and ->backstate for selective semirings),     */
+/* backward kernels fill ->bp. All return a log2 probability, SMRZERO_LOG   */
+/* if the observation cannot be generated.                                  */
+/*                                                                          */
+/* The forward kernels are wrappers around trellis_bounded_fsm/hmm_<suffix> */
+/* which, given suffix[] (suffix[i] an upper bound on the log2 weight of    */
+/* obs[i] ... obs[length-1] read from any state, including the final/end    */
+/* weight), stop as soon as the total of a column plus the bound for the    */
+/* rest of the observation falls below threshold, and return that bound.    */
+/* With suffix == NULL the whole trellis is computed.                       */
+/*                                                                          */
+/* Trellis layout (columns 0 ... length+1):                                 */
+/*   WFSA: column i+1 is reached from column i on symbol obs[i]; column     */
+/*         length+1 holds column length times the final weight of a state.  */
+/*   HMM:  column 0 is the non-emitting initial state 0, column i+1 holds   */
+/*         the states emitting obs[i], and column length+1 the non-emitting */
+/*         end state num_states-1.                                          */
+
+#include "semiring.h"
+
+/* Log2 of the (+)-total of a finished column, for early abandonment */
+#define SR_COLUMN_BOUND(DST,COL,N) do {				\
+	struct trellis *sr_bcol = (COL);				\
+	PROB sr_total = SR_ZERO;					\
+	int sr_j;							\
+	for (sr_j = 0; sr_j < (N); sr_j++)				\
+	    if (sr_bcol[sr_j].fp != SR_ZERO)				\
+		SR_PLUS(sr_total, sr_bcol[sr_j].fp);			\
+	(DST) = SR_TO_LOG(sr_total);					\
+    } while (0)
+
+#define TK_CAT2(A,B) A##_##B
+#define TK_CAT(A,B)  TK_CAT2(A,B)
+
+#if defined(TARGET_AVX512)
+ #define TK_FN(NAME) TK_CAT(TK_CAT(NAME, SR_SUFFIX), avx512)
+ #define TK_ATTR     CPU_ATTR_AVX512
+#elif defined(TARGET_AVX2)
+ #define TK_FN(NAME) TK_CAT(TK_CAT(NAME, SR_SUFFIX), avx2)
+ #define TK_ATTR     CPU_ATTR_AVX2
+#else
+ #define TK_FN(NAME) TK_CAT(NAME, SR_SUFFIX)
+ #define TK_ATTR
+#endif
+
+TK_ATTR PROB TK_FN(trellis_bounded_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm, PROB *suffix, PROB threshold) {
+    int i, sourcestate, targetstate, symbol, final_state;
+    PROB target_prob, source_prob, final_prob, bound;
+    SR_LOCALS
+
+    if (suffix != NULL && suffix[0] < threshold)
+	return(suffix[0]);
+
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++)
+	    TRELLIS_CELL(sourcestate,i)->fp = SR_ZERO;
+
+    TRELLIS_CELL(0,0)->fp = SR_ONE;
+    for (i = 0; i < length; i++) {
+	symbol = obs[i];
+	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++) {
+	    source_prob = TRELLIS_CELL(sourcestate,i)->fp;
+	    if (source_prob == SR_ZERO) { continue; }
+	    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
+		target_prob = *TRANSITION(fsm, sourcestate, symbol, targetstate);
+		if (target_prob <= SMRZERO_LOG) { continue; }
+		SR_ACCUM(TRELLIS_CELL(targetstate,i+1)->fp, TRELLIS_CELL(targetstate,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(target_prob)), sourcestate);
+	    }
+	}
+	SR_COLUMN_END(TRELLIS_CELL(0,i+1), fsm->num_states, fp);
+	if (suffix != NULL) {
+	    SR_COLUMN_BOUND(bound, TRELLIS_CELL(0,i+1), fsm->num_states);
+	    if (bound <= SMRZERO_LOG || bound + suffix[i+1] < threshold)
+		return(bound <= SMRZERO_LOG ? SMRZERO_LOG : bound + suffix[i+1]);
+	}
+    }
+
+    /* Final state probabilities: only the best final state keeps a */
+    /* backpointer (to itself) in column length+1                   */
+    i = length;
+    final_prob = SR_ZERO;
+    final_state = -1;
+    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
+	TRELLIS_CELL(targetstate,i+1)->backstate = -1;
+	if (TRELLIS_CELL(targetstate,i)->fp == SR_ZERO) { continue; }
+	if (*FINALPROB(fsm, targetstate) <= SMRZERO_LOG) { continue; }
+	TRELLIS_CELL(targetstate,i+1)->fp = SR_TIMES(TRELLIS_CELL(targetstate,i)->fp, SR_WEIGHT(*FINALPROB(fsm, targetstate)));
+	SR_ACCUM(final_prob, final_state, TRELLIS_CELL(targetstate,i+1)->fp, targetstate);
+    }
+    if (final_state >= 0) {
+	TRELLIS_CELL(final_state,i+1)->backstate = final_state;
+    }
+    return(SR_TO_LOG(final_prob));
+}
+
+TK_ATTR PROB TK_FN(trellis_forward_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
+    return(TK_FN(trellis_bounded_fsm)(trellis, obs, length, fsm, NULL, 0));
+}
+
+TK_ATTR PROB TK_FN(trellis_bounded_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm, PROB *suffix, PROB threshold) {
+    int i, sourcestate, targetstate, end_state;
+    PROB target_prob, source_prob, bound, *emission;
+    SR_LOCALS
+
+    if (suffix != NULL && suffix[0] < threshold)
+	return(suffix[0]);
+
+    end_state = hmm->num_states - 1;
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < hmm->num_states; sourcestate++)
+	    TRELLIS_CELL_HMM(sourcestate,i)->fp = SR_ZERO;
+
+    TRELLIS_CELL_HMM(0,0)->fp = SR_ONE;
+    for (i = 0; i < length; i++) {
+	emission = HMM_EMISSION_COLUMN(hmm, obs[i]);
+	for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	    source_prob = TRELLIS_CELL_HMM(sourcestate,i)->fp;
+	    if (source_prob == SR_ZERO) { continue; }
+	    for (targetstate = 1; targetstate < end_state; targetstate++) {
+		target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate) + emission[targetstate];
+		if (target_prob <= SMRZERO_LOG) { continue; }
+		SR_ACCUM(TRELLIS_CELL_HMM(targetstate,i+1)->fp, TRELLIS_CELL_HMM(targetstate,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(target_prob)), sourcestate);
+	    }
+	}
+	SR_COLUMN_END(TRELLIS_CELL_HMM(0,i+1), hmm->num_states, fp);
+	if (suffix != NULL) {
+	    SR_COLUMN_BOUND(bound, TRELLIS_CELL_HMM(0,i+1), hmm->num_states);
+	    if (bound <= SMRZERO_LOG || bound + suffix[i+1] < threshold)
+		return(bound <= SMRZERO_LOG ? SMRZERO_LOG : bound + suffix[i+1]);
+	}
+    }
+
+    /* Transition into the end state */
+    i = length;
+    for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	source_prob = TRELLIS_CELL_HMM(sourcestate,i)->fp;
+	if (source_prob == SR_ZERO) { continue; }
+	target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, end_state);
+	if (target_prob <= SMRZERO_LOG) { continue; }
+	SR_ACCUM(TRELLIS_CELL_HMM(end_state,i+1)->fp, TRELLIS_CELL_HMM(end_state,i+1)->backstate, SR_TIMES(source_prob, SR_WEIGHT(target_prob)), sourcestate);
+    }
+    return(SR_TO_LOG(TRELLIS_CELL_HMM(end_state,i+1)->fp));
+}
+
+TK_ATTR PROB TK_FN(trellis_forward_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
+    return(TK_FN(trellis_bounded_hmm)(trellis, obs, length, hmm, NULL, 0));
+}
+
+#ifdef TRELLIS_KERNEL_BACKWARD
+
+TK_ATTR PROB TK_FN(trellis_backward_fsm)(struct trellis *trellis, int *obs, int length, struct wfsa *fsm) {
+    int i, sourcestate, targetstate, symbol;
+    PROB target_prob, next_prob;
+    SR_LOCALS
+
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++)
+	    TRELLIS_CELL(sourcestate,i)->bp = SR_ZERO;
+
+    /* Fill last and penultimate column */
+    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
+	TRELLIS_CELL(targetstate,length+1)->bp = SR_ONE;
+	if (*FINALPROB(fsm, targetstate) > SMRZERO_LOG)
+	    TRELLIS_CELL(targetstate,length)->bp = SR_WEIGHT(*FINALPROB(fsm, targetstate));
+    }
+    for (i = length-1; i >= 0 ; i--) {
+	symbol = obs[i];
+	for (sourcestate = 0; sourcestate < fsm->num_states; sourcestate++) {
+	    for (targetstate = 0; targetstate < fsm->num_states; targetstate++) {
+		target_prob = *TRANSITION(fsm, sourcestate, symbol, targetstate);
+		if (target_prob <= SMRZERO_LOG) { continue; }
+		next_prob = TRELLIS_CELL(targetstate,i+1)->bp;
+		if (next_prob == SR_ZERO) { continue; }
+		SR_PLUS(TRELLIS_CELL(sourcestate,i)->bp, SR_TIMES(next_prob, SR_WEIGHT(target_prob)));
+	    }
+	}
+	SR_COLUMN_END(TRELLIS_CELL(0,i), fsm->num_states, bp);
+    }
+    return(SR_TO_LOG(TRELLIS_CELL(0,0)->bp));
+}
+
+TK_ATTR PROB TK_FN(trellis_backward_hmm)(struct trellis *trellis, int *obs, int length, struct hmm *hmm) {
+    int i, sourcestate, targetstate, end_state;
+    PROB target_prob, next_prob, *emission;
+    SR_LOCALS
+
+    end_state = hmm->num_states - 1;
+    for (i = 0; i <= length + 1; i++)
+	for (sourcestate = 0; sourcestate < hmm->num_states; sourcestate++)
+	    TRELLIS_CELL_HMM(sourcestate,i)->bp = SR_ZERO;
+
+    /* Fill last and penultimate column */
+    TRELLIS_CELL_HMM(end_state,length+1)->bp = SR_ONE;
+    for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, end_state);
+	if (target_prob > SMRZERO_LOG)
+	    TRELLIS_CELL_HMM(sourcestate,length)->bp = SR_WEIGHT(target_prob);
+    }
+    for (i = length-1; i >= 0 ; i--) {
+	emission = HMM_EMISSION_COLUMN(hmm, obs[i]);
+	for (sourcestate = 0; sourcestate < end_state; sourcestate++) {
+	    if (sourcestate == 0 && i != 0) { continue; }
+	    for (targetstate = 1; targetstate < end_state; targetstate++) {
+		target_prob = *HMM_TRANSITION_PROB(hmm, sourcestate, targetstate) + emission[targetstate];
+		if (target_prob <= SMRZERO_LOG) { continue; }
+		next_prob = TRELLIS_CELL_HMM(targetstate,i+1)->bp;
+		if (next_prob == SR_ZERO) { continue; }
+		SR_PLUS(TRELLIS_CELL_HMM(sourcestate,i)->bp, SR_TIMES(next_prob, SR_WEIGHT(target_prob)));
+	    }
+	}
+	SR_COLUMN_END(TRELLIS_CELL_HMM(0,i), hmm->num_states, bp);
+    }
+    return(SR_TO_LOG(TRELLIS_CELL_HMM(0,0)->bp));
+}
+
+#endif /* TRELLIS_KERNEL_BACKWARD */
+
+#undef TK_CAT2
+#undef TK_CAT
+#undef TK_FN
+#undef TK_ATTR
+#undef SR_SUFFIX
+#undef SR_ZERO
+#undef SR_ONE
+#undef SR_WEIGHT
+#undef SR_TIMES
+#undef SR_PLUS
+#undef SR_ACCUM
+#undef SR_LOCALS
+#undef SR_COLUMN_END
+#undef SR_TO_LOG
+#undef SR_COLUMN_BOUND